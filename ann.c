@@ -1,21 +1,98 @@
 #define LUA_LIB
 
-#include <lua.h>
-#include <lauxlib.h>
+#include "ann.h"
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <limits.h>
 
-struct signal {
+// Tape : the ops recorded by ann.record(), see the end of this file.
+
+enum {
+	OP_ACCUMULATE,
+	OP_SIGMOID,
+	OP_RELU,
+	OP_PROP,
+	OP_BACKPROP_WEIGHT,
+	OP_BACKPROP_BIAS,
+	OP_BACKPROP_SIGMOID,
+	OP_BACKPROP_RELU,
+	OP_SOFTMAX_ERROR,
+	OP_CONVOLUTION,
+	OP_CONVPOOL,
+	OP_MAXPOOLING,
+	OP_MAXPOOLING_ARGMAX,
+	OP_BACKPROP_CONV_BIAS,
+	OP_BACKPROP_MAXPOOLING,
+	OP_BACKPROP_MAXPOOLING_ARGMAX,
+	OP_BACKPROP_CONV_WEIGHT,
+	OP_BACKPROP_CONV_INPUT,
+	OP_PARAMS_ZERO,
+	OP_PARAMS_ACCUMULATE,
+	OP_PROP_LOWRANK,
+	OP_BACKPROP_LOWRANK,
+	OP_BACKPROP_BIAS_LOWRANK,
+	OP_PROP_SPARSE,
+	OP_CONVPOOL_ARGMAX,
+	OP_BACKPROP_CONV_WEIGHT_ARGMAX,
+};
+
+// tensors are bound by the address of their data pointer, so a tape follows them into ann.params
+struct instruction {
+	int op;
 	int n;
-	float data[1];
+	float eta;
+	void *arg[4];
+};
+
+static atomic_int recording;
+
+static int tape_recording(lua_State *L);
+static struct instruction * record_op(lua_State *L, int op, int nargs);
+
+// NULL when this lua_State isn't recording, it costs one atomic load when no one records.
+#define RECORD(L, op, nargs) (atomic_load_explicit(&recording, memory_order_relaxed) ? record_op(L, op, nargs) : NULL)
+
+// Backend : the hot kernels are dispatched through B, see ann.backend() near the end of this file.
+
+struct filter;
+
+struct backend {
+	const char *name;
+	void (*accumulate)(float *s, const float *delta, int n, float eta);
+	void (*sigmoid)(float *s, int n);
+	void (*relu)(float *s, int n);
+	void (*prop)(const float *input, float *output, const float *c, int w, int h);
+	void (*backprop_weight)(const float *source, const float *delta, float *nabla, int w, int h);
+	void (*backprop_bias)(float *output, const float *delta, const float *c, int w, int h);
+	void (*backprop_sigmoid)(const float *s, float *input, int n);
+	void (*backprop_relu)(const float *s, float *input, int n);
+	void (*softmax_error)(const float *a, const float *b, float *output, int n);
+	void (*convolution)(struct filter *f, const float *input, float *output);
+	void (*convpool)(struct filter *f, const float *input, float *output);
+	void (*maxpooling)(struct filter *f, const float *src, float *output);
+	void (*backprop_conv_weight)(struct filter *f, const float *input, const float *delta);
+	void (*maxpooling_argmax)(struct filter *f, const float *src, float *output, int *index);
+	void (*convpool_argmax)(struct filter *f, const float *input, float *output, int *index);
+	void (*backprop_maxpooling)(struct filter *f, float *conv, const float *delta);
+	void (*backprop_conv_weight_argmax)(struct filter *f, const float *input, const float *delta, const int *index);
+	void (*backprop_conv_input)(struct filter *f, const float *delta, float *input);
+	void (*backprop_conv_bias)(struct filter *f, const float *delta, int size);
+	void (*maxpooling_scatter)(const float *delta, const int *index, int n, float *conv, int conv_n);
 };
 
-static inline struct signal *
-check_signal(lua_State *L, int index) {
-	return (struct signal *)luaL_checkudata(L, index, "ANN_SIGNAL");
+static const struct backend *B;
+
+static void
+unrecordable(lua_State *L, const char *name) {
+	if (atomic_load_explicit(&recording, memory_order_relaxed) && tape_recording(L))
+		luaL_error(L, "%s can't be recorded", name);
 }
 
 static int
@@ -37,16 +114,33 @@ lsignal_size(lua_State *L) {
 	return 1;
 }
 
+static void
+init_signal_with_bytes(struct signal *s, const uint8_t *image) {
+	int i;
+	for (i=0;i<s->n;i++) {
+		s->data[i] = image[i] / 255.0f;
+	}
+}
+
 static void
 init_signal_with_string(lua_State *L, struct signal *s, int index) {
 	size_t sz;
 	const uint8_t * image = (const uint8_t *)luaL_checklstring(L, index, &sz);
 	if (sz != s->n)
 		luaL_error(L, "Invalid image size %d != %d", (int)sz, s->n);
-	int i;
-	for (i=0;i<s->n;i++) {
-		s->data[i] = image[i] / 255.0f;
-	}
+	init_signal_with_bytes(s, image);
+}
+
+// list[i] (at the top) is a pointer : list.stride is the bytes of an item, it must match the signal
+static const uint8_t *
+check_item_bytes(lua_State *L, struct signal *s, int list) {
+	if (lua_getfield(L, list, "stride") != LUA_TNUMBER)
+		luaL_error(L, "A list of pointers needs .stride");
+	lua_Integer stride = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (stride != s->n)
+		luaL_error(L, "Invalid image size %d != %d", (int)stride, s->n);
+	return (const uint8_t *)lua_touserdata(L, -1);
 }
 
 static void
@@ -71,6 +165,35 @@ init_signal_n(lua_State *L, struct signal *s, int n) {
 	s->data[n] = 1.0f;
 }
 
+// init s with list[i] : an image string or pointer, a label or a signal. returns 0 at the end of the list
+static int
+init_signal_with_item(lua_State *L, struct signal *s, int list, lua_Integer i) {
+	switch (lua_geti(L, list, i)) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		return 0;
+	case LUA_TSTRING:
+		init_signal_with_string(L, s, -1);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		init_signal_with_bytes(s, check_item_bytes(L, s, list));
+		break;
+	case LUA_TNUMBER:
+		init_signal_n(L, s, lua_tointeger(L, -1));
+		break;
+	default: {
+		struct signal *src = check_signal(L, -1);
+		if (src->n != s->n)
+			luaL_error(L, "Invalid feed size %d != %d", src->n, s->n);
+		memcpy(s->data, src->data, s->n * sizeof(float));
+		break;
+	}
+	}
+	lua_pop(L, 1);
+	return 1;
+}
+
+// signal:init(v) ; signal:init(pointer, bytes) ; signal:init(list, i), such as the ds:images() view of mnist
 static int
 lsignal_init(lua_State *L) {
 	struct signal * s = check_signal(L, 1);
@@ -78,12 +201,29 @@ lsignal_init(lua_State *L) {
 	case LUA_TSTRING:
 		init_signal_with_string(L, s, 2);
 		break;
+	case LUA_TLIGHTUSERDATA: {
+		// n bytes of pixels from an external buffer, the size is required
+		lua_Integer sz = luaL_checkinteger(L, 3);
+		if (sz != s->n)
+			return luaL_error(L, "Invalid image size %d != %d", (int)sz, s->n);
+		init_signal_with_bytes(s, (const uint8_t *)lua_touserdata(L, 2));
+		break;
+	}
 	case LUA_TNUMBER:
 		init_signal_n(L, s, luaL_checkinteger(L, 2));
 		break;
 	case LUA_TTABLE:
-		init_signal_with_table(L, s, 2);
+		if (lua_isnoneornil(L, 3)) {
+			init_signal_with_table(L, s, 2);
+			break;
+		}
+		// fall through
+	case LUA_TUSERDATA: {
+		lua_Integer i = luaL_checkinteger(L, 3);
+		if (!init_signal_with_item(L, s, 2, i))
+			return luaL_error(L, "Out of range %d", (int)i);
 		break;
+	}
 	case LUA_TNIL:
 	case LUA_TNONE:
 		memset(s->data, 0, sizeof(s->data[0]) * s->n);
@@ -114,23 +254,35 @@ lsignal_max(lua_State *L) {
 	return 2;
 }
 
+static void
+signal_accumulate(float *s, const float *delta, int n, float eta) {
+	int i;
+	if (eta != 1.0f) {
+		for (i=0;i<n;i++) {
+			s[i] += delta[i] * eta;
+		}
+	} else {
+		for (i=0;i<n;i++) {
+			s[i] += delta[i];
+		}
+	}
+}
+
 static int
 lsignal_accumulate(lua_State *L) {
 	struct signal * s = check_signal(L, 1);
 	struct signal * delta = check_signal(L, 2);
 	if (s->n != delta->n)
 		return luaL_error(L, "signal size %d != %d", s->n, delta->n);
-	int i;
-	if (lua_type(L, 3) == LUA_TNUMBER) {
-		float eta = lua_tonumber(L, 3);
-		for (i=0;i<s->n;i++) {
-			s->data[i] += delta->data[i] * eta;
-		}
-	} else {
-		for (i=0;i<s->n;i++) {
-			s->data[i] += delta->data[i];
-		}
+	float eta = lua_type(L, 3) == LUA_TNUMBER ? lua_tonumber(L, 3) : 1.0f;
+	struct instruction *ins = RECORD(L, OP_ACCUMULATE, 2);
+	if (ins) {
+		ins->n = s->n;
+		ins->eta = eta;
+		ins->arg[0] = &s->data;
+		ins->arg[1] = &delta->data;
 	}
+	B->accumulate(s->data, delta->data, s->n, eta);
 	lua_settop(L, 1);
 	return 1;
 }
@@ -140,13 +292,32 @@ sigmoid(float z) {
 	return 1.0f / (1.0f + expf(-z));
 }
 
+static void
+signal_sigmoid(float *s, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		s[i] = sigmoid(s[i]);
+	}
+}
+
+static void
+signal_relu(float *s, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		if (s[i] < 0)
+			s[i] = 0;
+	}
+}
+
 static int
 lsignal_sigmoid(lua_State *L) {
 	struct signal * s = check_signal(L, 1);
-	int i;
-	for (i=0;i<s->n;i++) {
-		s->data[i] = sigmoid(s->data[i]);
+	struct instruction *ins = RECORD(L, OP_SIGMOID, 1);
+	if (ins) {
+		ins->n = s->n;
+		ins->arg[0] = &s->data;
 	}
+	B->sigmoid(s->data, s->n);
 	lua_settop(L, 1);
 	return 1;
 }
@@ -154,11 +325,12 @@ lsignal_sigmoid(lua_State *L) {
 static int
 lsignal_relu(lua_State *L) {
 	struct signal * s = check_signal(L, 1);
-	int i;
-	for (i=0;i<s->n;i++) {
-		if (s->data[i] < 0)
-			s->data[i] = 0;
+	struct instruction *ins = RECORD(L, OP_RELU, 1);
+	if (ins) {
+		ins->n = s->n;
+		ins->arg[0] = &s->data;
 	}
+	B->relu(s->data, s->n);
 	lua_settop(L, 1);
 	return 1;
 }
@@ -242,7 +414,7 @@ gaussrand(float r[2], float deviation) {
 static void
 randn(float *f, int n, float deviation) {
 	int i;
-	for (i=0;i<n;i+=2) {
+	for (i=0;i+1<n;i+=2) {
 		gaussrand(f+i, deviation);
 	}
 	if (n & 1) {
@@ -255,19 +427,116 @@ randn(float *f, int n, float deviation) {
 static int
 lsignal_randn(lua_State *L) {
 	struct signal *s = check_signal(L, 1);
+	unrecordable(L, "signal:randn");
 	float deviation = luaL_optnumber(L, 2, 1.0f);
 	randn(s->data, s->n, deviation);
 	lua_settop(L, 1);
 	return 1;
 }
 
+// Bulk interop : raw float32 in one memcpy, from/to a string or an external buffer (lightuserdata).
+
+static float ** tensor_data(lua_State *L, int index, int *n);
+
 static int
-lsignal(lua_State *L) {
-	int n = luaL_checkinteger(L, 1);
-	size_t sz = sizeof(struct signal) + sizeof(float) * (n-1);
-	struct signal * s = (struct signal *)lua_newuserdatauv(L, sz, 0);
-	memset(s->data, 0, sizeof(s->data[0]) * n);
+ltensor_bytes(lua_State *L) {
+	int n;
+	float **data = tensor_data(L, 1, &n);
+	lua_pushlstring(L, (const char *)*data, n * sizeof(float));
+	return 1;
+}
+
+static int
+ltensor_pointer(lua_State *L) {
+	int n;
+	float **data = tensor_data(L, 1, &n);
+	lua_pushlightuserdata(L, *data);
+	return 1;
+}
+
+// read n floats from a string (at pos, 1-based) or a pointer (of nbytes)
+static void
+load_floats(lua_State *L, int index, float *data, int n) {
+	size_t bytes = n * sizeof(float);
+	if (lua_type(L, index) == LUA_TLIGHTUSERDATA) {
+		lua_Integer nbytes = luaL_checkinteger(L, index + 1);
+		if (nbytes < 0 || (size_t)nbytes < bytes)
+			luaL_error(L, "Need %d bytes (pointer of %d)", (int)bytes, (int)nbytes);
+		memcpy(data, lua_touserdata(L, index), bytes);
+		return;
+	}
+	size_t sz;
+	const char *src = luaL_checklstring(L, index, &sz);
+	lua_Integer pos = luaL_optinteger(L, index + 1, 1);
+	if (pos <= 0 || (size_t)pos - 1 > sz || sz - (pos - 1) < bytes)
+		luaL_error(L, "Need %d bytes at %d (size %d)", (int)bytes, (int)pos, (int)sz);
+	memcpy(data, src + pos - 1, bytes);
+}
+
+// tensor:load(string [, pos]) or tensor:load(pointer, nbytes)
+static int
+ltensor_load(lua_State *L) {
+	int n;
+	float **data = tensor_data(L, 1, &n);
+	unrecordable(L, "load");
+	load_floats(L, 2, *data, n);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static void signal_meta(lua_State *L);
+static void weight_meta(lua_State *L);
+
+// a view shares the storage of the tensor at owner (don't move either into ann.params after)
+static struct signal *
+new_signal_view(lua_State *L, int owner, float *data, int n) {
+	struct signal *s = (struct signal *)lua_newuserdatauv(L, sizeof(struct signal), 1);
 	s->n = n;
+	s->data = data;
+	signal_meta(L);
+	lua_pushvalue(L, owner);
+	lua_setiuservalue(L, -2, 1);
+	return s;
+}
+
+static struct weight *
+new_weight_view(lua_State *L, int owner, float *data, int w, int h) {
+	struct weight *v = (struct weight *)lua_newuserdatauv(L, sizeof(struct weight), 1);
+	v->w = w;
+	v->h = h;
+	v->data = data;
+	weight_meta(L);
+	lua_pushvalue(L, owner);
+	lua_setiuservalue(L, -2, 1);
+	return v;
+}
+
+// signal:slice(from [, to]) : a view of [from, to], 1-based like string.sub
+static int
+lsignal_slice(lua_State *L) {
+	struct signal *s = check_signal(L, 1);
+	int from = luaL_checkinteger(L, 2);
+	int to = luaL_optinteger(L, 3, s->n);
+	if (from <= 0 || to > s->n || from > to)
+		return luaL_error(L, "Invalid slice [%d, %d] of %d", from, to, s->n);
+	new_signal_view(L, 1, s->data + from - 1, to - from + 1);
+	return 1;
+}
+
+// signal:reshape(w, h) : a weight view
+static int
+lsignal_reshape(lua_State *L) {
+	struct signal *s = check_signal(L, 1);
+	int w = luaL_checkinteger(L, 2);
+	int h = luaL_checkinteger(L, 3);
+	if (w <= 0 || h <= 0 || w * h != s->n)
+		return luaL_error(L, "Invalid reshape %d * %d != %d", w, h, s->n);
+	new_weight_view(L, 1, s->data, w, h);
+	return 1;
+}
+
+static void
+signal_meta(lua_State *L) {
 	if (luaL_newmetatable(L, "ANN_SIGNAL")) {
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
@@ -281,30 +550,35 @@ lsignal(lua_State *L) {
 			{ "accumulate", lsignal_accumulate },
 			{ "sigmoid", lsignal_sigmoid },
 			{ "relu", lsignal_relu },
+			{ "bytes", ltensor_bytes },
+			{ "load", ltensor_load },
+			{ "pointer", ltensor_pointer },
+			{ "slice", lsignal_slice },
+			{ "reshape", lsignal_reshape },
 			{ "__tostring", lsignal_dump },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
 	}
 	lua_setmetatable(L, -2);
-
-	return 1;
 }
 
-struct weight {
-	int w;
-	int h;
-	float data[1];
-};
-
-static inline struct weight *
-check_weight(lua_State *L, int index) {
-	return (struct weight *)luaL_checkudata(L, index, "ANN_WEIGHT");
+static int
+lsignal(lua_State *L) {
+	int n = luaL_checkinteger(L, 1);
+	size_t sz = sizeof(struct signal) + sizeof(float) * (n-1);
+	struct signal * s = (struct signal *)lua_newuserdatauv(L, sz, 1);
+	s->data = s->buffer;
+	memset(s->data, 0, sizeof(s->data[0]) * n);
+	s->n = n;
+	signal_meta(L);
+	return 1;
 }
 
 static int
 lweight_zero(lua_State *L) {
 	struct weight *w = check_weight(L, 1);
+	unrecordable(L, "weight:zero");
 	int s = w->w * w->h;
 	memset(w->data, 0, sizeof(w->data[0]) * s);
 	lua_settop(L, 1);
@@ -322,6 +596,7 @@ lweight_size(lua_State *L) {
 static int
 lweight_randn(lua_State *L) {
 	struct weight *w = check_weight(L, 1);
+	unrecordable(L, "weight:randn");
 	float deviation = luaL_optnumber(L, 2, 1.0f);
 	randn(w->data, w->w * w->h, deviation);
 	lua_settop(L, 1);
@@ -355,21 +630,12 @@ lweight_dump(lua_State *L) {
 static int
 lweight_accumulate(lua_State *L) {
 	struct weight * s = check_weight(L, 1);
+	unrecordable(L, "weight:accumulate");
 	struct weight * delta = check_weight(L, 2);
 	if (s->w != delta->w || s->h != delta->h)
 		return luaL_error(L, "weight size (%d, %d) != (%d, %d)", s->w, s->h, delta->w, delta->h);
-	int i;
-	int sz = s->w * s->h;
-	if (lua_type(L, 3) == LUA_TNUMBER) {
-		float eta = lua_tonumber(L, 3);
-		for (i=0;i<sz;i++) {
-			s->data[i] += delta->data[i] * eta;
-		}
-	} else {
-		for (i=0;i<sz;i++) {
-			s->data[i] += delta->data[i];
-		}
-	}
+	float eta = lua_type(L, 3) == LUA_TNUMBER ? lua_tonumber(L, 3) : 1.0f;
+	B->accumulate(s->data, delta->data, s->w * s->h, eta);
 	lua_settop(L, 1);
 	return 1;
 }
@@ -377,6 +643,7 @@ lweight_accumulate(lua_State *L) {
 static int
 lweight_import(lua_State *L) {
 	struct weight * w = check_weight(L, 1);
+	unrecordable(L, "weight:import");
 	luaL_checktype(L, 2, LUA_TTABLE);
 	int i,j;
 	float *data = w->data;
@@ -400,147 +667,560 @@ lweight_import(lua_State *L) {
 }
 
 static int
-lweight(lua_State *L) {
-	int width = luaL_checkinteger(L, 1);
-	int height = luaL_checkinteger(L, 2);
-	int s = width * height;
-	size_t sz = sizeof(struct weight) + sizeof(float) * (s-1);
-	struct weight * w = (struct weight *)lua_newuserdatauv(L, sz, 0);
-	w->w = width;
-	w->h = height;
+lweight_export(lua_State *L) {
+	struct weight * w = check_weight(L, 1);
+	lua_createtable(L, w->h, 0);
+	int i,j;
+	const float *data = w->data;
+	for (i=0;i<w->h;i++) {
+		lua_createtable(L, w->w, 0);
+		for (j=0;j<w->w;j++) {
+			lua_pushnumber(L, *data);
+			lua_rawseti(L, -2, j+1);
+			++data;
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+// weight:row(i) : a signal view of the i-th (1-based) row
+static int
+lweight_row(lua_State *L) {
+	struct weight *w = check_weight(L, 1);
+	int i = luaL_checkinteger(L, 2);
+	if (i <= 0 || i > w->h)
+		return luaL_error(L, "Invalid row %d [1, %d]", i, w->h);
+	new_signal_view(L, 1, w->data + (i - 1) * w->w, w->w);
+	return 1;
+}
+
+static int
+lweight_reshape(lua_State *L) {
+	struct weight *w = check_weight(L, 1);
+	int width = luaL_checkinteger(L, 2);
+	int height = luaL_checkinteger(L, 3);
+	if (width <= 0 || height <= 0 || width * height != w->w * w->h)
+		return luaL_error(L, "Invalid reshape %d * %d != %d * %d", width, height, w->w, w->h);
+	new_weight_view(L, 1, w->data, width, height);
+	return 1;
+}
+
+static int
+lweight_flatten(lua_State *L) {
+	struct weight *w = check_weight(L, 1);
+	new_signal_view(L, 1, w->data, w->w * w->h);
+	return 1;
+}
+
+static int
+float_less(const void *a, const void *b) {
+	float x = *(const float *)a;
+	float y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+// weight:prune(sparsity) : zero the smallest magnitudes, returns the threshold and the number of zeros
+static int
+lweight_prune(lua_State *L) {
+	struct weight *w = check_weight(L, 1);
+	unrecordable(L, "weight:prune");
+	float sparsity = luaL_checknumber(L, 2);
+	if (!(sparsity >= 0 && sparsity <= 1))
+		return luaL_error(L, "Invalid sparsity %f", sparsity);
+	int n = w->w * w->h;
+	int k = (int)(sparsity * n);
+	float threshold = 0;
+	if (k > 0) {
+		// the scratch is a userdata, so it raises a memory error instead of returning NULL
+		float *m = (float *)lua_newuserdatauv(L, n * sizeof(float), 0);
+		int i;
+		for (i=0;i<n;i++)
+			m[i] = fabsf(w->data[i]);
+		qsort(m, n, sizeof(float), float_less);
+		threshold = m[k-1];
+		lua_pop(L, 1);
+	}
+	int i, zero = 0;
+	for (i=0;i<n;i++) {
+		if (fabsf(w->data[i]) <= threshold) {
+			w->data[i] = 0;
+			++zero;
+		}
+	}
+	lua_pushnumber(L, threshold);
+	lua_pushinteger(L, zero);
+	return 2;
+}
+
+static void
+weight_meta(lua_State *L) {
 	if (luaL_newmetatable(L, "ANN_WEIGHT")) {
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
 		luaL_Reg l[] = {
 			{ "import", lweight_import },
+			{ "export", lweight_export },
 			{ "zero", lweight_zero },
 			{ "randn", lweight_randn },
 			{ "size", lweight_size },
 			{ "accumulate", lweight_accumulate },
+			{ "bytes", ltensor_bytes },
+			{ "load", ltensor_load },
+			{ "pointer", ltensor_pointer },
+			{ "row", lweight_row },
+			{ "reshape", lweight_reshape },
+			{ "flatten", lweight_flatten },
+			{ "prune", lweight_prune },
 			{ "__tostring", lweight_dump },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
 	}
 	lua_setmetatable(L, -2);
-	return 1;
 }
 
 static int
-lprop(lua_State *L) {
-	struct signal * input = check_signal(L, 1);
-	struct signal * output = check_signal(L, 2);
-	struct weight * w = check_weight(L, 3);
-	if (input->n != w->w || output->n != w->h) {
-		return luaL_error(L, "Invalid weight (%d , %d) != (%d , %d)", w->w, w->h, input->n, output->n);
-	}
+lweight(lua_State *L) {
+	int width = luaL_checkinteger(L, 1);
+	int height = luaL_checkinteger(L, 2);
+	int s = width * height;
+	size_t sz = sizeof(struct weight) + sizeof(float) * (s-1);
+	struct weight * w = (struct weight *)lua_newuserdatauv(L, sz, 1);
+	w->data = w->buffer;
+	w->w = width;
+	w->h = height;
+	weight_meta(L);
+	return 1;
+}
+
+// input(w) -----w(w,h)----> output(h)
+
+static void
+prop(const float *input, float *output, const float *c, int w, int h) {
 	int i,j;
-	const float * c = w->data;
-	for (i=0;i<output->n;i++) {
+	for (i=0;i<h;i++) {
 		float s = 0;
-		for (j=0;j<input->n;j++) {
-			s += input->data[j] * (*c);
+		for (j=0;j<w;j++) {
+			s += input[j] * (*c);
 			++c;
 		}
-		output->data[i] = s;
+		output[i] = s;
 	}
-	return 0;
 }
 
-// source(w) <----w(w,h)---- delta(h)
-
-static int
-lbackprop_weight(lua_State *L) {
-	struct signal * source = check_signal(L, 1);
-	struct signal * delta = check_signal(L, 2);
-	struct weight * w = check_weight(L, 3);
-	if (source->n != w->w || delta->n != w->h) {
-		return luaL_error(L, "Invalid weight (%d , %d) != (%d, %d)", w->w, w->h, source->n, delta->n);
-	}
-	int i,j;
-	float * nabla = w->data;
-	for (i=0;i<delta->n;i++) {
-		float d = delta->data[i];
-		for (j=0;j<source->n;j++) {
-			*nabla = d * source->data[j];
-			++nabla;
+// 8 partial sums, the compiler vectorizes them. The sum order differs from prop().
+static void
+prop_simd(const float *input, float *output, const float *c, int w, int h) {
+	int i,j,k;
+	for (i=0;i<h;i++) {
+		float s[8] = { 0 };
+		for (j=0;j+8<=w;j+=8) {
+			for (k=0;k<8;k++) {
+				s[k] += input[j+k] * c[j+k];
+			}
+		}
+		float sum = ((s[0] + s[4]) + (s[1] + s[5])) + ((s[2] + s[6]) + (s[3] + s[7]));
+		for (;j<w;j++) {
+			sum += input[j] * c[j];
 		}
+		output[i] = sum;
+		c += w;
 	}
-	return 0;
 }
 
+struct kernel_args {
+	const float *input;
+	float *output;
+	const float *c;
+	int w;
+	int h;
+};
 
-// output_delta(w) <----w(w,h)----- delta(h)
-
-static int
-lbackprop_bias(lua_State *L) {
-	struct signal * output = check_signal(L, 1);
-	struct signal * delta = check_signal(L, 2);
-	struct weight * w = check_weight(L, 3);
-	if (output->n != w->w || delta->n != w->h) {
-		return luaL_error(L, "Invalid weight (%d , %d) != (%d, %d)", w->w, w->h, output->n, delta->n);
-	}
-	int i,j;
-	for (i=0;i<output->n;i++) {
-		const float * weight = &w->data[i];
-		float d = 0;
-		for (j=0;j<delta->n;j++) {
-			d += delta->data[j] * (*weight);
-			weight += w->w;
-		}
-		output->data[i] = d;
-	}
-	return 0;
+static void
+prop_part(void *ud, int from, int to) {
+	struct kernel_args *args = (struct kernel_args *)ud;
+	prop_simd(args->input, args->output + from, args->c + (size_t)from * args->w, args->w, to - from);
 }
 
-static int
-lbackprop_sigmoid(lua_State *L) {
-	struct signal * s = check_signal(L, 1);
-	struct signal * input = check_signal(L, 2);
-	if (s->n != input->n)
-		return luaL_error(L, "Invalid signal size");
-	int i;
-	for (i=0;i<s->n;i++) {
-		input->data[i] *= sigmoid_prime(s->data[i]);
-	}
-	return 0;
+static void
+prop_parallel(const float *input, float *output, const float *c, int w, int h) {
+	struct kernel_args args = { input, output, c, w, h };
+	ann_parallel(prop_part, &args, h, (size_t)w * h);
 }
 
-static int
-lbackprop_relu(lua_State *L) {
-	struct signal * s = check_signal(L, 1);
-	struct signal * input = check_signal(L, 2);
-	if (s->n != input->n)
-		return luaL_error(L, "Invalid signal size");
+// Low rank weight : W(w,h) ~= U(rank,h) * V(w,rank), input(w) --V--> t(rank) --U--> output(h).
+// data is V (rank rows of w) then U (h rows of rank), so it's one tensor in ann.params.
+struct lowrank {
+	int w;
+	int h;
+	int rank;
+	float *data;
+	float buffer[1];
+};
+
+// the rank temporaries live on the stack, ann.lowrank rejects a larger rank
+#define LOWRANK_STACK 1024
+
+static inline float *
+lowrank_v(const struct lowrank *lr) {
+	return lr->data;
+}
+
+static inline float *
+lowrank_u(const struct lowrank *lr) {
+	return lr->data + (size_t)lr->rank * lr->w;
+}
+
+static struct lowrank *
+test_lowrank(lua_State *L, int index) {
+	return (struct lowrank *)luaL_testudata(L, index, "ANN_LOWRANK");
+}
+
+static void
+lowrank_prop(const struct lowrank *lr, const float *input, float *output) {
+	float t[LOWRANK_STACK];
+	B->prop(input, t, lowrank_v(lr), lr->w, lr->rank);
+	B->prop(t, output, lowrank_u(lr), lr->rank, lr->h);
+}
+
+// output(w) = V' * U' * delta(h)
+static void
+lowrank_backprop_bias(const struct lowrank *lr, float *output, const float *delta) {
+	float dt[LOWRANK_STACK];
+	B->backprop_bias(dt, delta, lowrank_u(lr), lr->rank, lr->h);
+	B->backprop_bias(output, dt, lowrank_v(lr), lr->w, lr->rank);
+}
+
+// gradient of U and V into nabla (the same shape as lr)
+static void
+lowrank_backprop_weight(const struct lowrank *lr, const float *source, const float *delta, struct lowrank *nabla) {
+	float t[LOWRANK_STACK];
+	float dt[LOWRANK_STACK];
+	B->prop(source, t, lowrank_v(lr), lr->w, lr->rank);
+	B->backprop_bias(dt, delta, lowrank_u(lr), lr->rank, lr->h);
+	B->backprop_weight(t, delta, lowrank_u(nabla), lr->rank, lr->h);
+	B->backprop_weight(source, dt, lowrank_v(nabla), lr->w, lr->rank);
+}
+
+// CSR : gather the input of the non zeros, 4 partial sums
+
+static inline float
+sparse_dot(const int *col, const float *val, int n, const float *input) {
+	float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	int k;
+	for (k=0;k+4<=n;k+=4) {
+		a0 += val[k] * input[col[k]];
+		a1 += val[k+1] * input[col[k+1]];
+		a2 += val[k+2] * input[col[k+2]];
+		a3 += val[k+3] * input[col[k+3]];
+	}
+	for (;k<n;k++)
+		a0 += val[k] * input[col[k]];
+	return (a0 + a1) + (a2 + a3);
+}
+
+static void
+sparse_prop(const struct sparse *s, const float *input, float *output) {
 	int i;
-	for (i=0;i<s->n;i++) {
-		if (s->data[i] <= 0)
-			input->data[i] = 0;
+	for (i=0;i<s->h;i++) {
+		int from = s->row[i];
+		output[i] = sparse_dot(s->col + from, s->val + from, s->row[i+1] - from, input);
+	}
+}
+
+// 4 samples share each load of col/val
+void
+sparse_prop_batch(const struct sparse *s, const float *input, float *output, int n, const float *bias) {
+	int i,j,k;
+	int w = s->w, h = s->h;
+	for (j=0;j+4<=n;j+=4) {
+		const float *x0 = input + (size_t)j * w;
+		const float *x1 = x0 + w;
+		const float *x2 = x1 + w;
+		const float *x3 = x2 + w;
+		float *y = output + (size_t)j * h;
+		for (i=0;i<h;i++) {
+			float b = bias ? bias[i] : 0;
+			float a0 = b, a1 = b, a2 = b, a3 = b;
+			for (k=s->row[i];k<s->row[i+1];k++) {
+				float v = s->val[k];
+				int c = s->col[k];
+				a0 += v * x0[c];
+				a1 += v * x1[c];
+				a2 += v * x2[c];
+				a3 += v * x3[c];
+			}
+			y[i] = a0;
+			y[h+i] = a1;
+			y[h*2+i] = a2;
+			y[h*3+i] = a3;
+		}
+	}
+	for (;j<n;j++) {
+		const float *x = input + (size_t)j * w;
+		float *y = output + (size_t)j * h;
+		sparse_prop(s, x, y);
+		if (bias) {
+			for (i=0;i<h;i++)
+				y[i] += bias[i];
+		}
+	}
+}
+
+static struct sparse *
+test_sparse(lua_State *L, int index) {
+	return (struct sparse *)luaL_testudata(L, index, "ANN_SPARSE");
+}
+
+static int
+lprop(lua_State *L) {
+	struct signal * input = check_signal(L, 1);
+	struct signal * output = check_signal(L, 2);
+	struct lowrank * lr = test_lowrank(L, 3);
+	if (lr) {
+		if (input->n != lr->w || output->n != lr->h)
+			return luaL_error(L, "Invalid lowrank (%d , %d) != (%d , %d)", lr->w, lr->h, input->n, output->n);
+		struct instruction *ins = RECORD(L, OP_PROP_LOWRANK, 3);
+		if (ins) {
+			ins->arg[0] = &input->data;
+			ins->arg[1] = &output->data;
+			ins->arg[2] = lr;
+		}
+		lowrank_prop(lr, input->data, output->data);
+		return 0;
+	}
+	struct sparse * sw = test_sparse(L, 3);
+	if (sw) {
+		if (input->n != sw->w || output->n != sw->h)
+			return luaL_error(L, "Invalid sparse (%d , %d) != (%d , %d)", sw->w, sw->h, input->n, output->n);
+		struct instruction *ins = RECORD(L, OP_PROP_SPARSE, 3);
+		if (ins) {
+			ins->arg[0] = &input->data;
+			ins->arg[1] = &output->data;
+			ins->arg[2] = sw;
+		}
+		sparse_prop(sw, input->data, output->data);
+		return 0;
+	}
+	struct weight * w = check_weight(L, 3);
+	if (input->n != w->w || output->n != w->h) {
+		return luaL_error(L, "Invalid weight (%d , %d) != (%d , %d)", w->w, w->h, input->n, output->n);
+	}
+	struct instruction *ins = RECORD(L, OP_PROP, 3);
+	if (ins) {
+		ins->arg[0] = &input->data;
+		ins->arg[1] = &output->data;
+		ins->arg[2] = w;
+	}
+	B->prop(input->data, output->data, w->data, w->w, w->h);
+	return 0;
+}
+
+// source(w) <----w(w,h)---- delta(h)
+
+static void
+backprop_weight(const float *source, const float *delta, float *nabla, int w, int h) {
+	int i,j;
+	for (i=0;i<h;i++) {
+		float d = delta[i];
+		for (j=0;j<w;j++) {
+			*nabla = d * source[j];
+			++nabla;
+		}
+	}
+}
+
+static int
+lbackprop_weight(lua_State *L) {
+	struct signal * source = check_signal(L, 1);
+	struct signal * delta = check_signal(L, 2);
+	struct weight * w = check_weight(L, 3);
+	if (source->n != w->w || delta->n != w->h) {
+		return luaL_error(L, "Invalid weight (%d , %d) != (%d, %d)", w->w, w->h, source->n, delta->n);
+	}
+	struct instruction *ins = RECORD(L, OP_BACKPROP_WEIGHT, 3);
+	if (ins) {
+		ins->arg[0] = &source->data;
+		ins->arg[1] = &delta->data;
+		ins->arg[2] = w;
+	}
+	B->backprop_weight(source->data, delta->data, w->data, w->w, w->h);
+	return 0;
+}
+
+
+// output_delta(w) <----w(w,h)----- delta(h)
+
+static void
+backprop_bias_range(float *output, const float *delta, const float *c, int w, int h, int from, int to) {
+	int i,j;
+	for (i=from;i<to;i++) {
+		const float * weight = &c[i];
+		float d = 0;
+		for (j=0;j<h;j++) {
+			d += delta[j] * (*weight);
+			weight += w;
+		}
+		output[i] = d;
+	}
+}
+
+static void
+backprop_bias(float *output, const float *delta, const float *c, int w, int h) {
+	backprop_bias_range(output, delta, c, w, h, 0, w);
+}
+
+// reads the weight by rows and accumulates 4 outputs at once, each sum in the same order as backprop_bias_range()
+static void
+backprop_bias_simd_range(float *output, const float *delta, const float *c, int w, int h, int from, int to) {
+	int i,j;
+	for (i=from;i<to;i++) {
+		output[i] = 0;
+	}
+	for (j=0;j<h;j++) {
+		float d = delta[j];
+		const float *weight = c + (size_t)j * w;
+		for (i=from;i+4<=to;i+=4) {
+			output[i] += d * weight[i];
+			output[i+1] += d * weight[i+1];
+			output[i+2] += d * weight[i+2];
+			output[i+3] += d * weight[i+3];
+		}
+		for (;i<to;i++) {
+			output[i] += d * weight[i];
+		}
+	}
+}
+
+static void
+backprop_bias_simd(float *output, const float *delta, const float *c, int w, int h) {
+	backprop_bias_simd_range(output, delta, c, w, h, 0, w);
+}
+
+static void
+backprop_bias_part(void *ud, int from, int to) {
+	struct kernel_args *args = (struct kernel_args *)ud;
+	backprop_bias_simd_range(args->output, args->input, args->c, args->w, args->h, from, to);
+}
+
+static void
+backprop_bias_parallel(float *output, const float *delta, const float *c, int w, int h) {
+	// input is the delta
+	struct kernel_args args = { delta, output, c, w, h };
+	ann_parallel(backprop_bias_part, &args, w, (size_t)w * h);
+}
+
+static int
+lbackprop_bias(lua_State *L) {
+	struct signal * output = check_signal(L, 1);
+	struct signal * delta = check_signal(L, 2);
+	struct lowrank * lr = test_lowrank(L, 3);
+	if (lr) {
+		if (output->n != lr->w || delta->n != lr->h)
+			return luaL_error(L, "Invalid lowrank (%d , %d) != (%d, %d)", lr->w, lr->h, output->n, delta->n);
+		struct instruction *ins = RECORD(L, OP_BACKPROP_BIAS_LOWRANK, 3);
+		if (ins) {
+			ins->arg[0] = &output->data;
+			ins->arg[1] = &delta->data;
+			ins->arg[2] = lr;
+		}
+		lowrank_backprop_bias(lr, output->data, delta->data);
+		return 0;
+	}
+	struct weight * w = check_weight(L, 3);
+	if (output->n != w->w || delta->n != w->h) {
+		return luaL_error(L, "Invalid weight (%d , %d) != (%d, %d)", w->w, w->h, output->n, delta->n);
+	}
+	struct instruction *ins = RECORD(L, OP_BACKPROP_BIAS, 3);
+	if (ins) {
+		ins->arg[0] = &output->data;
+		ins->arg[1] = &delta->data;
+		ins->arg[2] = w;
+	}
+	B->backprop_bias(output->data, delta->data, w->data, w->w, w->h);
+	return 0;
+}
+
+static void
+backprop_sigmoid(const float *s, float *input, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		input[i] *= sigmoid_prime(s[i]);
+	}
+}
+
+static void
+backprop_relu(const float *s, float *input, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		if (s[i] <= 0)
+			input[i] = 0;
+	}
+}
+
+static int
+lbackprop_sigmoid(lua_State *L) {
+	struct signal * s = check_signal(L, 1);
+	struct signal * input = check_signal(L, 2);
+	if (s->n != input->n)
+		return luaL_error(L, "Invalid signal size");
+	struct instruction *ins = RECORD(L, OP_BACKPROP_SIGMOID, 2);
+	if (ins) {
+		ins->n = s->n;
+		ins->arg[0] = &s->data;
+		ins->arg[1] = &input->data;
+	}
+	B->backprop_sigmoid(s->data, input->data, s->n);
+	return 0;
+}
+
+static int
+lbackprop_relu(lua_State *L) {
+	struct signal * s = check_signal(L, 1);
+	struct signal * input = check_signal(L, 2);
+	if (s->n != input->n)
+		return luaL_error(L, "Invalid signal size");
+	struct instruction *ins = RECORD(L, OP_BACKPROP_RELU, 2);
+	if (ins) {
+		ins->n = s->n;
+		ins->arg[0] = &s->data;
+		ins->arg[1] = &input->data;
 	}
+	B->backprop_relu(s->data, input->data, s->n);
 	return 0;
 }
 
 static void
-softmax(struct signal *a, struct signal *output) {
+softmax(const float *a, float *output, int n) {
 	int i;
-	float m = a->data[0];
-	for (i=1;i<a->n;i++) {
-		if (a->data[i] > m)
-			m = a->data[i];
+	float m = a[0];
+	for (i=1;i<n;i++) {
+		if (a[i] > m)
+			m = a[i];
 	}
 	float sum = 0;
-	for (i=0;i<a->n;i++) {
-		float exp_a = expf(a->data[i] - m);
-		output->data[i] = exp_a;
+	for (i=0;i<n;i++) {
+		float exp_a = expf(a[i] - m);
+		output[i] = exp_a;
 		sum += exp_a;
 	}
 	float inv_sum = 1.0f / sum;
-	for (i=0;i<a->n;i++) {
-		output->data[i] *= inv_sum;
+	for (i=0;i<n;i++) {
+		output[i] *= inv_sum;
 	}
 }
 
 
+static void
+softmax_error(const float *a, const float *b, float *output, int n) {
+	softmax(a, output, n);
+	int i;
+	for (i=0;i<n;i++) {
+		output[i] -= b[i];
+	}
+}
+
 static int
 lsignal_softmax(lua_State *L) {
 	struct signal * a = check_signal(L, 1);
@@ -548,33 +1228,112 @@ lsignal_softmax(lua_State *L) {
 	struct signal * output = check_signal(L, 3);
 	if (a->n != b->n || a->n != output->n)
 		return luaL_error(L, "Invalid signal size");
-	softmax(a, output);
-	int i;
-	for (i=0;i<a->n;i++) {
-		output->data[i] -= b->data[i];
+	struct instruction *ins = RECORD(L, OP_SOFTMAX_ERROR, 3);
+	if (ins) {
+		ins->n = a->n;
+		ins->arg[0] = &a->data;
+		ins->arg[1] = &b->data;
+		ins->arg[2] = &output->data;
+	}
+	B->softmax_error(a->data, b->data, output->data, a->n);
+	return 0;
+}
+
+// planar (channel * size) <-> interleaved (size * channel), for stacking filters
+
+static void
+check_channel(lua_State *L, struct signal *a, struct signal *b, int channel) {
+	if (a->n != b->n)
+		luaL_error(L, "Invalid signal size %d != %d", a->n, b->n);
+	if (channel <= 0 || a->n % channel != 0)
+		luaL_error(L, "Invalid channel %d for signal size %d", channel, a->n);
+}
+
+static int
+linterleave(lua_State *L) {
+	unrecordable(L, "ann.interleave");
+	struct signal * planar = check_signal(L, 1);
+	struct signal * output = check_signal(L, 2);
+	int channel = luaL_checkinteger(L, 3);
+	check_channel(L, planar, output, channel);
+	int size = planar->n / channel;
+	int i,j;
+	const float * src = planar->data;
+	for (i=0;i<channel;i++) {
+		float * dst = output->data + i;
+		for (j=0;j<size;j++) {
+			*dst = *src;
+			++src;
+			dst += channel;
+		}
+	}
+	return 0;
+}
+
+static int
+ldeinterleave(lua_State *L) {
+	unrecordable(L, "ann.deinterleave");
+	struct signal * interleaved = check_signal(L, 1);
+	struct signal * output = check_signal(L, 2);
+	int channel = luaL_checkinteger(L, 3);
+	check_channel(L, interleaved, output, channel);
+	int size = interleaved->n / channel;
+	int i,j;
+	float * dst = output->data;
+	for (i=0;i<channel;i++) {
+		const float * src = interleaved->data + i;
+		for (j=0;j<size;j++) {
+			*dst = *src;
+			++dst;
+			src += channel;
+		}
 	}
 	return 0;
 }
 
-// filter for convolution with stride 1.
+// filter for convolution with stride and zero padding, then max pooling (pooling * pooling windows every pool_stride).
+// Input of multi channels is interleaved (src_h * src_w * channel),
+// so a filter line (size * channel) is contiguous in both the input and the weight.
 struct filter {
 	int size;	// (size * size) filter
 	int pooling;
 	int n;
+	int channel;
 	int src_w;
 	int src_h;
-	float f[1];	// bias[n] + weight[size * size * n]
+	int stride;
+	int pad;
+	int pool_stride;
+	const struct conv_kernel *kernel;	// selected by size and channel when the filter is created
+	float *f;	// bias[n] + weight[size * size * channel * n]
+	float buffer[1];
+};
+
+// kernels of one filter (w, bias), see conv_kernel_select()
+struct conv_kernel {
+	// input => output (cw * ch)
+	void (*convolution)(const struct filter *f, const float *input, float *output, const float *w, float bias);
+	// input => output (pw * ph), convolution + bias + max pooling + relu
+	void (*convpool)(const struct filter *f, const float *input, float *output, const float *w, float bias);
+	// input, delta (cw * ch) => w
+	void (*backprop_weight)(const struct filter *f, const float *input, const float *delta, float *w);
 };
 
 static inline size_t
-filter_size(int size, int n) {
-	int nfloat = (size * size + 1) * n;
+filter_size(int size, int channel, int n) {
+	int nfloat = (size * size * channel + 1) * n;
 	return sizeof(struct filter) + (nfloat - 1) * sizeof(float);
 }
 
+// weight number of one filter
+static inline int
+filter_wsize(const struct filter *f) {
+	return f->size * f->size * f->channel;
+}
+
 static inline float *
 filter_weight(struct filter *f, int n) {
-	return f->f + f->n + f->size * f->size * n;
+	return f->f + f->n + filter_wsize(f) * n;
 }
 
 static inline float
@@ -590,8 +1349,9 @@ check_filter(lua_State *L, int index) {
 static int
 lfilter_randn(lua_State *L) {
 	struct filter *f = check_filter(L, 1);
+	unrecordable(L, "filter:randn");
 	float deviation = luaL_optnumber(L, 2, 1.0f);
-	int n = f->n * (1 + f->size * f->size);
+	int n = f->n * (1 + filter_wsize(f));
 	randn(f->f, n, deviation);
 	lua_settop(L, 1);
 	return 1;
@@ -600,7 +1360,8 @@ lfilter_randn(lua_State *L) {
 static int
 lfilter_zero(lua_State *L) {
 	struct filter *f = check_filter(L, 1);
-	int n = f->n * (1 + f->size * f->size);
+	unrecordable(L, "filter:zero");
+	int n = f->n * (1 + filter_wsize(f));
 	memset(f->f, 0, n * sizeof(float));
 	lua_settop(L, 1);
 	return 1;
@@ -617,9 +1378,10 @@ lfilter_dump(lua_State *L) {
 		addfloat(L, &b, filter_bias(f, i));
 		luaL_addchar(&b, '\n');
 		float * w = filter_weight(f, i);
+		int line = f->size * f->channel;
 		for (j=0;j<f->size;j++) {
 			luaL_addlstring(&b, "  [", 3);
-			for (k=0;k<f->size;k++) {
+			for (k=0;k<line;k++) {
 				addfloat(L, &b, *w);
 				++w;
 			}
@@ -637,9 +1399,23 @@ set_arg(lua_State *L, const char *key, int v) {
 }
 
 static inline void
-filter_output_size(struct filter *f, int *w, int *h) {
-	*w = f->src_w - f->size + 1;
-	*h = f->src_h - f->size + 1;
+filter_output_size(const struct filter *f, int *w, int *h) {
+	*w = (f->src_w + 2 * f->pad - f->size) / f->stride + 1;
+	*h = (f->src_h + 2 * f->pad - f->size) / f->stride + 1;
+}
+
+static inline void
+filter_pooling_size(const struct filter *f, int *w, int *h) {
+	int dw, dh;
+	filter_output_size(f, &dw, &dh);
+	*w = (dw - f->pooling) / f->pool_stride + 1;
+	*h = (dh - f->pooling) / f->pool_stride + 1;
+}
+
+// stride 1, no padding and non-overlapping pooling : the fast paths
+static inline int
+filter_unit_stride(const struct filter *f) {
+	return f->stride == 1 && f->pad == 0 && f->pool_stride == f->pooling;
 }
 
 static int
@@ -648,16 +1424,19 @@ lfilter_args(lua_State *L) {
 	lua_newtable(L);
 	set_arg(L, "size", f->size);
 	set_arg(L, "n", f->n);
+	set_arg(L, "channel", f->channel);
 	set_arg(L, "w", f->src_w);
 	set_arg(L, "h", f->src_h);
 	set_arg(L, "pooling", f->pooling);
+	set_arg(L, "stride", f->stride);
+	set_arg(L, "pad", f->pad);
+	set_arg(L, "pool_stride", f->pool_stride);
 	int dw, dh;
 	filter_output_size(f, &dw, &dh);
 	set_arg(L, "cw", dw);
 	set_arg(L, "ch", dh);
 	set_arg(L, "conv_size", dw * dh * f->n);
-	dw /= f->pooling;
-	dh /= f->pooling;
+	filter_pooling_size(f, &dw, &dh);
 	set_arg(L, "pw", dw);
 	set_arg(L, "ph", dh);
 	set_arg(L, "output_size", dw * dh * f->n);
@@ -665,13 +1444,14 @@ lfilter_args(lua_State *L) {
 	return 1;
 }
 
+// fline is the width of a filter line : fsize * channel
 static inline float
-conv_dot(const float *src, int stride, const float *f, int fsize) {
+conv_dot(const float *src, int stride, const float *f, int fsize, int fline) {
 	int i,j;
 	float s = 0;
 	const float *line = src;
 	for (i=0;i<fsize;i++) {
-		for (j=0;j<fsize;j++) {
+		for (j=0;j<fline;j++) {
 			s += line[j] * (*f);
 			++f;
 		}
@@ -681,105 +1461,529 @@ conv_dot(const float *src, int stride, const float *f, int fsize) {
 }
 
 static void
-conv2dpool(const float *src, int w, int h, float *dst, int fsize, const float *f, float bias) {
+conv2dpool(const float *src, int w, int h, int channel, float *dst, int fsize, const float *f, float bias) {
 	int i,j;
 	const float * line = src;
 	int y = h - fsize + 1;
 	int x = w - fsize + 1;
+	int stride = w * channel;
+	int fline = fsize * channel;
 	for (i=0;i<y;i++) {
 		const float * src = line;
 		for (j=0;j<x;j++) {
-			float v = conv_dot(src, w, f, fsize);
+			float v = conv_dot(src, stride, f, fsize, fline);
 			*dst = v + bias;
 			++dst;
-			++src;
+			src += channel;
 		}
-		line += w;
+		line += stride;
 	}
 }
 
-static int
-lfilter_convolution(lua_State *L) {
-	struct filter *f = check_filter(L, 1);
-	struct signal *input = check_signal(L, 2);
-	struct signal *output = check_signal(L, 3);
-
-	int input_size = f->src_w * f->src_h;
-	int dw,dh;
-	filter_output_size(f, &dw, &dh);
-	int output_size = dw * dh;
-	if (input_size != input->n)
-		return luaL_error(L, "Invalid input signal size %d * %d != %d", f->src_w, f->src_h, input->n);
-	if (output_size * f->n != output->n)
-		return luaL_error(L, "Invalid output signal size %d * %d * %d != %d", dw, dh, f->n, output->n);
-
-	int i;
-	float *oimg = output->data;
-	for (i=0;i<f->n;i++) {
-		conv2dpool(input->data, f->src_w, f->src_h, oimg, f->size, filter_weight(f, i), filter_bias(f, i));
-		oimg += output_size;
+// the window of the output (x, y) with stride and padding, the taps in the padding are zero
+static inline float
+conv_window_dot(const struct filter *f, const float *input, int x, int y, const float *w) {
+	int x0 = x * f->stride - f->pad;
+	int y0 = y * f->stride - f->pad;
+	int stride = f->src_w * f->channel;
+	int fline = f->size * f->channel;
+	if (x0 >= 0 && y0 >= 0 && x0 + f->size <= f->src_w && y0 + f->size <= f->src_h) {
+		return conv_dot(input + y0 * stride + x0 * f->channel, stride, w, f->size, fline);
 	}
-	return 0;
+	float s = 0;
+	int i,j;
+	for (i=0;i<f->size;i++) {
+		int sy = y0 + i;
+		if (sy < 0 || sy >= f->src_h)
+			continue;
+		for (j=0;j<fline;j++) {
+			int sx = x0 + j / f->channel;
+			if (sx >= 0 && sx < f->src_w)
+				s += input[sy * stride + x0 * f->channel + j] * w[i * fline + j];
+		}
+	}
+	return s;
 }
 
-static inline float
-pooling_max(const float *src, int x, int y, int pooling, int stride) {
+// 4 outputs of a line, step apart in the input. Each sum is in the same order as conv_dot()
+static inline void
+conv_dot4(const float *src, int stride, int step, const float *f, int fsize, int fline, float *out) {
+	float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
 	int i,j;
-	src += y * pooling * stride + x * pooling;
-	float m = *src;
-	for (i=0;i<pooling;i++) {
-		for (j=0;j<pooling;j++) {
-			float v = src[j];
-			if (v > m)
-				m = v;
+	for (i=0;i<fsize;i++) {
+		for (j=0;j<fline;j++) {
+			float v = f[j];
+			a0 += src[j] * v;
+			a1 += src[step + j] * v;
+			a2 += src[step * 2 + j] * v;
+			a3 += src[step * 3 + j] * v;
 		}
 		src += stride;
+		f += fline;
 	}
-	return m;
+	out[0] = a0;
+	out[1] = a1;
+	out[2] = a2;
+	out[3] = a3;
 }
 
-static int
-lfilter_maxpooling(lua_State *L) {
-	struct filter *f = check_filter(L, 1);
-	struct signal *input = check_signal(L, 2);
-	struct signal *output = check_signal(L, 3);
-
+// the line y of the convolution output (without bias)
+static void
+conv_window_line(const struct filter *f, const float *input, int y, const float *w, float *out) {
 	int dw,dh;
 	filter_output_size(f, &dw, &dh);
-	int input_size = dw * dh;
-	if (input_size * f->n != input->n)
-		return luaL_error(L, "Invalid input signal size %d * %d * %d != %d", dw, dh, f->n, input->n);
-	int pw = dw / f->pooling;
-	int ph = dh / f->pooling;
-	int output_size = pw * ph;
-	if (output_size * f->n != output->n)
-		return luaL_error(L, "Invalid output signal size %d * %d * %d != %d", pw, ph, f->n, output->n);
-
-	int i,j,k;
-	float *ptr = output->data;
-	const float * src = input->data;
-	int pooling_size = f->pooling;
-	for (i=0;i<f->n;i++) {
-		for (j=0;j<ph;j++) {
-			for (k=0;k<pw;k++) {
-				*ptr = pooling_max(src, k, j, pooling_size, dw);
-				++ptr;
+	int x = 0;
+	int y0 = y * f->stride - f->pad;
+	if (y0 >= 0 && y0 + f->size <= f->src_h) {
+		// the windows inside the input
+		int from = (f->pad + f->stride - 1) / f->stride;
+		int to = (f->src_w - f->size + f->pad) / f->stride + 1;
+		if (to > dw)
+			to = dw;
+		int stride = f->src_w * f->channel;
+		int step = f->stride * f->channel;
+		int fline = f->size * f->channel;
+		for (;x<from;x++)
+			out[x] = conv_window_dot(f, input, x, y, w);
+		const float *src = input + y0 * stride + (x * f->stride - f->pad) * f->channel;
+		for (;x+4<=to;x+=4) {
+			// constant bounds for the common single channel filters, the compiler unrolls them
+			switch (f->channel == 1 ? f->size : 0) {
+			case 3: conv_dot4(src, stride, step, w, 3, 3, out + x); break;
+			case 5: conv_dot4(src, stride, step, w, 5, 5, out + x); break;
+			case 7: conv_dot4(src, stride, step, w, 7, 7, out + x); break;
+			default: conv_dot4(src, stride, step, w, f->size, fline, out + x); break;
 			}
+			src += step * 4;
 		}
-		src += input_size;
 	}
-	return 0;
+	for (;x<dw;x++)
+		out[x] = conv_window_dot(f, input, x, y, w);
 }
 
+// w += d * the window of the output (x, y)
 static inline void
-fill_max(float * conv, float delta, int stride, int pooling) {
+conv_window_backprop(const struct filter *f, const float *input, int x, int y, float d, float *w) {
+	int x0 = x * f->stride - f->pad;
+	int y0 = y * f->stride - f->pad;
+	int stride = f->src_w * f->channel;
+	int fline = f->size * f->channel;
 	int i,j;
-	float * m = conv;
-	float maxv = *m;
-	for (i=0;i<pooling;i++) {
-		for (j=0;j<pooling;j++) {
-			float v = conv[j];
-			if (v > maxv) {
+	for (i=0;i<f->size;i++) {
+		int sy = y0 + i;
+		if (sy >= 0 && sy < f->src_h) {
+			const float *line = input + sy * stride + x0 * f->channel;
+			if (x0 >= 0 && x0 + f->size <= f->src_w) {
+				for (j=0;j<fline;j++) {
+					w[j] += d * line[j];
+				}
+			} else {
+				for (j=0;j<fline;j++) {
+					int sx = x0 + j / f->channel;
+					if (sx >= 0 && sx < f->src_w)
+						w[j] += d * line[j];
+				}
+			}
+		}
+		w += fline;
+	}
+}
+
+// filters [from, to)
+static void
+filter_convolution_range(const struct conv_kernel *k, struct filter *f, const float *input, float *output, int from, int to) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int output_size = dw * dh;
+	int i;
+	output += (size_t)from * output_size;
+	for (i=from;i<to;i++) {
+		k->convolution(f, input, output, filter_weight(f, i), filter_bias(f, i));
+		output += output_size;
+	}
+}
+
+static void
+filter_convolution(struct filter *f, const float *input, float *output) {
+	filter_convolution_range(f->kernel, f, input, output, 0, f->n);
+}
+
+struct filter_args {
+	struct filter *f;
+	const float *input;
+	float *output;
+};
+
+static void
+filter_convolution_part(void *ud, int from, int to) {
+	struct filter_args *args = (struct filter_args *)ud;
+	filter_convolution_range(args->f->kernel, args->f, args->input, args->output, from, to);
+}
+
+static void
+filter_convolution_parallel(struct filter *f, const float *input, float *output) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	struct filter_args args = { f, input, output };
+	ann_parallel(filter_convolution_part, &args, f->n, (size_t)dw * dh * f->n * filter_wsize(f));
+}
+
+static int
+lfilter_convolution(lua_State *L) {
+	struct filter *f = check_filter(L, 1);
+	struct signal *input = check_signal(L, 2);
+	struct signal *output = check_signal(L, 3);
+
+	int input_size = f->src_w * f->src_h * f->channel;
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int output_size = dw * dh;
+	if (input_size != input->n)
+		return luaL_error(L, "Invalid input signal size %d * %d * %d != %d", f->src_w, f->src_h, f->channel, input->n);
+	if (output_size * f->n != output->n)
+		return luaL_error(L, "Invalid output signal size %d * %d * %d != %d", dw, dh, f->n, output->n);
+
+	struct instruction *ins = RECORD(L, OP_CONVOLUTION, 3);
+	if (ins) {
+		ins->arg[0] = f;
+		ins->arg[1] = &input->data;
+		ins->arg[2] = &output->data;
+	}
+	B->convolution(f, input->data, output->data);
+	return 0;
+}
+
+// argmax of each pooling window, offset into the convolution signal.
+// dw, dh, planes : the convolution signal of the filter, the offsets are less than dw * dh * planes
+struct argmax {
+	int n;
+	int dw;
+	int dh;
+	int planes;
+	int index[1];
+};
+
+static inline struct argmax *
+check_argmax(lua_State *L, int index) {
+	return (struct argmax *)luaL_checkudata(L, index, "ANN_ARGMAX");
+}
+
+// the argmax of filter:argmax() of a filter with the same convolution signal and pooling windows
+static struct argmax *
+check_filter_argmax(lua_State *L, int index, const struct filter *f) {
+	struct argmax *a = check_argmax(L, index);
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	if (a->dw != dw || a->dh != dh || a->planes != f->n || a->n != pw * ph * f->n)
+		luaL_error(L, "Invalid argmax %d x %d x %d (%d windows), the filter is %d x %d x %d (%d windows)",
+			a->dw, a->dh, a->planes, a->n, dw, dh, f->n, pw * ph * f->n);
+	return a;
+}
+
+static inline int
+pooling_argmax(const float *src, int x, int y, int pooling, int step, int stride) {
+	int i,j;
+	int offset = y * step * stride + x * step;
+	int m = offset;
+	float maxv = src[offset];
+	for (i=0;i<pooling;i++) {
+		for (j=0;j<pooling;j++) {
+			float v = src[offset + j];
+			if (v > maxv) {
+				maxv = v;
+				m = offset + j;
+			}
+		}
+		offset += stride;
+	}
+	return m;
+}
+
+// inference only : convolution + bias + max pooling + relu, without the convolution buffer.
+static void
+convpool(const float *src, int w, int channel, float *dst, int pw, int ph, int pooling, int fsize, const float *f, float bias) {
+	int i,j,m,n;
+	int line = w * channel;
+	int stride = line * pooling;
+	int fline = fsize * channel;
+	for (i=0;i<ph;i++) {
+		for (j=0;j<pw;j++) {
+			const float *window = src + j * pooling * channel;
+			float maxv = -INFINITY;
+			for (m=0;m<pooling;m++) {
+				for (n=0;n<pooling;n++) {
+					float v = conv_dot(window + n * channel, line, f, fsize, fline);
+					if (v > maxv)
+						maxv = v;
+				}
+				window += line;
+			}
+			maxv += bias;
+			*dst = maxv > 0 ? maxv : 0;
+			++dst;
+		}
+		src += stride;
+	}
+}
+
+static void
+filter_convpool_kernel(const struct conv_kernel *k, struct filter *f, const float *input, float *output) {
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int i;
+	for (i=0;i<f->n;i++) {
+		k->convpool(f, input, output, filter_weight(f, i), filter_bias(f, i));
+		output += pw * ph;
+	}
+}
+
+static void
+filter_convpool(struct filter *f, const float *input, float *output) {
+	filter_convpool_kernel(f->kernel, f, input, output);
+}
+
+#define CONV_PLANE 4096
+
+// the rows of windows a row of windows overlaps, itself included
+static inline int
+pooling_band_rows(int pooling, int pool_stride) {
+	return (pooling + pool_stride - 1) / pool_stride;
+}
+
+// training without the convolution signal : one plane (cw * ch) at a time, then max pooling + relu.
+// index is the argmax in the layout of the convolution signal, see filter_backprop_weight_argmax()
+static void
+filter_convpool_argmax(const struct conv_kernel *kernel, struct filter *f, const float *input, float *output, int *index, float *plane) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int plane_size = dw * dh;
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int i,j,k;
+	for (i=0;i<f->n;i++) {
+		kernel->convolution(f, input, plane, filter_weight(f, i), filter_bias(f, i));
+		int base = i * plane_size;
+		for (j=0;j<ph;j++) {
+			for (k=0;k<pw;k++) {
+				int m = pooling_argmax(plane, k, j, f->pooling, f->pool_stride, dw);
+				float v = plane[m];
+				*output = v > 0 ? v : 0;
+				*index = base + m;
+				++output;
+				++index;
+			}
+		}
+	}
+}
+
+// without a plane : each window of the pooling is convolved in place, the same result as filter_convpool_argmax()
+static void
+filter_convpool_argmax_windows(struct filter *f, const float *input, float *output, int *index) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int i,j,k,m,n;
+	for (i=0;i<f->n;i++) {
+		const float *w = filter_weight(f, i);
+		float bias = filter_bias(f, i);
+		int base = i * dw * dh;
+		for (j=0;j<ph;j++) {
+			for (k=0;k<pw;k++) {
+				float maxv = -INFINITY;
+				int maxi = 0;
+				for (m=0;m<f->pooling;m++) {
+					int y = j * f->pool_stride + m;
+					for (n=0;n<f->pooling;n++) {
+						int x = k * f->pool_stride + n;
+						float v = conv_window_dot(f, input, x, y, w) + bias;
+						if (v > maxv || (m == 0 && n == 0)) {
+							maxv = v;
+							maxi = y * dw + x;
+						}
+					}
+				}
+				*output = maxv > 0 ? maxv : 0;
+				*index = base + maxi;
+				++output;
+				++index;
+			}
+		}
+	}
+}
+
+static void
+convpool_argmax_kernel(const struct conv_kernel *kernel, struct filter *f, const float *input, float *output, int *index) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	float stack[CONV_PLANE];
+	float *plane = dw * dh <= CONV_PLANE ? stack : (float *)malloc((size_t)dw * dh * sizeof(float));
+	if (plane == NULL) {
+		filter_convpool_argmax_windows(f, input, output, index);
+		return;
+	}
+	filter_convpool_argmax(kernel, f, input, output, index, plane);
+	if (plane != stack)
+		free(plane);
+}
+
+static void
+convpool_argmax(struct filter *f, const float *input, float *output, int *index) {
+	convpool_argmax_kernel(f->kernel, f, input, output, index);
+}
+
+static int
+lfilter_convpool(lua_State *L) {
+	struct filter *f = check_filter(L, 1);
+	struct signal *input = check_signal(L, 2);
+	struct signal *output = check_signal(L, 3);
+
+	int input_size = f->src_w * f->src_h * f->channel;
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int output_size = pw * ph;
+	if (input_size != input->n)
+		return luaL_error(L, "Invalid input signal size %d * %d * %d != %d", f->src_w, f->src_h, f->channel, input->n);
+	if (output_size * f->n != output->n)
+		return luaL_error(L, "Invalid output signal size %d * %d * %d != %d", pw, ph, f->n, output->n);
+
+	if (!lua_isnoneornil(L, 4)) {
+		// for training, backprop_conv_weight with the argmax replaces the convolution signal
+		struct argmax *index = check_filter_argmax(L, 4, f);
+		if (index->n != output->n)
+			return luaL_error(L, "Invalid argmax size %d != %d", index->n, output->n);
+		struct instruction *ins = RECORD(L, OP_CONVPOOL_ARGMAX, 4);
+		if (ins) {
+			ins->arg[0] = f;
+			ins->arg[1] = &input->data;
+			ins->arg[2] = &output->data;
+			ins->arg[3] = index;
+		}
+		B->convpool_argmax(f, input->data, output->data, index->index);
+		return 0;
+	}
+
+	struct instruction *ins = RECORD(L, OP_CONVPOOL, 3);
+	if (ins) {
+		ins->arg[0] = f;
+		ins->arg[1] = &input->data;
+		ins->arg[2] = &output->data;
+	}
+	B->convpool(f, input->data, output->data);
+	return 0;
+}
+
+// the window at (x, y) * step, stride is the width of the convolution output
+static inline float
+pooling_max(const float *src, int x, int y, int pooling, int step, int stride) {
+	int i,j;
+	src += y * step * stride + x * step;
+	float m = *src;
+	for (i=0;i<pooling;i++) {
+		for (j=0;j<pooling;j++) {
+			float v = src[j];
+			if (v > m)
+				m = v;
+		}
+		src += stride;
+	}
+	return m;
+}
+
+static void
+filter_maxpooling_argmax(struct filter *f, const float *src, float *output, int *index) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int input_size = dw * dh;
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int i,j,k;
+	int base = 0;
+	for (i=0;i<f->n;i++) {
+		for (j=0;j<ph;j++) {
+			for (k=0;k<pw;k++) {
+				int m = pooling_argmax(src, k, j, f->pooling, f->pool_stride, dw);
+				*output = src[m];
+				*index = base + m;
+				++output;
+				++index;
+			}
+		}
+		src += input_size;
+		base += input_size;
+	}
+}
+
+static void
+filter_maxpooling(struct filter *f, const float *src, float *output) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int input_size = dw * dh;
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int i,j,k;
+	for (i=0;i<f->n;i++) {
+		for (j=0;j<ph;j++) {
+			for (k=0;k<pw;k++) {
+				*output = pooling_max(src, k, j, f->pooling, f->pool_stride, dw);
+				++output;
+			}
+		}
+		src += input_size;
+	}
+}
+
+static int
+lfilter_maxpooling(lua_State *L) {
+	struct filter *f = check_filter(L, 1);
+	struct signal *input = check_signal(L, 2);
+	struct signal *output = check_signal(L, 3);
+	struct argmax *index = lua_isnoneornil(L, 4) ? NULL : check_filter_argmax(L, 4, f);
+
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int input_size = dw * dh;
+	if (input_size * f->n != input->n)
+		return luaL_error(L, "Invalid input signal size %d * %d * %d != %d", dw, dh, f->n, input->n);
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int output_size = pw * ph;
+	if (output_size * f->n != output->n)
+		return luaL_error(L, "Invalid output signal size %d * %d * %d != %d", pw, ph, f->n, output->n);
+
+	if (index) {
+		if (index->n != output->n)
+			return luaL_error(L, "Invalid argmax size %d != %d", index->n, output->n);
+		struct instruction *ins = RECORD(L, OP_MAXPOOLING_ARGMAX, 4);
+		if (ins) {
+			ins->arg[0] = f;
+			ins->arg[1] = &input->data;
+			ins->arg[2] = &output->data;
+			ins->arg[3] = index;
+		}
+		B->maxpooling_argmax(f, input->data, output->data, index->index);
+		return 0;
+	}
+	struct instruction *ins = RECORD(L, OP_MAXPOOLING, 3);
+	if (ins) {
+		ins->arg[0] = f;
+		ins->arg[1] = &input->data;
+		ins->arg[2] = &output->data;
+	}
+	B->maxpooling(f, input->data, output->data);
+	return 0;
+}
+
+static inline void
+fill_max(float * conv, float delta, int stride, int pooling) {
+	int i,j;
+	float * m = conv;
+	float maxv = *m;
+	for (i=0;i<pooling;i++) {
+		for (j=0;j<pooling;j++) {
+			float v = conv[j];
+			if (v > maxv) {
 				maxv = v;
 				m = &conv[j];
 			}
@@ -792,7 +1996,7 @@ fill_max(float * conv, float delta, int stride, int pooling) {
 
 static void
 pooling_max_backprop(const float *delta_img, float *conv_img, int w, int h, int pooling) {
-	int i,j;
+	int i,j,k;
 	int y = h - pooling + 1;
 	int x = w - pooling + 1;
 	int stride = w * pooling;
@@ -801,21 +2005,37 @@ pooling_max_backprop(const float *delta_img, float *conv_img, int w, int h, int
 			fill_max(conv_img + j , *delta_img, w, pooling);
 			delta_img ++;
 		}
-		for (;j<w;j++) {
-			conv_img[j] = 0;
+		// the columns out of the windows, in all the lines of the band
+		for (k=0;k<pooling;k++) {
+			int c;
+			for (c=j;c<w;c++) {
+				conv_img[k * w + c] = 0;
+			}
 		}
 		conv_img += stride;
 	}
 	memset(conv_img, 0, (h-i) * w * sizeof(float));
 }
 
+// index[i] < conv_n, as the argmax is checked against the filter (see check_filter_argmax).
+// One memset of the plane is cheaper than clearing each window, and covers the cells out of any window.
+static void
+pooling_max_scatter(const float *delta, const int *index, int n, float *conv, int conv_n) {
+	int i;
+	memset(conv, 0, conv_n * sizeof(float));
+	// overlapped windows (pool_stride < pooling) may share the max
+	for (i=0;i<n;i++) {
+		conv[index[i]] += delta[i];
+	}
+}
+
 static inline float
-calc_filter_weight(const float * a, int stride, const float *b, int w, int h) {
+calc_filter_weight(const float * a, int stride, int step, const float *b, int w, int h) {
 	float s = 0;
 	int i,j;
 	for (i=0;i<h;i++) {
 		for (j=0;j<w;j++) {
-			s += a[j] * (*b);
+			s += a[j * step] * (*b);
 			++b;
 		}
 		a += stride;
@@ -825,13 +2045,8 @@ calc_filter_weight(const float * a, int stride, const float *b, int w, int h) {
 
 // https://microsoft.github.io/ai-edu/%E5%9F%BA%E7%A1%80%E6%95%99%E7%A8%8B/A2-%E7%A5%9E%E7%BB%8F%E7%BD%91%E7%BB%9C%E5%9F%BA%E6%9C%AC%E5%8E%9F%E7%90%86/%E7%AC%AC8%E6%AD%A5%20-%20%E5%8D%B7%E7%A7%AF%E7%A5%9E%E7%BB%8F%E7%BD%91%E7%BB%9C/17.3-%E5%8D%B7%E7%A7%AF%E7%9A%84%E5%8F%8D%E5%90%91%E4%BC%A0%E6%92%AD%E5%8E%9F%E7%90%86.html
 
-static int
-lbackprop_conv_bias(lua_State *L) {
-	struct filter *f = check_filter(L, 1);
-	struct signal *delta = check_signal(L, 2);
-
-	int size = delta->n / f->n;
-	const float * ptr = delta->data;
+static void
+filter_backprop_bias(struct filter *f, const float *ptr, int size) {
 	int i,j;
 	for (i=0;i<f->n;i++) {
 		float s = 0;
@@ -841,10 +2056,94 @@ lbackprop_conv_bias(lua_State *L) {
 		}
 		f->f[i] = s;
 	}
+}
+
+static int
+lbackprop_conv_bias(lua_State *L) {
+	struct filter *f = check_filter(L, 1);
+	struct signal *delta = check_signal(L, 2);
+
+	struct instruction *ins = RECORD(L, OP_BACKPROP_CONV_BIAS, 2);
+	if (ins) {
+		ins->n = delta->n / f->n;
+		ins->arg[0] = f;
+		ins->arg[1] = &delta->data;
+	}
+	B->backprop_conv_bias(f, delta->data, delta->n / f->n);
 
 	return 0;
 }
 
+// any pool_stride : find the max in a copy of the plane, then the windows add their delta
+static void
+pooling_max_backprop_strided(const struct filter *f, const float *delta_img, float *conv_img, float *plane) {
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	int i,j;
+	memcpy(plane, conv_img, dw * dh * sizeof(float));
+	memset(conv_img, 0, dw * dh * sizeof(float));
+	for (i=0;i<ph;i++) {
+		for (j=0;j<pw;j++) {
+			conv_img[pooling_argmax(plane, j, i, f->pooling, f->pool_stride, dw)] += *delta_img;
+			++delta_img;
+		}
+	}
+}
+
+// any pool_stride without a copy of the plane : the argmax of a row of windows is taken before
+// the rows it reads are written, so the argmax of the last pooling_band_rows() rows of windows are kept,
+// and a line of the plane is zeroed just before the first delta it gets.
+static void
+pooling_max_backprop_band(const struct filter *f, const float *delta_img, float *conv_img) {
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	int k = pooling_band_rows(f->pooling, f->pool_stride);
+	int band[CONV_PLANE];	// k * pw, see lconvpool_filter()
+	int zero = 0;	// the lines before are zeroed
+	int i,j;
+	for (i=0;i<ph+k-1;i++) {
+		if (i < ph) {
+			int *index = band + (i % k) * pw;
+			for (j=0;j<pw;j++)
+				index[j] = pooling_argmax(conv_img, j, i, f->pooling, f->pool_stride, dw);
+		}
+		// no window after i reads the lines of the row r
+		int r = i - k + 1;
+		if (r >= 0) {
+			int end = r * f->pool_stride + f->pooling;
+			if (end > zero) {
+				memset(conv_img + zero * dw, 0, (end - zero) * dw * sizeof(float));
+				zero = end;
+			}
+			const int *index = band + (r % k) * pw;
+			const float *delta = delta_img + r * pw;
+			for (j=0;j<pw;j++)
+				conv_img[index[j]] += delta[j];
+		}
+	}
+	memset(conv_img + zero * dw, 0, (dh - zero) * dw * sizeof(float));
+}
+
+static void
+filter_backprop_maxpooling(struct filter *f, float *conv_img, const float *delta_img) {
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	int conv_size = dw * dh;
+	int output_size = pw * ph;
+	int i;
+	for (i=0;i<f->n;i++) {
+		if (f->pool_stride == f->pooling)
+			pooling_max_backprop(delta_img, conv_img, dw, dh, f->pooling);
+		else
+			pooling_max_backprop_band(f, delta_img, conv_img);
+		delta_img += output_size;
+		conv_img += conv_size;
+	}
+}
+
 static int
 lbackprop_maxpooling(lua_State *L) {
 	struct filter *f = check_filter(L, 1);
@@ -855,8 +2154,8 @@ lbackprop_maxpooling(lua_State *L) {
 	filter_output_size(f, &dw, &dh);
 	int conv_size = dw * dh;
 
-	int pw = dw / f->pooling;
-	int ph = dh / f->pooling;
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
 	int output_size = pw * ph;
 
 	if (conv_size * f->n != conv->n)
@@ -865,84 +2164,284 @@ lbackprop_maxpooling(lua_State *L) {
 	if (output_size * f->n != delta->n)
 		return luaL_error(L, "Invalid output signal size %d * %d * %d != %d", pw, ph, f->n, delta->n);
 
-	int i;
-	const float * delta_img = delta->data;
-	float * conv_img = conv->data;
-	for (i=0;i<f->n;i++) {
-		pooling_max_backprop(delta_img, conv_img, dw, dh, f->pooling);
-		delta_img += output_size;
-		conv_img += conv_size;
+	if (!lua_isnoneornil(L, 4)) {
+		// conv is the output delta here, the forward activation is kept by the caller.
+		struct argmax *index = check_filter_argmax(L, 4, f);
+		if (index->n != delta->n)
+			return luaL_error(L, "Invalid argmax size %d != %d", index->n, delta->n);
+		struct instruction *ins = RECORD(L, OP_BACKPROP_MAXPOOLING_ARGMAX, 4);
+		if (ins) {
+			ins->n = delta->n;
+			ins->arg[0] = f;
+			ins->arg[1] = &conv->data;
+			ins->arg[2] = &delta->data;
+			ins->arg[3] = index;
+		}
+		B->maxpooling_scatter(delta->data, index->index, delta->n, conv->data, conv->n);
+		return 0;
+	}
+
+	struct instruction *ins = RECORD(L, OP_BACKPROP_MAXPOOLING, 3);
+	if (ins) {
+		ins->arg[0] = f;
+		ins->arg[1] = &conv->data;
+		ins->arg[2] = &delta->data;
 	}
+	B->backprop_maxpooling(f, conv->data, delta->data);
 
 	return 0;
 }
 
+static void
+filter_backprop_weight_range(const struct conv_kernel *k, struct filter *f, const float *input_img, const float *delta_img, int from, int to) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int delta_size = dw * dh;
+	int i;
+	delta_img += (size_t)from * delta_size;
+	for (i=from;i<to;i++) {
+		k->backprop_weight(f, input_img, delta_img, filter_weight(f, i));
+		delta_img += delta_size;
+	}
+}
+
+static void
+filter_backprop_weight(struct filter *f, const float *input_img, const float *delta_img) {
+	filter_backprop_weight_range(f->kernel, f, input_img, delta_img, 0, f->n);
+}
+
+static void
+filter_backprop_weight_part(void *ud, int from, int to) {
+	// output is the delta
+	struct filter_args *args = (struct filter_args *)ud;
+	filter_backprop_weight_range(args->f->kernel, args->f, args->input, args->output, from, to);
+}
+
+static void
+filter_backprop_weight_parallel(struct filter *f, const float *input, const float *delta) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	// output is the delta
+	struct filter_args args = { f, input, (float *)delta };
+	ann_parallel(filter_backprop_weight_part, &args, f->n, (size_t)dw * dh * f->n * filter_wsize(f));
+}
+
+// delta (output_size) is the delta of the max pooling, only the windows at argmax get a gradient,
+// so it recomputes pooling * pooling fewer windows than the convolution signal has.
+// The argmax is of this filter geometry (check_filter_argmax), so the window j of plane i is in plane i.
+static void
+filter_backprop_weight_argmax(struct filter *f, const float *input, const float *delta, const int *index) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int plane_size = dw * dh;
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int pn = pw * ph;
+	int wsize = filter_wsize(f);
+	int i,j;
+	for (i=0;i<f->n;i++) {
+		float *w = filter_weight(f, i);
+		memset(w, 0, wsize * sizeof(float));
+		for (j=0;j<pn;j++) {
+			float d = *delta++;
+			int m = *index++ - i * plane_size;
+			if (d != 0)
+				conv_window_backprop(f, input, m % dw, m / dw, d, w);
+		}
+	}
+}
+
 static int
 lbackprop_conv_weight(lua_State *L) {
 	struct filter *f = check_filter(L, 1);
 	struct signal *input = check_signal(L, 2);
 	struct signal *delta =  check_signal(L, 3);
 
-	int input_size = f->src_w * f->src_h;
+	int input_size = f->src_w * f->src_h * f->channel;
 	int dw,dh;
 	filter_output_size(f, &dw, &dh);
 	int delta_size = dw * dh;
 
 	if (input_size != input->n)
-		return luaL_error(L, "Invalid input signal size %d * %d != %d", f->src_w, f->src_h, input->n);
+		return luaL_error(L, "Invalid input signal size %d * %d * %d != %d", f->src_w, f->src_h, f->channel, input->n);
+
+	if (!lua_isnoneornil(L, 4)) {
+		// delta is the delta of the pooling output, see filter:convpool(input, output, argmax)
+		struct argmax *index = check_filter_argmax(L, 4, f);
+		int pw,ph;
+		filter_pooling_size(f, &pw, &ph);
+		int output_size = pw * ph * f->n;
+		if (output_size != delta->n)
+			return luaL_error(L, "Invalid pooling delta size %d != %d", output_size, delta->n);
+		if (index->n != delta->n)
+			return luaL_error(L, "Invalid argmax size %d != %d", index->n, delta->n);
+		struct instruction *ins = RECORD(L, OP_BACKPROP_CONV_WEIGHT_ARGMAX, 4);
+		if (ins) {
+			ins->arg[0] = f;
+			ins->arg[1] = &input->data;
+			ins->arg[2] = &delta->data;
+			ins->arg[3] = index;
+		}
+		B->backprop_conv_weight_argmax(f, input->data, delta->data, index->index);
+		return 0;
+	}
 
 	if (delta_size * f->n != delta->n)
 		return luaL_error(L, "Invalid input delta size %d * %d != %d", dw, dh, f->n, delta->n);
 
-	const float * input_img = input->data;
-	float * delta_img = delta->data;
+	struct instruction *ins = RECORD(L, OP_BACKPROP_CONV_WEIGHT, 3);
+	if (ins) {
+		ins->arg[0] = f;
+		ins->arg[1] = &input->data;
+		ins->arg[2] = &delta->data;
+	}
+	B->backprop_conv_weight(f, input->data, delta->data);
+
+	return 0;
+}
+
+// input_delta(src_w * src_h * channel) <----filter----- delta(conv_size)
+
+static void
+conv_backprop_input(const float *delta, int dw, int dh, float *input, int w, int channel, int fsize, const float *f) {
 	int i,j,k;
-	for (i=0;i<f->n;i++) {
-		const float * line = input_img;
-		float * w = filter_weight(f, i);
-		for (j=0;j<f->size;j++) {
+	int stride = w * channel;
+	int fline = fsize * channel;
+	for (i=0;i<dh;i++) {
+		for (j=0;j<dw;j++) {
+			float d = *delta;
+			++delta;
+			if (d == 0)
+				continue;
+			float * line = input + i * stride + j * channel;
+			const float * weight = f;
+			for (k=0;k<fsize;k++) {
+				int x;
+				for (x=0;x<fline;x++) {
+					line[x] += d * weight[x];
+				}
+				line += stride;
+				weight += fline;
+			}
+		}
+	}
+}
+
+// with stride and padding, the taps in the padding are dropped
+static void
+conv_backprop_input_strided(const struct filter *f, const float *delta, float *input, const float *w) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int stride = f->src_w * f->channel;
+	int fline = f->size * f->channel;
+	int i,j,k,x;
+	for (i=0;i<dh;i++) {
+		for (j=0;j<dw;j++) {
+			float d = *delta;
+			++delta;
+			if (d == 0)
+				continue;
+			int x0 = j * f->stride - f->pad;
+			int y0 = i * f->stride - f->pad;
 			for (k=0;k<f->size;k++) {
-				*w = calc_filter_weight(line + k, f->src_w, delta_img, dw, dh);
-				++w;
+				int sy = y0 + k;
+				if (sy < 0 || sy >= f->src_h)
+					continue;
+				float * line = input + sy * stride + x0 * f->channel;
+				const float * weight = w + k * fline;
+				for (x=0;x<fline;x++) {
+					int sx = x0 + x / f->channel;
+					if (sx >= 0 && sx < f->src_w)
+						line[x] += d * weight[x];
+				}
 			}
-			line += f->src_w;
 		}
+	}
+}
+
+static void
+filter_backprop_input(struct filter *f, const float *delta_img, float *input) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int delta_size = dw * dh;
+	memset(input, 0, f->src_w * f->src_h * f->channel * sizeof(float));
+	int i;
+	for (i=0;i<f->n;i++) {
+		if (f->stride == 1 && f->pad == 0)
+			conv_backprop_input(delta_img, dw, dh, input, f->src_w, f->channel, f->size, filter_weight(f, i));
+		else
+			conv_backprop_input_strided(f, delta_img, input, filter_weight(f, i));
 		delta_img += delta_size;
 	}
+}
+
+static int
+lbackprop_conv_input(lua_State *L) {
+	struct filter *f = check_filter(L, 1);
+	struct signal *delta = check_signal(L, 2);
+	struct signal *input = check_signal(L, 3);
+
+	int input_size = f->src_w * f->src_h * f->channel;
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int delta_size = dw * dh;
+
+	if (delta_size * f->n != delta->n)
+		return luaL_error(L, "Invalid input delta size %d * %d * %d != %d", dw, dh, f->n, delta->n);
+
+	if (input_size != input->n)
+		return luaL_error(L, "Invalid input signal size %d * %d * %d != %d", f->src_w, f->src_h, f->channel, input->n);
 
+	struct instruction *ins = RECORD(L, OP_BACKPROP_CONV_INPUT, 3);
+	if (ins) {
+		ins->arg[0] = f;
+		ins->arg[1] = &delta->data;
+		ins->arg[2] = &input->data;
+	}
+	B->backprop_conv_input(f, delta->data, input->data);
 	return 0;
 }
 
 static int
 lfilter_clone(lua_State *L) {
 	struct filter *f = check_filter(L, 1);
-	size_t sz = lua_rawlen(L, 1);
-	void * c = lua_newuserdatauv(L, sz, 0);
-	memcpy(c, f, sz);
+	size_t sz = filter_size(f->size, f->channel, f->n);
+	struct filter * c = (struct filter *)lua_newuserdatauv(L, sz, 1);
+	memcpy(c, f, sizeof(*c));
+	c->f = c->buffer;
+	memcpy(c->f, f->f, (filter_wsize(f) + 1) * f->n * sizeof(float));
 	lua_getmetatable(L, 1);
 	lua_setmetatable(L, -2);
 
 	return 1;
 }
 
+static int
+lfilter_argmax(lua_State *L) {
+	struct filter *f = check_filter(L, 1);
+	int pw, ph;
+	filter_pooling_size(f, &pw, &ph);
+	int n = pw * ph * f->n;
+	size_t sz = sizeof(struct argmax) + sizeof(int) * (n-1);
+	struct argmax *index = (struct argmax *)lua_newuserdatauv(L, sz, 0);
+	memset(index, 0, sz);
+	index->n = n;
+	filter_output_size(f, &index->dw, &index->dh);
+	index->planes = f->n;
+	luaL_newmetatable(L, "ANN_ARGMAX");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
 static int
 lfilter_accumulate(lua_State *L) {
 	struct filter * f = check_filter(L, 1);
+	unrecordable(L, "filter:accumulate");
 	struct filter * delta = check_filter(L, 2);
-	if (f->size != delta->size || f->n != delta->n)
-		return luaL_error(L, "filter size (%d , %d) != (%d , %d)", f->size, f->n, delta->size, delta->n);
-	int i;
-	int nfloat = (f->size * f->size + 1) * f->n;
-	if (lua_type(L, 3) == LUA_TNUMBER) {
-		float eta = lua_tonumber(L, 3);
-		for (i=0;i<nfloat;i++) {
-			f->f[i] += delta->f[i] * eta;
-		}
-	} else {
-		for (i=0;i<nfloat;i++) {
-			f->f[i] += delta->f[i];
-		}
-	}
+	if (f->size != delta->size || f->n != delta->n || f->channel != delta->channel)
+		return luaL_error(L, "filter size (%d , %d , %d) != (%d , %d , %d)", f->size, f->n, f->channel, delta->size, delta->n, delta->channel);
+	float eta = lua_type(L, 3) == LUA_TNUMBER ? lua_tonumber(L, 3) : 1.0f;
+	B->accumulate(f->f, delta->f, (filter_wsize(f) + 1) * f->n, eta);
 	lua_settop(L, 1);
 	return 1;
 }
@@ -952,7 +2451,7 @@ lfilter_export(lua_State *L) {
 	struct filter * f = check_filter(L, 1);
 	lua_createtable(L, f->n, 0);
 	int i,j;
-	int size = f->size * f->size;
+	int size = filter_wsize(f);
 	for (i=0;i<f->n;i++) {
 		lua_createtable(L, size, 1);
 		const float * w = filter_weight(f, i);
@@ -970,9 +2469,10 @@ lfilter_export(lua_State *L) {
 static int
 lfilter_import(lua_State *L) {
 	struct filter * f = check_filter(L, 1);
+	unrecordable(L, "filter:import");
 	luaL_checktype(L, 2, LUA_TTABLE);
 	int i,j;
-	int size = f->size * f->size;
+	int size = filter_wsize(f);
 	for (i=0;i<f->n;i++) {
 		if (lua_rawgeti(L, 2, i+1) != LUA_TTABLE)
 			return luaL_error(L, "[%d] is not a table (%s)", i+1, lua_typename(L, lua_type(L, -1)));
@@ -994,6 +2494,281 @@ lfilter_import(lua_State *L) {
 	return 0;
 }
 
+// Generic kernels, any size and channel
+
+static void
+generic_convolution(const struct filter *f, const float *input, float *output, const float *w, float bias) {
+	conv2dpool(input, f->src_w, f->src_h, f->channel, output, f->size, w, bias);
+}
+
+static void
+generic_convpool(const struct filter *f, const float *input, float *output, const float *w, float bias) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	convpool(input, f->src_w, f->channel, output, dw / f->pooling, dh / f->pooling, f->pooling, f->size, w, bias);
+}
+
+static void
+generic_backprop_weight(const struct filter *f, const float *input, const float *delta, float *w) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int stride = f->src_w * f->channel;
+	int fline = f->size * f->channel;
+	int j,k;
+	for (j=0;j<f->size;j++) {
+		for (k=0;k<fline;k++) {
+			*w = calc_filter_weight(input + k, stride, f->channel, delta, dw, dh);
+			++w;
+		}
+		input += stride;
+	}
+}
+
+static const struct conv_kernel generic_kernel = {
+	generic_convolution,
+	generic_convpool,
+	generic_backprop_weight,
+};
+
+// Strided kernels, any stride, padding and pooling stride. They compute only the outputs needed,
+// so a stride 2 convolution costs about a quarter of the stride 1 one.
+
+static void
+strided_convolution(const struct filter *f, const float *input, float *output, const float *w, float bias) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int i,j;
+	for (i=0;i<dh;i++) {
+		conv_window_line(f, input, i, w, output);
+		for (j=0;j<dw;j++)
+			output[j] += bias;
+		output += dw;
+	}
+}
+
+// without the line buffer : each window of the pooling is convolved in place
+static void
+strided_convpool_windows(const struct filter *f, const float *input, float *output, const float *w, float bias) {
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int i,j,m,n;
+	for (i=0;i<ph;i++) {
+		for (j=0;j<pw;j++) {
+			float maxv = -INFINITY;
+			for (m=0;m<f->pooling;m++) {
+				for (n=0;n<f->pooling;n++) {
+					float v = conv_window_dot(f, input, j * f->pool_stride + n, i * f->pool_stride + m, w);
+					if (v > maxv)
+						maxv = v;
+				}
+			}
+			float v = maxv + bias;
+			*output = v > 0 ? v : 0;
+			++output;
+		}
+	}
+}
+
+// the lines of each pooling window, into a line buffer
+static void
+strided_convpool(const struct filter *f, const float *input, float *output, const float *w, float bias) {
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	float stack[CONV_PLANE];
+	float *line = dw + pw <= CONV_PLANE ? stack : (float *)malloc((dw + pw) * sizeof(float));
+	if (line == NULL) {
+		strided_convpool_windows(f, input, output, w, bias);
+		return;
+	}
+	float *maxv = line + dw;
+	int i,j,m,n;
+	for (i=0;i<ph;i++) {
+		for (j=0;j<pw;j++)
+			maxv[j] = -INFINITY;
+		for (m=0;m<f->pooling;m++) {
+			conv_window_line(f, input, i * f->pool_stride + m, w, line);
+			for (j=0;j<pw;j++) {
+				const float *window = line + j * f->pool_stride;
+				for (n=0;n<f->pooling;n++) {
+					if (window[n] > maxv[j])
+						maxv[j] = window[n];
+				}
+			}
+		}
+		for (j=0;j<pw;j++) {
+			float v = maxv[j] + bias;
+			*output = v > 0 ? v : 0;
+			++output;
+		}
+	}
+	if (line != stack)
+		free(line);
+}
+
+static void
+strided_backprop_weight(const struct filter *f, const float *input, const float *delta, float *w) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	memset(w, 0, filter_wsize(f) * sizeof(float));
+	int i,j;
+	for (i=0;i<dh;i++) {
+		for (j=0;j<dw;j++) {
+			float d = *delta;
+			++delta;
+			if (d != 0)
+				conv_window_backprop(f, input, j, i, d, w);
+		}
+	}
+}
+
+static const struct conv_kernel strided_kernel = {
+	strided_convolution,
+	strided_convpool,
+	strided_backprop_weight,
+};
+
+// the plain kernel of the reference backend
+static inline const struct conv_kernel *
+reference_kernel(const struct filter *f) {
+	return filter_unit_stride(f) ? &generic_kernel : &strided_kernel;
+}
+
+// Specialized kernels of single channel N * N filters : the constant loop bounds let the compiler
+// unroll the taps and keep them in registers. convolution computes 4 adjacent outputs at once, and
+// backprop_weight keeps the N sums of a filter line; each sum is still in the same order as the generic kernels.
+
+// convpool computes up to CONV_LINE convolution outputs of a line at once
+#define CONV_LINE 64
+
+#define CONV_KERNEL(N) \
+static inline void \
+conv_line_##N(const float *src, int stride, const float *k, float *out, int n) { \
+	int m,t,x; \
+	for (x=0;x+4<=n;x+=4) { \
+		float a0 = 0, a1 = 0, a2 = 0, a3 = 0; \
+		for (m=0;m<N;m++) { \
+			const float *line = src + m * stride + x; \
+			for (t=0;t<N;t++) { \
+				float kv = k[m * N + t]; \
+				a0 += line[t] * kv; \
+				a1 += line[t+1] * kv; \
+				a2 += line[t+2] * kv; \
+				a3 += line[t+3] * kv; \
+			} \
+		} \
+		out[x] = a0; \
+		out[x+1] = a1; \
+		out[x+2] = a2; \
+		out[x+3] = a3; \
+	} \
+	for (;x<n;x++) { \
+		float a = 0; \
+		for (m=0;m<N;m++) { \
+			for (t=0;t<N;t++) { \
+				a += src[m * stride + x + t] * k[m * N + t]; \
+			} \
+		} \
+		out[x] = a; \
+	} \
+} \
+static void \
+convolution_##N(const struct filter *f, const float *input, float *output, const float *w, float bias) { \
+	int stride = f->src_w; \
+	int dw = f->src_w - N + 1; \
+	int dh = f->src_h - N + 1; \
+	float k[N * N]; \
+	int i,x; \
+	memcpy(k, w, sizeof(k)); \
+	for (i=0;i<dh;i++) { \
+		conv_line_##N(input + i * stride, stride, k, output, dw); \
+		for (x=0;x<dw;x++) \
+			output[x] += bias; \
+		output += dw; \
+	} \
+} \
+static void \
+convpool_##N(const struct filter *f, const float *input, float *output, const float *w, float bias) { \
+	int stride = f->src_w; \
+	int pooling = f->pooling; \
+	int pw = (f->src_w - N + 1) / pooling; \
+	int ph = (f->src_h - N + 1) / pooling; \
+	float k[N * N]; \
+	float line[CONV_LINE]; \
+	int i,j,m,x,n; \
+	memcpy(k, w, sizeof(k)); \
+	int step = CONV_LINE / pooling; \
+	for (i=0;i<ph;i++) { \
+		for (j=0;j<pw;j+=step) { \
+			int npool = pw - j < step ? pw - j : step; \
+			float *maxv = output + j; \
+			for (x=0;x<npool;x++) \
+				maxv[x] = -INFINITY; \
+			for (m=0;m<pooling;m++) { \
+				conv_line_##N(input + (i * pooling + m) * stride + j * pooling, stride, k, line, npool * pooling); \
+				for (x=0;x<npool;x++) { \
+					for (n=0;n<pooling;n++) { \
+						float v = line[x * pooling + n]; \
+						if (v > maxv[x]) \
+							maxv[x] = v; \
+					} \
+				} \
+			} \
+			for (x=0;x<npool;x++) { \
+				float v = maxv[x] + bias; \
+				maxv[x] = v > 0 ? v : 0; \
+			} \
+		} \
+		output += pw; \
+	} \
+} \
+static void \
+backprop_weight_##N(const struct filter *f, const float *input, const float *delta, float *w) { \
+	int stride = f->src_w; \
+	int dw = f->src_w - N + 1; \
+	int dh = f->src_h - N + 1; \
+	int i,j,m,t; \
+	for (m=0;m<N;m++) { \
+		float s[N] = { 0 }; \
+		const float *d = delta; \
+		for (i=0;i<dh;i++) { \
+			const float *line = input + (i + m) * stride; \
+			for (j=0;j<dw;j++) { \
+				float dv = *d++; \
+				_Pragma("GCC unroll 8") \
+				for (t=0;t<N;t++) { \
+					s[t] += line[j + t] * dv; \
+				} \
+			} \
+		} \
+		memcpy(w + m * N, s, sizeof(s)); \
+	} \
+} \
+static const struct conv_kernel kernel_##N = { \
+	convolution_##N, \
+	convpool_##N, \
+	backprop_weight_##N, \
+};
+
+CONV_KERNEL(3)
+CONV_KERNEL(5)
+CONV_KERNEL(7)
+
+static const struct conv_kernel *
+conv_kernel_select(const struct filter *f) {
+	if (!filter_unit_stride(f))
+		return &strided_kernel;
+	if (f->channel == 1 && f->pooling <= CONV_LINE) {
+		switch (f->size) {
+		case 3: return &kernel_3;
+		case 5: return &kernel_5;
+		case 7: return &kernel_7;
+		}
+	}
+	return &generic_kernel;
+}
+
+// ann.convpool_filter(size, w, h, n [, pooling = 2 [, channel = 1 [, stride = 1 [, pad = 0 [, pool_stride = pooling]]]]])
 static int
 lconvpool_filter(lua_State *L) {
 	int size = luaL_checkinteger(L, 1);
@@ -1001,20 +2776,43 @@ lconvpool_filter(lua_State *L) {
 	int src_h = luaL_checkinteger(L, 3);
 	int n = luaL_checkinteger(L, 4);
 	int pooling = luaL_optinteger(L, 5, 2);
-	size_t sz = filter_size(size, n);
-	struct filter * f = (struct filter *)lua_newuserdatauv(L, sz, 0);
+	int channel = luaL_optinteger(L, 6, 1);
+	int stride = luaL_optinteger(L, 7, 1);
+	int pad = luaL_optinteger(L, 8, 0);
+	int pool_stride = luaL_optinteger(L, 9, pooling);
+	if (channel <= 0)
+		return luaL_error(L, "Invalid channel %d", channel);
+	if (stride <= 0 || stride > 255 || pad < 0 || pad >= size || pad > 255)
+		return luaL_error(L, "Invalid stride %d or pad %d for filter size %d", stride, pad, size);
+	if (pooling <= 0 || pooling > 255 || pool_stride <= 0 || pool_stride > 255)
+		return luaL_error(L, "Invalid pooling %d stride %d", pooling, pool_stride);
+	if (src_w + 2 * pad < size + (pooling - 1) * stride || src_h + 2 * pad < size + (pooling - 1) * stride)
+		return luaL_error(L, "Invalid filter size %d for input %d * %d (pad %d)", size, src_w, src_h, pad);
+	int pw = ((src_w + 2 * pad - size) / stride + 1 - pooling) / pool_stride + 1;
+	if (pool_stride != pooling && pooling_band_rows(pooling, pool_stride) * pw > CONV_PLANE)
+		return luaL_error(L, "Invalid pooling %d stride %d, %d windows a line is too wide", pooling, pool_stride, pw);
+	size_t sz = filter_size(size, channel, n);
+	struct filter * f = (struct filter *)lua_newuserdatauv(L, sz, 1);
 	memset(f, 0, sz);
+	f->f = f->buffer;
 	f->size = size;
 	f->n = n;
+	f->channel = channel;
 	f->src_w = src_w;
 	f->src_h = src_h;
 	f->pooling = pooling;
+	f->stride = stride;
+	f->pad = pad;
+	f->pool_stride = pool_stride;
+	f->kernel = conv_kernel_select(f);
 
 	if (luaL_newmetatable(L, "ANN_FILTER")) {
 		lua_pushvalue(L, -1);
 		lua_setfield(L, -2, "__index");
 		luaL_Reg l[] = {
 			{ "clone", lfilter_clone },
+			{ "bytes", ltensor_bytes },
+			{ "load", ltensor_load },
 			{ "accumulate", lfilter_accumulate },
 			{ "randn", lfilter_randn },
 			{ "zero", lfilter_zero },
@@ -1022,23 +2820,2845 @@ lconvpool_filter(lua_State *L) {
 			{ "args", lfilter_args },
 			{ "convolution", lfilter_convolution },
 			{ "maxpooling", lfilter_maxpooling },
+			{ "argmax", lfilter_argmax },
+			{ "convpool", lfilter_convpool },
 			{ "export", lfilter_export },
 			{ "import", lfilter_import },
 			{ "backprop_maxpooling", lbackprop_maxpooling },
 			{ "backprop_conv_bias", lbackprop_conv_bias},
 			{ "backprop_conv_weight", lbackprop_conv_weight},
+			{ "backprop_conv_input", lbackprop_conv_input},
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static struct lowrank *
+check_lowrank(lua_State *L, int index) {
+	return (struct lowrank *)luaL_checkudata(L, index, "ANN_LOWRANK");
+}
+
+static inline int
+lowrank_n(const struct lowrank *lr) {
+	return lr->rank * (lr->w + lr->h);
+}
+
+static int
+llowrank_size(lua_State *L) {
+	struct lowrank *lr = check_lowrank(L, 1);
+	lua_pushinteger(L, lr->w);
+	lua_pushinteger(L, lr->h);
+	lua_pushinteger(L, lr->rank);
+	return 3;
+}
+
+// lowrank:randn([deviation]) : the entries of U * V have about the deviation
+static int
+llowrank_randn(lua_State *L) {
+	struct lowrank *lr = check_lowrank(L, 1);
+	unrecordable(L, "lowrank:randn");
+	float deviation = luaL_optnumber(L, 2, 1.0f);
+	randn(lr->data, lowrank_n(lr), sqrtf(deviation) / sqrtf(sqrtf(lr->rank)));
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+llowrank_zero(lua_State *L) {
+	struct lowrank *lr = check_lowrank(L, 1);
+	unrecordable(L, "lowrank:zero");
+	memset(lr->data, 0, lowrank_n(lr) * sizeof(float));
+	lua_settop(L, 1);
+	return 1;
+}
+
+static void
+lowrank_expand(const struct lowrank *lr, float *w) {
+	const float *u = lowrank_u(lr);
+	const float *v = lowrank_v(lr);
+	int i,j,k;
+	for (i=0;i<lr->h;i++) {
+		float *row = w + (size_t)i * lr->w;
+		memset(row, 0, lr->w * sizeof(float));
+		for (k=0;k<lr->rank;k++) {
+			float c = u[i * lr->rank + k];
+			const float *vr = v + (size_t)k * lr->w;
+			for (j=0;j<lr->w;j++) {
+				row[j] += c * vr[j];
+			}
+		}
+	}
+}
+
+// lowrank:expand([weight]) : U * V into a weight (w, h)
+static int
+llowrank_expand(lua_State *L) {
+	struct lowrank *lr = check_lowrank(L, 1);
+	struct weight *w;
+	if (lua_isnoneornil(L, 2)) {
+		lua_settop(L, 1);
+		lua_pushcfunction(L, lweight);
+		lua_pushinteger(L, lr->w);
+		lua_pushinteger(L, lr->h);
+		lua_call(L, 2, 1);
+		w = check_weight(L, 2);
+	} else {
+		unrecordable(L, "lowrank:expand");
+		w = check_weight(L, 2);
+		if (w->w != lr->w || w->h != lr->h)
+			return luaL_error(L, "Invalid weight (%d , %d) != (%d , %d)", w->w, w->h, lr->w, lr->h);
+		lua_settop(L, 2);
+	}
+	lowrank_expand(lr, w->data);
+	return 1;
+}
+
+// lowrank:export() : the rows of U * V, the same as weight:export()
+static int
+llowrank_export(lua_State *L) {
+	llowrank_expand(L);
+	lua_replace(L, 1);
+	lua_settop(L, 1);
+	return lweight_export(L);
+}
+
+// ann.backprop_lowrank(lowrank, source, delta, nabla) : the gradients of U and V into nabla (the shape of lowrank)
+static int
+lbackprop_lowrank(lua_State *L) {
+	struct lowrank *lr = check_lowrank(L, 1);
+	struct signal *source = check_signal(L, 2);
+	struct signal *delta = check_signal(L, 3);
+	struct lowrank *nabla = check_lowrank(L, 4);
+	if (source->n != lr->w || delta->n != lr->h)
+		return luaL_error(L, "Invalid lowrank (%d , %d) != (%d, %d)", lr->w, lr->h, source->n, delta->n);
+	if (nabla->w != lr->w || nabla->h != lr->h || nabla->rank != lr->rank)
+		return luaL_error(L, "Invalid nabla (%d , %d , %d) != (%d , %d , %d)", nabla->w, nabla->h, nabla->rank, lr->w, lr->h, lr->rank);
+	struct instruction *ins = RECORD(L, OP_BACKPROP_LOWRANK, 4);
+	if (ins) {
+		ins->arg[0] = lr;
+		ins->arg[1] = &source->data;
+		ins->arg[2] = &delta->data;
+		ins->arg[3] = nabla;
+	}
+	lowrank_backprop_weight(lr, source->data, delta->data, nabla);
+	return 0;
+}
+
+// orthonormalize the r columns (stride r) of q (n rows), Gram-Schmidt twice for stability
+static void
+orthonormalize(double *q, int n, int r) {
+	int i,j,k,pass;
+	for (j=0;j<r;j++) {
+		for (pass=0;pass<2;pass++) {
+			for (k=0;k<j;k++) {
+				double d = 0;
+				for (i=0;i<n;i++)
+					d += q[i*r+j] * q[i*r+k];
+				for (i=0;i<n;i++)
+					q[i*r+j] -= d * q[i*r+k];
+			}
+		}
+		double norm = 0;
+		for (i=0;i<n;i++)
+			norm += q[i*r+j] * q[i*r+j];
+		norm = sqrt(norm);
+		if (norm < 1e-30) {
+			// rank deficient, any unit vector orthogonal enough
+			for (i=0;i<n;i++)
+				q[i*r+j] = (i == j % n);
+		} else {
+			for (i=0;i<n;i++)
+				q[i*r+j] /= norm;
+		}
+	}
+}
+
+#define SUBSPACE_ITERATION 8
+
+// truncated SVD by subspace iteration : Q = orth(W * W' ... W * G), U = Q, V = Q' * W. returns |W - U*V| / |W|
+static double
+lowrank_from_weight(lua_State *L, struct lowrank *lr, const struct weight *w) {
+	int h = w->h, n = w->w, r = lr->rank;
+	double *q = (double *)malloc(((size_t)h * r + (size_t)n * r) * sizeof(double));	// Q(h, r), Z(n, r)
+	if (q == NULL)
+		luaL_error(L, "Out of memory");
+	double *z = q + (size_t)h * r;
+	const float *W = w->data;
+	int i,j,k,it;
+	float *g = (float *)malloc((size_t)n * r * sizeof(float));
+	if (g == NULL) {
+		free(q);
+		luaL_error(L, "Out of memory");
+	}
+	randn(g, n * r, 1.0f);
+	for (i=0;i<n*r;i++)
+		z[i] = g[i];
+	free(g);
+	for (it=0;it<=SUBSPACE_ITERATION;it++) {
+		// Q = orth(W * Z)
+		for (i=0;i<h;i++) {
+			const float *row = W + (size_t)i * n;
+			for (k=0;k<r;k++) {
+				double s = 0;
+				for (j=0;j<n;j++)
+					s += row[j] * z[j*r+k];
+				q[i*r+k] = s;
+			}
+		}
+		orthonormalize(q, h, r);
+		if (it == SUBSPACE_ITERATION)
+			break;
+		// Z = orth(W' * Q)
+		for (j=0;j<n;j++) {
+			for (k=0;k<r;k++)
+				z[j*r+k] = 0;
+		}
+		for (i=0;i<h;i++) {
+			const float *row = W + (size_t)i * n;
+			for (j=0;j<n;j++) {
+				for (k=0;k<r;k++)
+					z[j*r+k] += row[j] * q[i*r+k];
+			}
+		}
+		orthonormalize(z, n, r);
+	}
+	float *u = lowrank_u(lr);
+	float *v = lowrank_v(lr);
+	for (i=0;i<h;i++) {
+		for (k=0;k<r;k++)
+			u[i*r+k] = q[i*r+k];
+	}
+	// V = Q' * W
+	for (k=0;k<r;k++) {
+		for (j=0;j<n;j++) {
+			double s = 0;
+			for (i=0;i<h;i++)
+				s += q[i*r+k] * W[(size_t)i*n+j];
+			v[(size_t)k*n+j] = s;
+		}
+	}
+	free(q);
+	double err = 0, norm = 0;
+	float *row = (float *)malloc(n * sizeof(float));
+	if (row == NULL)
+		luaL_error(L, "Out of memory");
+	for (i=0;i<h;i++) {
+		for (j=0;j<n;j++) {
+			double s = 0;
+			for (k=0;k<r;k++)
+				s += u[i*r+k] * v[(size_t)k*n+j];
+			row[j] = s;
+		}
+		for (j=0;j<n;j++) {
+			double a = W[(size_t)i*n+j];
+			double d = a - row[j];
+			err += d * d;
+			norm += a * a;
+		}
+	}
+	free(row);
+	return norm > 0 ? sqrt(err / norm) : 0;
+}
+
+// ann.lowrank(w, h, rank) : a zero lowrank weight,
+// ann.lowrank(weight, rank) : factorize a weight, returns the lowrank and the relative error
+static int
+llowrank(lua_State *L) {
+	struct weight *src = NULL;
+	int w, h, rank;
+	if (lua_type(L, 1) == LUA_TUSERDATA) {
+		src = check_weight(L, 1);
+		w = src->w;
+		h = src->h;
+		rank = luaL_checkinteger(L, 2);
+	} else {
+		w = luaL_checkinteger(L, 1);
+		h = luaL_checkinteger(L, 2);
+		rank = luaL_checkinteger(L, 3);
+	}
+	if (w <= 0 || h <= 0 || rank <= 0 || rank > w || rank > h)
+		return luaL_error(L, "Invalid lowrank (%d , %d) rank %d", w, h, rank);
+	if (rank > LOWRANK_STACK)
+		return luaL_error(L, "Invalid lowrank rank %d > %d", rank, LOWRANK_STACK);
+	int n = rank * (w + h);
+	size_t sz = sizeof(struct lowrank) + sizeof(float) * (n - 1);
+	struct lowrank *lr = (struct lowrank *)lua_newuserdatauv(L, sz, 1);
+	lr->w = w;
+	lr->h = h;
+	lr->rank = rank;
+	lr->data = lr->buffer;
+	memset(lr->data, 0, n * sizeof(float));
+	if (luaL_newmetatable(L, "ANN_LOWRANK")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "size", llowrank_size },
+			{ "randn", llowrank_randn },
+			{ "zero", llowrank_zero },
+			{ "expand", llowrank_expand },
+			{ "export", llowrank_export },
+			{ "bytes", ltensor_bytes },
+			{ "load", ltensor_load },
+			{ "pointer", ltensor_pointer },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L, l, 0);
 	}
 	lua_setmetatable(L, -2);
+	if (src == NULL)
+		return 1;
+	lua_pushnumber(L, lowrank_from_weight(L, lr, src));
+	return 2;
+}
+
+// Sparse weight : one userdata of the header, row[h+1], col[nnz] and val[nnz]
+
+static int
+lsparse_size(lua_State *L) {
+	struct sparse *s = (struct sparse *)luaL_checkudata(L, 1, "ANN_SPARSE");
+	lua_pushinteger(L, s->w);
+	lua_pushinteger(L, s->h);
+	lua_pushinteger(L, s->nnz);
+	return 3;
+}
+
+// sparse:expand([weight]) : the dense weight
+static int
+lsparse_expand(lua_State *L) {
+	struct sparse *s = (struct sparse *)luaL_checkudata(L, 1, "ANN_SPARSE");
+	struct weight *w;
+	if (lua_isnoneornil(L, 2)) {
+		lua_settop(L, 1);
+		lua_pushcfunction(L, lweight);
+		lua_pushinteger(L, s->w);
+		lua_pushinteger(L, s->h);
+		lua_call(L, 2, 1);
+		w = check_weight(L, 2);
+	} else {
+		unrecordable(L, "sparse:expand");
+		w = check_weight(L, 2);
+		if (w->w != s->w || w->h != s->h)
+			return luaL_error(L, "Invalid weight (%d , %d) != (%d , %d)", w->w, w->h, s->w, s->h);
+		lua_settop(L, 2);
+	}
+	memset(w->data, 0, (size_t)w->w * w->h * sizeof(float));
+	int i,k;
+	for (i=0;i<s->h;i++) {
+		float *row = w->data + (size_t)i * s->w;
+		for (k=s->row[i];k<s->row[i+1];k++)
+			row[s->col[k]] = s->val[k];
+	}
+	return 1;
+}
 
+static int
+lsparse_export(lua_State *L) {
+	lsparse_expand(L);
+	lua_replace(L, 1);
+	lua_settop(L, 1);
+	return lweight_export(L);
+}
+
+// sparse:bytes() : w, h, nnz (int32), row, col and val, ann.sparse(str) reads it back
+static int
+lsparse_bytes(lua_State *L) {
+	struct sparse *s = (struct sparse *)luaL_checkudata(L, 1, "ANN_SPARSE");
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	int32_t head[3] = { s->w, s->h, s->nnz };
+	luaL_addlstring(&b, (const char *)head, sizeof(head));
+	luaL_addlstring(&b, (const char *)s->row, ((size_t)s->h + 1) * sizeof(int));
+	luaL_addlstring(&b, (const char *)s->col, (size_t)s->nnz * sizeof(int));
+	luaL_addlstring(&b, (const char *)s->val, (size_t)s->nnz * sizeof(float));
+	luaL_pushresult(&b);
+	return 1;
+}
+
+// bytes of row (h + 1), col and val (nnz) ; in 64 bits, h + 1 + nnz may overflow an int
+static inline uint64_t
+sparse_bytes(int h, int nnz) {
+	return ((uint64_t)h + 1 + (uint64_t)nnz) * sizeof(int) + (uint64_t)nnz * sizeof(float);
+}
+
+static struct sparse *
+new_sparse(lua_State *L, int w, int h, int nnz) {
+	if (h < 0 || nnz < 0 || sparse_bytes(h, nnz) > SIZE_MAX - sizeof(struct sparse))
+		luaL_error(L, "Invalid sparse (%d , %d) nnz %d", w, h, nnz);
+	size_t sz = sizeof(struct sparse) + (size_t)sparse_bytes(h, nnz);
+	struct sparse *s = (struct sparse *)lua_newuserdatauv(L, sz, 0);
+	s->w = w;
+	s->h = h;
+	s->nnz = nnz;
+	s->row = (int *)(s + 1);
+	s->col = s->row + h + 1;
+	s->val = (float *)(s->col + nnz);
+	if (luaL_newmetatable(L, "ANN_SPARSE")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "size", lsparse_size },
+			{ "expand", lsparse_expand },
+			{ "export", lsparse_export },
+			{ "bytes", lsparse_bytes },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	return s;
+}
+
+static int
+sparse_load(lua_State *L) {
+	size_t sz;
+	const char *str = luaL_checklstring(L, 1, &sz);
+	int32_t head[3];
+	if (sz < sizeof(head))
+		return luaL_error(L, "Invalid sparse (%I bytes)", (lua_Integer)sz);
+	memcpy(head, str, sizeof(head));
+	int w = head[0], h = head[1], nnz = head[2];
+	if (w <= 0 || h <= 0 || nnz < 0 || (int64_t)nnz > (int64_t)w * h ||
+		(uint64_t)(sz - sizeof(head)) != sparse_bytes(h, nnz))
+		return luaL_error(L, "Invalid sparse (%d , %d) nnz %d, %I bytes", w, h, nnz, (lua_Integer)sz);
+	struct sparse *s = new_sparse(L, w, h, nnz);
+	memcpy(s->row, str + sizeof(head), sz - sizeof(head));
+	int i,k;
+	if (s->row[0] != 0 || s->row[h] != nnz)
+		return luaL_error(L, "Invalid sparse rows");
+	for (i=0;i<h;i++) {
+		if (s->row[i] > s->row[i+1])
+			return luaL_error(L, "Invalid sparse row %d", i);
+	}
+	for (k=0;k<nnz;k++) {
+		if (s->col[k] < 0 || s->col[k] >= w)
+			return luaL_error(L, "Invalid sparse column %d", s->col[k]);
+	}
+	return 1;
+}
+
+// ann.sparse(weight [, threshold]) : the entries with magnitude above threshold (default 0), see weight:prune
+// ann.sparse(str) : from sparse:bytes()
+static int
+lsparse(lua_State *L) {
+	if (lua_type(L, 1) == LUA_TSTRING)
+		return sparse_load(L);
+	struct weight *w = check_weight(L, 1);
+	float threshold = luaL_optnumber(L, 2, 0);
+	int n = w->w * w->h;
+	int i, j, nnz = 0;
+	for (i=0;i<n;i++) {
+		if (fabsf(w->data[i]) > threshold)
+			++nnz;
+	}
+	struct sparse *s = new_sparse(L, w->w, w->h, nnz);
+	int k = 0;
+	for (i=0;i<w->h;i++) {
+		const float *row = w->data + (size_t)i * w->w;
+		s->row[i] = k;
+		for (j=0;j<w->w;j++) {
+			if (fabsf(row[j]) > threshold) {
+				s->col[k] = j;
+				s->val[k] = row[j];
+				++k;
+			}
+		}
+	}
+	s->row[w->h] = k;
+	return 1;
+}
+
+// ann.prop_batch(input, output, weight) : input is a weight (w, n) of n samples, output is (h, n)
+static int
+lprop_batch(lua_State *L) {
+	struct weight *input = check_weight(L, 1);
+	struct weight *output = check_weight(L, 2);
+	struct sparse *s = test_sparse(L, 3);
+	int w, h;
+	if (s) {
+		w = s->w;
+		h = s->h;
+	} else {
+		struct weight *c = check_weight(L, 3);
+		w = c->w;
+		h = c->h;
+	}
+	if (input->w != w || output->w != h || input->h != output->h)
+		return luaL_error(L, "Invalid batch (%d , %d) -> (%d , %d) with (%d , %d)", input->w, input->h, output->w, output->h, w, h);
+	unrecordable(L, "ann.prop_batch");
+	if (s) {
+		sparse_prop_batch(s, input->data, output->data, input->h, NULL);
+	} else {
+		const float *c = check_weight(L, 3)->data;
+		int i;
+		for (i=0;i<input->h;i++)
+			B->prop(input->data + (size_t)i * w, output->data + (size_t)i * h, c, w, h);
+	}
+	return 0;
+}
+
+// Parameter group : the tensors (signal/weight/filter) of a model packed into one contiguous aligned buffer,
+// the tensors become views into it. So zero/accumulate of a whole model is one call and one pass.
+
+// returns the address of the data pointer of a tensor, and the number of floats
+static float **
+tensor_data(lua_State *L, int index, int *n) {
+	struct signal *s = (struct signal *)luaL_testudata(L, index, "ANN_SIGNAL");
+	if (s) {
+		*n = s->n;
+		return &s->data;
+	}
+	struct weight *w = (struct weight *)luaL_testudata(L, index, "ANN_WEIGHT");
+	if (w) {
+		*n = w->w * w->h;
+		return &w->data;
+	}
+	struct filter *f = (struct filter *)luaL_testudata(L, index, "ANN_FILTER");
+	if (f) {
+		*n = (filter_wsize(f) + 1) * f->n;
+		return &f->f;
+	}
+	struct lowrank *lr = test_lowrank(L, index);
+	if (lr) {
+		*n = lowrank_n(lr);
+		return &lr->data;
+	}
+	luaL_error(L, "Invalid tensor (%s)", luaL_typename(L, index));
+	return NULL;
+}
+
+static int
+lparams_zero(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	struct instruction *ins = RECORD(L, OP_PARAMS_ZERO, 1);
+	if (ins)
+		ins->arg[0] = p;
+	memset(p->data, 0, p->n * sizeof(float));
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+lparams_size(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	lua_pushinteger(L, p->n);
+	return 1;
+}
+
+// with scale, each segment is scaled by eta * lr
+static void
+params_accumulate(struct params *p, const struct params *delta, int scale, float eta) {
+	float *d = p->data;
+	const float *s = delta->data;
+	int i,j;
+	if (scale) {
+		for (i=0;i<p->nseg;i++) {
+			const struct segment *seg = &p->seg[i];
+			float e = eta * seg->lr;
+			float *dd = d + seg->offset;
+			const float *ss = s + seg->offset;
+			for (j=0;j<seg->n;j++) {
+				dd[j] += ss[j] * e;
+			}
+		}
+	} else {
+		for (i=0;i<p->n;i++) {
+			d[i] += s[i];
+		}
+	}
+}
+
+static int
+lparams_accumulate(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	struct params *delta = check_params(L, 2);
+	int i;
+	if (p->n != delta->n || p->nseg != delta->nseg)
+		return luaL_error(L, "params size %d != %d", p->n, delta->n);
+	for (i=0;i<p->nseg;i++) {
+		if (p->seg[i].n != delta->seg[i].n)
+			return luaL_error(L, "params [%d] size %d != %d", i+1, p->seg[i].n, delta->seg[i].n);
+	}
+	int scale = lua_type(L, 3) == LUA_TNUMBER;
+	float eta = scale ? lua_tonumber(L, 3) : 1.0f;
+	struct instruction *ins = RECORD(L, OP_PARAMS_ACCUMULATE, 2);
+	if (ins) {
+		ins->n = scale;
+		ins->eta = eta;
+		ins->arg[0] = p;
+		ins->arg[1] = delta;
+	}
+	params_accumulate(p, delta, scale, eta);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+lparams_views(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	luaL_checkstack(L, p->nseg, NULL);
+	lua_getiuservalue(L, 1, 1);
+	int views = lua_gettop(L);
+	int i;
+	for (i=0;i<p->nseg;i++) {
+		lua_rawgeti(L, views, i+1);
+	}
+	return p->nseg;
+}
+
+static int
+lparams_bytes(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	lua_pushlstring(L, (const char *)p->data, p->n * sizeof(float));
+	return 1;
+}
+
+static int
+lparams_load(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	unrecordable(L, "params:load");
+	load_floats(L, 2, p->data, p->n);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int lparams_clone(lua_State *L);
+
+static struct params *
+new_params(lua_State *L, int nseg, int n) {
+	size_t sz = sizeof(struct params) + (nseg - 1) * sizeof(struct segment) + (n + PARAMS_ALIGN) * sizeof(float);
+	struct params *p = (struct params *)lua_newuserdatauv(L, sz, 1);
+	p->n = n;
+	p->nseg = nseg;
+	uintptr_t align = PARAMS_ALIGN * sizeof(float);
+	p->data = (float *)(((uintptr_t)&p->seg[nseg] + align - 1) & ~(align - 1));
+	memset(p->data, 0, n * sizeof(float));
+	if (luaL_newmetatable(L, "ANN_PARAMS")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "zero", lparams_zero },
+			{ "accumulate", lparams_accumulate },
+			{ "clone", lparams_clone },
+			{ "views", lparams_views },
+			{ "size", lparams_size },
+			{ "bytes", lparams_bytes },
+			{ "load", lparams_load },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	return p;
+}
+
+// the tensor at index, or { tensor, lr = multiplier }
+static float **
+params_member(lua_State *L, int index, int *n, float *lr) {
+	index = lua_absindex(L, index);
+	if (lua_type(L, index) == LUA_TTABLE) {
+		lua_rawgeti(L, index, 1);
+		float ** data = params_member(L, -1, n, lr);
+		lua_getfield(L, index, "lr");
+		*lr = luaL_optnumber(L, -1, 1.0f);
+		lua_pop(L, 2);
+		return data;
+	}
+	*lr = 1.0f;
+	float ** data = tensor_data(L, index, n);
+	// views and members of another group share their storage, it can't move
+	if (lua_getiuservalue(L, index, 1) != LUA_TNIL)
+		luaL_error(L, "The tensor shares storage, can't join params");
+	lua_pop(L, 1);
+	return data;
+}
+
+// ann.params { tensor1, tensor2, { tensor3, lr = 0.1 }, ... }
+static int
+lparams(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	int nseg = lua_rawlen(L, 1);
+	if (nseg <= 0)
+		return luaL_error(L, "Empty params");
+	int i;
+	int n = 0;
+	for (i=0;i<nseg;i++) {
+		int sz;
+		float lr;
+		lua_rawgeti(L, 1, i+1);
+		params_member(L, -1, &sz, &lr);
+		lua_pop(L, 1);
+		n += (sz + PARAMS_ALIGN - 1) / PARAMS_ALIGN * PARAMS_ALIGN;
+	}
+	struct params *p = new_params(L, nseg, n);	// index 2
+	lua_createtable(L, nseg, 0);	// views, index 3
+	int offset = 0;
+	for (i=0;i<nseg;i++) {
+		int sz;
+		float lr;
+		lua_rawgeti(L, 1, i+1);
+		float ** data = params_member(L, -1, &sz, &lr);
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			lua_rawgeti(L, -1, 1);
+			lua_replace(L, -2);
+		}
+		p->seg[i].offset = offset;
+		p->seg[i].n = sz;
+		p->seg[i].lr = lr;
+		float *ptr = p->data + offset;
+		memcpy(ptr, *data, sz * sizeof(float));
+		*data = ptr;
+		lua_pushvalue(L, 2);
+		lua_setiuservalue(L, -2, 1);
+		lua_rawseti(L, 3, i+1);
+		offset += (sz + PARAMS_ALIGN - 1) / PARAMS_ALIGN * PARAMS_ALIGN;
+	}
+	lua_setiuservalue(L, 2, 1);
+	return 1;
+}
+
+// params:clone() returns a new group of the same layout (and values), with new views
+static int
+lparams_clone(lua_State *L) {
+	struct params *p = check_params(L, 1);
+	lua_settop(L, 1);
+	struct params *c = new_params(L, p->nseg, p->n);	// index 2
+	memcpy(c->seg, p->seg, p->nseg * sizeof(struct segment));
+	memcpy(c->data, p->data, p->n * sizeof(float));
+	lua_createtable(L, p->nseg, 0);	// index 3
+	lua_getiuservalue(L, 1, 1);	// index 4
+	int i;
+	for (i=0;i<p->nseg;i++) {
+		int n;
+		lua_rawgeti(L, 4, i+1);
+		void * src = lua_touserdata(L, -1);
+		float ** data = tensor_data(L, -1, &n);
+		// a view needs only the header of the tensor
+		size_t hsz = (char *)data - (char *)src + sizeof(float *) + sizeof(float);
+		void * view = lua_newuserdatauv(L, hsz, 1);
+		memcpy(view, src, hsz);
+		*(float **)((char *)view + ((char *)data - (char *)src)) = c->data + c->seg[i].offset;
+		lua_getmetatable(L, -2);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, 2);
+		lua_setiuservalue(L, -2, 1);
+		lua_rawseti(L, 3, i+1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	lua_setiuservalue(L, 2, 1);
+	return 1;
+}
+
+// Hogwild : threads pull samples from a shared cursor, and update the shared parameters without locks.
+
+#define HOGWILD_MAX_THREADS 64
+
+struct hogwild_model {
+	struct filter *filter;	// NULL for the dense network
+	struct weight *weight_ih;
+	struct signal *bias_hidden;
+	struct weight *weight_ho;
+	struct signal *bias_output;
+	float filter_lr;
+	int lean;	// no convolution signal, see filter_convpool_argmax()
+	int input;
+	int conv;
+	int pooling;
+	int hidden;
+	int output;
+};
+
+struct hogwild {
+	const struct hogwild_model *m;
+	const uint8_t *images;
+	const uint8_t *labels;
+	const uint32_t *order;
+	atomic_int *cursor;
+	float *buffer;	// hogwild_buffer_size() floats, then pooling + 1 argmax
+	struct filter filter_delta;	// the header of the filter gradient in buffer
+	int count;
+	int batch;
+	float eta;
+	// stats
+	int samples;
+	int errors;
+	double seconds;
+};
+
+static inline double
+wall_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+add_scaled(float *dst, const float *src, int n, float eta) {
+	int i;
+	for (i=0;i<n;i++) {
+		dst[i] += src[i] * eta;
+	}
+}
+
+static inline int
+hogwild_grad_size(const struct hogwild_model *m) {
+	int nfilter = m->filter ? (filter_wsize(m->filter) + 1) * m->filter->n : 0;
+	return m->weight_ih->w * m->hidden + m->hidden * m->output + m->hidden + m->output + nfilter;
+}
+
+// floats of the buffer of a thread
+static inline size_t
+hogwild_buffer_size(const struct hogwild_model *m) {
+	// conv and db_conv, none when lean
+	size_t nconv = m->lean ? 0 : (size_t)m->conv * 2;
+	return m->input + nconv + (size_t)m->pooling * 2 + m->hidden + m->output + (size_t)hogwild_grad_size(m) * 2;
+}
+
+static void *
+hogwild_thread(void *ud) {
+	struct hogwild *H = (struct hogwild *)ud;
+	const struct hogwild_model *m = H->m;
+	double start = wall_clock();
+	int dense = m->weight_ih->w;
+	int nw_ih = dense * m->hidden;
+	int nw_ho = m->hidden * m->output;
+	int nfilter = m->filter ? (filter_wsize(m->filter) + 1) * m->filter->n : 0;
+	int ngrad = hogwild_grad_size(m);
+	int nconv = m->lean ? 0 : m->conv * 2;
+	float *buffer = H->buffer;
+	int *argmax = (int *)(buffer + hogwild_buffer_size(m));
+	float *input = buffer;
+	float *conv = input + m->input;
+	float *db_conv = m->lean ? NULL : conv + m->conv;
+	float *pooling = conv + nconv;
+	float *db_pooling = pooling + m->pooling;
+	float *hidden = db_pooling + m->pooling;
+	float *output = hidden + m->hidden;
+	// gradient : dw_ih, dw_ho, db_hidden, db_output, filter
+	float *grad = output + m->output;
+	float *sum = grad + ngrad;
+	float *dw_ih = grad;
+	float *dw_ho = dw_ih + nw_ih;
+	float *db_hidden = dw_ho + nw_ho;
+	float *db_output = db_hidden + m->hidden;
+	struct filter *filter_delta = NULL;
+	if (m->filter) {
+		filter_delta = &H->filter_delta;
+		*filter_delta = *m->filter;
+		filter_delta->f = db_output + m->output;
+	}
+	const float *x = m->filter ? pooling : input;
+	int i,j;
+	for (;;) {
+		int first = atomic_fetch_add(H->cursor, H->batch);
+		if (first >= H->count)
+			break;
+		int last = first + H->batch;
+		if (last > H->count)
+			last = H->count;
+		for (i=first;i<last;i++) {
+			int idx = H->order[i];
+			const uint8_t *image = H->images + (size_t)idx * m->input;
+			int label = H->labels[idx];
+			for (j=0;j<m->input;j++) {
+				input[j] = image[j] / 255.0f;
+			}
+			// feedforward
+			if (m->lean) {
+				B->convpool_argmax(m->filter, input, pooling, argmax);
+			} else if (m->filter) {
+				B->convolution(m->filter, input, conv);
+				B->maxpooling_argmax(m->filter, conv, pooling, argmax);
+				for (j=0;j<m->pooling;j++) {
+					if (pooling[j] < 0)
+						pooling[j] = 0;
+				}
+			}
+			B->prop(x, hidden, m->weight_ih->data, dense, m->hidden);
+			for (j=0;j<m->hidden;j++) {
+				hidden[j] = sigmoid(hidden[j] + m->bias_hidden->data[j]);
+			}
+			B->prop(hidden, output, m->weight_ho->data, m->hidden, m->output);
+			int r = 0;
+			for (j=0;j<m->output;j++) {
+				output[j] += m->bias_output->data[j];
+				if (output[j] > output[r])
+					r = j;
+			}
+			if (r != label)
+				++H->errors;
+			// backprop
+			softmax(output, db_output, m->output);
+			db_output[label] -= 1.0f;
+			B->backprop_weight(hidden, db_output, dw_ho, m->hidden, m->output);
+			B->backprop_bias(db_hidden, db_output, m->weight_ho->data, m->hidden, m->output);
+			for (j=0;j<m->hidden;j++) {
+				db_hidden[j] *= sigmoid_prime(hidden[j]);
+			}
+			B->backprop_weight(x, db_hidden, dw_ih, dense, m->hidden);
+			if (m->filter) {
+				B->backprop_bias(db_pooling, db_hidden, m->weight_ih->data, dense, m->hidden);
+				for (j=0;j<m->pooling;j++) {
+					if (pooling[j] <= 0)
+						db_pooling[j] = 0;
+				}
+				B->backprop_conv_bias(filter_delta, db_pooling, m->pooling / m->filter->n);
+				if (m->lean) {
+					B->backprop_conv_weight_argmax(filter_delta, input, db_pooling, argmax);
+				} else {
+					B->maxpooling_scatter(db_pooling, argmax, m->pooling, db_conv, m->conv);
+					B->backprop_conv_weight(filter_delta, input, db_conv);
+				}
+			}
+			if (last - first > 1) {
+				if (i == first)
+					memcpy(sum, grad, ngrad * sizeof(float));
+				else
+					add_scaled(sum, grad, ngrad, 1.0f);
+			}
+		}
+		// apply the update to the shared parameters without lock
+		const float *g = last - first > 1 ? sum : grad;
+		float eta = - H->eta / (last - first);
+		add_scaled(m->weight_ih->data, g, nw_ih, eta);
+		g += nw_ih;
+		add_scaled(m->weight_ho->data, g, nw_ho, eta);
+		g += nw_ho;
+		add_scaled(m->bias_hidden->data, g, m->hidden, eta);
+		g += m->hidden;
+		add_scaled(m->bias_output->data, g, m->output, eta);
+		g += m->output;
+		if (m->filter) {
+			add_scaled(m->filter->f, g, nfilter, eta * m->filter_lr);
+		}
+		H->samples += last - first;
+	}
+	H->seconds = wall_clock() - start;
+	return NULL;
+}
+
+// raw bytes of a string or a userdata (MNIST_IMAGES/MNIST_LABELS/MNIST_IDX)
+static const uint8_t *
+raw_bytes(lua_State *L, int index, size_t *sz) {
+	if (lua_type(L, index) == LUA_TSTRING)
+		return (const uint8_t *)lua_tolstring(L, index, sz);
+	if (luaL_testudata(L, index, "MNIST_IMAGES") || luaL_testudata(L, index, "MNIST_LABELS") || luaL_testudata(L, index, "MNIST_IDX")) {
+		*sz = lua_rawlen(L, index);
+		return (const uint8_t *)lua_touserdata(L, index);
+	}
+	luaL_error(L, "Need string or mnist images/labels/idx (%s)", luaL_typename(L, index));
+	return NULL;
+}
+
+static void *
+hogwild_field(lua_State *L, const char *key, const char *type, int optional) {
+	lua_getfield(L, 1, key);
+	void *ud = luaL_testudata(L, -1, type);
+	if (ud == NULL && !(optional && lua_isnil(L, -1)))
+		luaL_error(L, ".%s should be %s", key, type);
+	lua_pop(L, 1);
+	return ud;
+}
+
+static inline uint32_t
+xorshift32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/*
+	ann.hogwild {
+		images = images, labels = labels,	-- mnist images/labels, or strings
+		weight_ih = weight, bias_hidden = signal, weight_ho = weight, bias_output = signal,
+		filter = filter,	-- optional, for the cnn
+		filter_lr = 1,	-- learning rate multiplier of filter
+		lean = false,	-- true : don't keep the convolution signal of the filter, see filter:convpool(input, output, argmax)
+		threads = 4,
+		eta = 3.0,
+		batch = 1,	-- samples per update of a thread
+		seed = 0,
+	}
+	returns { samples = n, seconds = t, errors = e, { samples = n, seconds = t, errors = e }, ... }
+ */
+static int
+lhogwild(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	struct hogwild_model m;
+	m.filter = (struct filter *)hogwild_field(L, "filter", "ANN_FILTER", 1);
+	m.weight_ih = (struct weight *)hogwild_field(L, "weight_ih", "ANN_WEIGHT", 0);
+	m.bias_hidden = (struct signal *)hogwild_field(L, "bias_hidden", "ANN_SIGNAL", 0);
+	m.weight_ho = (struct weight *)hogwild_field(L, "weight_ho", "ANN_WEIGHT", 0);
+	m.bias_output = (struct signal *)hogwild_field(L, "bias_output", "ANN_SIGNAL", 0);
+	m.hidden = m.weight_ih->h;
+	m.output = m.weight_ho->h;
+	if (m.bias_hidden->n != m.hidden || m.weight_ho->w != m.hidden || m.bias_output->n != m.output)
+		return luaL_error(L, "Invalid model (%d, %d) (%d, %d)", m.weight_ih->w, m.weight_ih->h, m.weight_ho->w, m.weight_ho->h);
+	if (m.filter) {
+		int dw, dh;
+		filter_output_size(m.filter, &dw, &dh);
+		m.input = m.filter->src_w * m.filter->src_h * m.filter->channel;
+		m.conv = dw * dh * m.filter->n;
+		int pw, ph;
+		filter_pooling_size(m.filter, &pw, &ph);
+		m.pooling = pw * ph * m.filter->n;
+		if (m.pooling != m.weight_ih->w)
+			return luaL_error(L, "Invalid weight_ih %d != filter output %d", m.weight_ih->w, m.pooling);
+	} else {
+		m.input = m.weight_ih->w;
+		m.conv = 0;
+		m.pooling = 0;
+	}
+	lua_getfield(L, 1, "filter_lr");
+	m.filter_lr = luaL_optnumber(L, -1, 1.0f);
+	lua_getfield(L, 1, "lean");
+	m.lean = m.filter && lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, 1, "threads");
+	int threads = luaL_optinteger(L, -1, 1);
+	lua_getfield(L, 1, "eta");
+	float eta = luaL_checknumber(L, -1);
+	lua_getfield(L, 1, "batch");
+	int batch = luaL_optinteger(L, -1, 1);
+	lua_getfield(L, 1, "seed");
+	uint32_t seed = (uint32_t)luaL_optinteger(L, -1, rand());
+	lua_pop(L, 5);
+	if (threads <= 0 || threads > HOGWILD_MAX_THREADS)
+		return luaL_error(L, "Invalid threads %d", threads);
+	if (batch <= 0)
+		return luaL_error(L, "Invalid batch %d", batch);
+
+	size_t images_sz, labels_sz;
+	lua_getfield(L, 1, "images");	// index 2
+	const uint8_t *images = raw_bytes(L, 2, &images_sz);
+	lua_getfield(L, 1, "labels");	// index 3
+	const uint8_t *labels = raw_bytes(L, 3, &labels_sz);
+	int count = (int)labels_sz;
+	if (images_sz < (size_t)count * m.input)
+		return luaL_error(L, "Invalid images size %d < %d * %d", (int)images_sz, count, m.input);
+	int i;
+	for (i=0;i<count;i++) {
+		if (labels[i] >= m.output)
+			return luaL_error(L, "Invalid label [%d] = %d", i+1, labels[i]);
+	}
+
+	uint32_t *order = (uint32_t *)lua_newuserdatauv(L, (count + 1) * sizeof(uint32_t), 0);
+	for (i=0;i<count;i++) {
+		order[i] = i;
+	}
+	if (seed == 0)
+		seed = 1;
+	for (i=count-1;i>0;i--) {
+		int r = xorshift32(&seed) % (i + 1);
+		uint32_t tmp = order[i];
+		order[i] = order[r];
+		order[r] = tmp;
+	}
+
+	atomic_int cursor;
+	atomic_init(&cursor, 0);
+	struct hogwild H[HOGWILD_MAX_THREADS];
+	pthread_t pid[HOGWILD_MAX_THREADS];
+	size_t nbuf = hogwild_buffer_size(&m) * sizeof(float) + (m.pooling + 1) * sizeof(int);
+	for (i=0;i<threads;i++) {
+		// the buffers of the threads stay on the stack until return
+		H[i].buffer = (float *)lua_newuserdatauv(L, nbuf, 0);
+	}
+	double start = wall_clock();
+	for (i=0;i<threads;i++) {
+		struct hogwild *h = &H[i];
+		h->m = &m;
+		h->images = images;
+		h->labels = labels;
+		h->order = order;
+		h->cursor = &cursor;
+		h->count = count;
+		h->batch = batch;
+		h->eta = eta;
+		h->samples = 0;
+		h->errors = 0;
+		h->seconds = 0;
+	}
+	int n = 0;
+	for (i=1;i<threads;i++) {
+		if (pthread_create(&pid[i], NULL, hogwild_thread, &H[i]) != 0)
+			break;
+		++n;
+	}
+	hogwild_thread(&H[0]);
+	for (i=1;i<=n;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	double seconds = wall_clock() - start;
+
+	lua_createtable(L, n+1, 3);
+	int samples = 0, errors = 0;
+	for (i=0;i<=n;i++) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, H[i].samples);
+		lua_setfield(L, -2, "samples");
+		lua_pushinteger(L, H[i].errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushnumber(L, H[i].seconds);
+		lua_setfield(L, -2, "seconds");
+		lua_rawseti(L, -2, i+1);
+		samples += H[i].samples;
+		errors += H[i].errors;
+	}
+	lua_pushinteger(L, samples);
+	lua_setfield(L, -2, "samples");
+	lua_pushinteger(L, errors);
+	lua_setfield(L, -2, "errors");
+	lua_pushnumber(L, seconds);
+	lua_setfield(L, -2, "seconds");
+	return 1;
+}
+
+// Tape : ann.record(f, ...) calls f(...) and records the ops it runs (and their tensors) into a tape.
+// tape:run() replays them in C, without the Lua dispatch and the size checks. signal:init isn't recorded,
+// so set the inputs before tape:run(), or feed them by tape:batch(from, to, signal, list, ...).
+
+struct tape {
+	int n;
+	int cap;
+	struct instruction *code;
+};
+
+static int tape_key;	// registry[&tape_key] is the tape being recorded by this lua_State
+
+static int
+tape_recording(lua_State *L) {
+	int r = lua_rawgetp(L, LUA_REGISTRYINDEX, &tape_key) == LUA_TUSERDATA;
+	lua_pop(L, 1);
+	return r;
+}
+
+static struct instruction *
+record_op(lua_State *L, int op, int nargs) {
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, &tape_key) != LUA_TUSERDATA) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	struct tape *t = (struct tape *)lua_touserdata(L, -1);
+	// the tape keeps the arguments alive
+	lua_getiuservalue(L, -1, 1);
+	int i;
+	for (i=1;i<=nargs;i++) {
+		lua_pushvalue(L, i);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 2);
+	if (t->n >= t->cap) {
+		int cap = t->cap ? t->cap * 2 : 16;
+		struct instruction *code = (struct instruction *)realloc(t->code, cap * sizeof(*code));
+		if (code == NULL)
+			luaL_error(L, "Out of memory");
+		t->code = code;
+		t->cap = cap;
+	}
+	struct instruction *ins = &t->code[t->n++];
+	memset(ins, 0, sizeof(*ins));
+	ins->op = op;
+	return ins;
+}
+
+#define TENSOR(i) (*(float **)ins->arg[i])
+
+static void
+tape_run(const struct tape *t) {
+	const struct instruction *ins = t->code;
+	int i;
+	for (i=0;i<t->n;i++,ins++) {
+		switch (ins->op) {
+		case OP_ACCUMULATE:
+			B->accumulate(TENSOR(0), TENSOR(1), ins->n, ins->eta);
+			break;
+		case OP_SIGMOID:
+			B->sigmoid(TENSOR(0), ins->n);
+			break;
+		case OP_RELU:
+			B->relu(TENSOR(0), ins->n);
+			break;
+		case OP_PROP: {
+			const struct weight *w = (const struct weight *)ins->arg[2];
+			B->prop(TENSOR(0), TENSOR(1), w->data, w->w, w->h);
+			break;
+		}
+		case OP_BACKPROP_WEIGHT: {
+			const struct weight *w = (const struct weight *)ins->arg[2];
+			B->backprop_weight(TENSOR(0), TENSOR(1), w->data, w->w, w->h);
+			break;
+		}
+		case OP_BACKPROP_BIAS: {
+			const struct weight *w = (const struct weight *)ins->arg[2];
+			B->backprop_bias(TENSOR(0), TENSOR(1), w->data, w->w, w->h);
+			break;
+		}
+		case OP_BACKPROP_SIGMOID:
+			B->backprop_sigmoid(TENSOR(0), TENSOR(1), ins->n);
+			break;
+		case OP_BACKPROP_RELU:
+			B->backprop_relu(TENSOR(0), TENSOR(1), ins->n);
+			break;
+		case OP_SOFTMAX_ERROR:
+			B->softmax_error(TENSOR(0), TENSOR(1), TENSOR(2), ins->n);
+			break;
+		case OP_CONVOLUTION:
+			B->convolution((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2));
+			break;
+		case OP_CONVPOOL:
+			B->convpool((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2));
+			break;
+		case OP_MAXPOOLING:
+			B->maxpooling((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2));
+			break;
+		case OP_MAXPOOLING_ARGMAX:
+			B->maxpooling_argmax((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2), ((struct argmax *)ins->arg[3])->index);
+			break;
+		case OP_BACKPROP_CONV_BIAS:
+			B->backprop_conv_bias((struct filter *)ins->arg[0], TENSOR(1), ins->n);
+			break;
+		case OP_BACKPROP_MAXPOOLING:
+			B->backprop_maxpooling((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2));
+			break;
+		case OP_BACKPROP_MAXPOOLING_ARGMAX: {
+			const struct filter *f = (const struct filter *)ins->arg[0];
+			int dw,dh;
+			filter_output_size(f, &dw, &dh);
+			B->maxpooling_scatter(TENSOR(2), ((struct argmax *)ins->arg[3])->index, ins->n, TENSOR(1), dw * dh * f->n);
+			break;
+		}
+		case OP_BACKPROP_CONV_WEIGHT:
+			B->backprop_conv_weight((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2));
+			break;
+		case OP_BACKPROP_CONV_INPUT:
+			B->backprop_conv_input((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2));
+			break;
+		case OP_PARAMS_ZERO: {
+			struct params *p = (struct params *)ins->arg[0];
+			memset(p->data, 0, p->n * sizeof(float));
+			break;
+		}
+		case OP_PARAMS_ACCUMULATE:
+			params_accumulate((struct params *)ins->arg[0], (const struct params *)ins->arg[1], ins->n, ins->eta);
+			break;
+		case OP_PROP_LOWRANK:
+			lowrank_prop((const struct lowrank *)ins->arg[2], TENSOR(0), TENSOR(1));
+			break;
+		case OP_BACKPROP_BIAS_LOWRANK:
+			lowrank_backprop_bias((const struct lowrank *)ins->arg[2], TENSOR(0), TENSOR(1));
+			break;
+		case OP_BACKPROP_LOWRANK:
+			lowrank_backprop_weight((const struct lowrank *)ins->arg[0], TENSOR(1), TENSOR(2), (struct lowrank *)ins->arg[3]);
+			break;
+		case OP_PROP_SPARSE:
+			sparse_prop((const struct sparse *)ins->arg[2], TENSOR(0), TENSOR(1));
+			break;
+		case OP_CONVPOOL_ARGMAX:
+			B->convpool_argmax((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2), ((struct argmax *)ins->arg[3])->index);
+			break;
+		case OP_BACKPROP_CONV_WEIGHT_ARGMAX:
+			B->backprop_conv_weight_argmax((struct filter *)ins->arg[0], TENSOR(1), TENSOR(2), ((const struct argmax *)ins->arg[3])->index);
+			break;
+		}
+	}
+}
+
+static struct tape *
+check_tape(lua_State *L, int index) {
+	return (struct tape *)luaL_checkudata(L, index, "ANN_TAPE");
+}
+
+static int
+ltape_run(lua_State *L) {
+	struct tape *t = check_tape(L, 1);
+	tape_run(t);
+	return 0;
+}
+
+// tape:batch(from, to, signal1, list1, signal2, list2, ...) : for i = from, to, init each signal with list[i]
+// (an image string or pointer, a label or a signal ; a list of pointers has .stride) and run the tape. Returns the samples, it stops at the end of a list.
+static int
+ltape_batch(lua_State *L) {
+	struct tape *t = check_tape(L, 1);
+	int from = luaL_checkinteger(L, 2);
+	int to = luaL_checkinteger(L, 3);
+	int top = lua_gettop(L);
+	int feeds = (top - 3) / 2;
+	if (feeds * 2 != top - 3)
+		return luaL_error(L, "Need signal, list pairs");
+	int i,j;
+	for (j=0;j<feeds;j++) {
+		check_signal(L, 4 + j * 2);
+		int t = lua_type(L, 5 + j * 2);
+		if (t != LUA_TTABLE && t != LUA_TUSERDATA)
+			return luaL_typeerror(L, 5 + j * 2, "list");
+	}
+	for (i=from;i<=to;i++) {
+		for (j=0;j<feeds;j++) {
+			struct signal *s = (struct signal *)lua_touserdata(L, 4 + j * 2);
+			if (!init_signal_with_item(L, s, 5 + j * 2, i)) {
+				lua_pushinteger(L, i - from);
+				return 1;
+			}
+		}
+		tape_run(t);
+	}
+	lua_pushinteger(L, to < from ? 0 : to - from + 1);
+	return 1;
+}
+
+static int
+ltape_size(lua_State *L) {
+	struct tape *t = check_tape(L, 1);
+	lua_pushinteger(L, t->n);
+	return 1;
+}
+
+static int
+ltape_gc(lua_State *L) {
+	struct tape *t = check_tape(L, 1);
+	free(t->code);
+	t->code = NULL;
+	t->n = 0;
+	t->cap = 0;
+	return 0;
+}
+
+// Async : tape:async() resolves the feeds of each sample in the caller, then a native worker thread
+// runs the samples. The handle is polled, joined, or waited by a coroutine (it yields until the job is done).
+// Jobs run one by one in the order they are queued. Don't touch the tensors of a tape until its job is done.
+
+enum {
+	FEED_BYTES,	// pixels, from a string or a pointer
+	FEED_LABEL,
+	FEED_SIGNAL,
+};
+
+struct feed {
+	int kind;
+	int label;
+	const void *ptr;
+};
+
+struct async_job {
+	struct async_job *next;
+	const struct tape *t;
+	int samples;
+	int feeds;
+	int slots;	// feeds + 1 for the label of async_test
+	int done;
+	int errors;
+	struct signal *output;	// argmax of output is compared with the label, NULL for tape:async()
+	struct signal **dst;
+	struct feed *feed;	// samples * slots
+};
+
+struct async_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t job;
+	pthread_cond_t done;
+	int started;
+	struct async_job *head;
+	struct async_job *tail;
+};
+
+static struct async_queue Q = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+};
+
+static int
+signal_argmax(const struct signal *s) {
+	int i;
+	int idx = 0;
+	for (i=1;i<s->n;i++) {
+		if (s->data[i] > s->data[idx])
+			idx = i;
+	}
+	return idx;
+}
+
+static void
+async_run(struct async_job *j) {
+	int i,k;
+	for (i=0;i<j->samples;i++) {
+		const struct feed *f = j->feed + i * j->slots;
+		for (k=0;k<j->feeds;k++) {
+			struct signal *s = j->dst[k];
+			switch (f[k].kind) {
+			case FEED_BYTES:
+				init_signal_with_bytes(s, (const uint8_t *)f[k].ptr);
+				break;
+			case FEED_LABEL:
+				memset(s->data, 0, s->n * sizeof(float));
+				s->data[f[k].label] = 1.0f;
+				break;
+			case FEED_SIGNAL:
+				memcpy(s->data, ((const struct signal *)f[k].ptr)->data, s->n * sizeof(float));
+				break;
+			}
+		}
+		tape_run(j->t);
+		if (j->output && signal_argmax(j->output) != f[j->feeds].label)
+			++j->errors;
+	}
+}
+
+static void *
+async_thread(void *ud) {
+	struct async_queue *q = (struct async_queue *)ud;
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (q->head == NULL)
+			pthread_cond_wait(&q->job, &q->lock);
+		struct async_job *j = q->head;
+		pthread_mutex_unlock(&q->lock);
+
+		async_run(j);
+
+		pthread_mutex_lock(&q->lock);
+		q->head = j->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		j->done = 1;
+		pthread_cond_broadcast(&q->done);
+		pthread_mutex_unlock(&q->lock);
+	}
+	return NULL;
+}
+
+static int
+async_submit(struct async_job *j) {
+	struct async_queue *q = &Q;
+	pthread_mutex_lock(&q->lock);
+	if (!q->started) {
+		pthread_t pid;
+		if (pthread_create(&pid, NULL, async_thread, q) != 0) {
+			pthread_mutex_unlock(&q->lock);
+			return 0;
+		}
+		pthread_detach(pid);
+		q->started = 1;
+	}
+	j->next = NULL;
+	if (q->tail)
+		q->tail->next = j;
+	else
+		q->head = j;
+	q->tail = j;
+	pthread_cond_signal(&q->job);
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+static int
+async_done(struct async_job *j) {
+	pthread_mutex_lock(&Q.lock);
+	int done = j->done;
+	pthread_mutex_unlock(&Q.lock);
+	return done;
+}
+
+static void
+async_join(struct async_job *j) {
+	pthread_mutex_lock(&Q.lock);
+	while (!j->done)
+		pthread_cond_wait(&Q.done, &Q.lock);
+	pthread_mutex_unlock(&Q.lock);
+}
+
+static struct async_job *
+check_job(lua_State *L, int index) {
+	return (struct async_job *)luaL_checkudata(L, index, "ANN_ASYNC");
+}
+
+static int
+async_results(lua_State *L, struct async_job *j) {
+	lua_pushinteger(L, j->samples);
+	if (j->output) {
+		lua_pushinteger(L, j->errors);
+		return 2;
+	}
+	return 1;
+}
+
+// handle:poll() : false, or true and the results
+static int
+lasync_poll(lua_State *L) {
+	struct async_job *j = check_job(L, 1);
+	if (!async_done(j)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushboolean(L, 1);
+	return 1 + async_results(L, j);
+}
+
+// handle:join() : block until the job is done, returns the results
+static int
+lasync_join(lua_State *L) {
+	struct async_job *j = check_job(L, 1);
+	async_join(j);
+	return async_results(L, j);
+}
+
+static int
+lasync_wait_k(lua_State *L, int status, lua_KContext ctx) {
+	(void)status;
+	(void)ctx;
+	struct async_job *j = check_job(L, 1);
+	if (!async_done(j)) {
+		if (lua_isyieldable(L)) {
+			lua_settop(L, 1);
+			lua_pushvalue(L, 1);
+			return lua_yieldk(L, 1, 0, lasync_wait_k);
+		}
+		async_join(j);
+	}
+	return async_results(L, j);
+}
+
+// handle:wait() : in a coroutine, yield the handle until the job is done; else join. returns the results
+static int
+lasync_wait(lua_State *L) {
+	return lasync_wait_k(L, LUA_OK, 0);
+}
+
+// the job must finish before its memory (and the tensors it uses) can be collected
+static int
+lasync_gc(lua_State *L) {
+	struct async_job *j = check_job(L, 1);
+	async_join(j);
+	return 0;
+}
+
+// resolve list[i] into a feed of signal s, keep the value alive in the table at keep
+static int
+async_feed(lua_State *L, struct signal *s, int list, int i, struct feed *f, int keep) {
+	int t = lua_geti(L, list, i);
+	switch (t) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		return 0;
+	case LUA_TSTRING: {
+		size_t sz;
+		f->kind = FEED_BYTES;
+		f->ptr = lua_tolstring(L, -1, &sz);
+		if (sz != s->n)
+			return luaL_error(L, "Invalid image size %d != %d", (int)sz, s->n);
+		break;
+	}
+	case LUA_TLIGHTUSERDATA:
+		f->kind = FEED_BYTES;
+		f->ptr = check_item_bytes(L, s, list);
+		break;
+	case LUA_TNUMBER:
+		f->kind = FEED_LABEL;
+		f->label = lua_tointeger(L, -1);
+		if (f->label < 0 || f->label >= s->n)
+			return luaL_error(L, "Invalid n (%d)", f->label);
+		break;
+	default: {
+		struct signal *src = check_signal(L, -1);
+		if (src->n != s->n)
+			return luaL_error(L, "Invalid feed size %d != %d", src->n, s->n);
+		f->kind = FEED_SIGNAL;
+		f->ptr = src;
+		break;
+	}
+	}
+	if (t == LUA_TSTRING || t == LUA_TUSERDATA)
+		lua_rawseti(L, keep, lua_rawlen(L, keep) + 1);
+	else
+		lua_pop(L, 1);
+	return 1;
+}
+
+// args at index base : signal1, list1, ... ; labels is the list of the expected labels (0 for none)
+static int
+async_new(lua_State *L, struct tape *t, int from, int to, int base, struct signal *output, int labels) {
+	int top = lua_gettop(L);
+	int feeds = (top - base + 1) / 2;
+	if (feeds * 2 != top - base + 1)
+		return luaL_error(L, "Need signal, list pairs");
+	int i,j;
+	for (j=0;j<feeds;j++) {
+		check_signal(L, base + j * 2);
+		int tt = lua_type(L, base + 1 + j * 2);
+		if (tt != LUA_TTABLE && tt != LUA_TUSERDATA)
+			return luaL_typeerror(L, base + 1 + j * 2, "list");
+	}
+	int samples = to < from ? 0 : to - from + 1;
+	int slots = feeds + (output != NULL);
+	size_t sz = sizeof(struct async_job) + feeds * sizeof(struct signal *) + (size_t)samples * slots * sizeof(struct feed);
+	struct async_job *job = (struct async_job *)lua_newuserdatauv(L, sz, 1);
+	memset(job, 0, sizeof(*job));
+	job->done = 1;	// not queued yet, so __gc doesn't wait
+	job->t = t;
+	job->feeds = feeds;
+	job->slots = slots;
+	job->output = output;
+	job->dst = (struct signal **)(job + 1);
+	job->feed = (struct feed *)(job->dst + feeds);
+	if (luaL_newmetatable(L, "ANN_ASYNC")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "poll", lasync_poll },
+			{ "join", lasync_join },
+			{ "wait", lasync_wait },
+			{ "__gc", lasync_gc },
+			{ "__close", lasync_gc },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	int handle = lua_gettop(L);
+	// keep the args (the tape, signals and lists) and the feed values alive
+	lua_createtable(L, top, 0);
+	int keep = handle + 1;
+	for (i=1;i<=top;i++) {
+		lua_pushvalue(L, i);
+		lua_rawseti(L, keep, i);
+	}
+	for (j=0;j<feeds;j++) {
+		job->dst[j] = (struct signal *)lua_touserdata(L, base + j * 2);
+	}
+	int n;
+	for (n=0;n<samples;n++) {
+		struct feed *f = job->feed + n * slots;
+		for (j=0;j<feeds;j++) {
+			if (!async_feed(L, job->dst[j], base + 1 + j * 2, from + n, &f[j], keep))
+				goto end;
+		}
+		if (output) {
+			if (lua_geti(L, labels, from + n) == LUA_TNIL) {
+				lua_pop(L, 1);
+				break;
+			}
+			f[feeds].label = (int)luaL_checkinteger(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+end:
+	job->samples = n;
+	lua_setiuservalue(L, handle, 1);
+	job->done = 0;
+	if (!async_submit(job)) {
+		job->done = 1;
+		return luaL_error(L, "Can't create async thread");
+	}
+	return 1;
+}
+
+// tape:async(from, to, signal1, list1, ...) : tape:batch() in a worker thread, returns a handle (result : samples)
+static int
+ltape_async(lua_State *L) {
+	struct tape *t = check_tape(L, 1);
+	int from = luaL_checkinteger(L, 2);
+	int to = luaL_checkinteger(L, 3);
+	return async_new(L, t, from, to, 4, NULL, 0);
+}
+
+// tape:async_test(from, to, output, labels, signal1, list1, ...) : like tape:async(),
+// and counts the samples whose argmax of output isn't labels[i] (result : samples, errors)
+static int
+ltape_async_test(lua_State *L) {
+	struct tape *t = check_tape(L, 1);
+	int from = luaL_checkinteger(L, 2);
+	int to = luaL_checkinteger(L, 3);
+	struct signal *output = check_signal(L, 4);
+	int tt = lua_type(L, 5);
+	if (tt != LUA_TTABLE && tt != LUA_TUSERDATA)
+		return luaL_typeerror(L, 5, "list");
+	return async_new(L, t, from, to, 6, output, 5);
+}
+
+static int
+lrecord(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	if (tape_recording(L))
+		return luaL_error(L, "Already recording");
+	struct tape *t = (struct tape *)lua_newuserdatauv(L, sizeof(*t), 1);
+	t->n = 0;
+	t->cap = 0;
+	t->code = NULL;
+	if (luaL_newmetatable(L, "ANN_TAPE")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "run", ltape_run },
+			{ "batch", ltape_batch },
+			{ "async", ltape_async },
+			{ "async_test", ltape_async_test },
+			{ "size", ltape_size },
+			{ "__gc", ltape_gc },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &tape_key);
+	lua_insert(L, 1);
+
+	atomic_fetch_add(&recording, 1);
+	int err = lua_pcall(L, lua_gettop(L) - 2, 0, 0);
+	atomic_fetch_sub(&recording, 1);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &tape_key);
+	if (err != LUA_OK)
+		return lua_error(L);
+	lua_settop(L, 1);
+	return 1;
+}
+
+// Backends : reference is the plain scalar code, simd adds the vectorized and specialized kernels,
+// threaded (the default) runs the big simd kernels on the thread pool (see ann.threads).
+// Verification runs the reference beside the selected backend, and keeps the max error of each op.
+
+static void
+reference_convolution(struct filter *f, const float *input, float *output) {
+	filter_convolution_range(reference_kernel(f), f, input, output, 0, f->n);
+}
+
+static void
+reference_convpool(struct filter *f, const float *input, float *output) {
+	filter_convpool_kernel(reference_kernel(f), f, input, output);
+}
+
+static void
+reference_backprop_conv_weight(struct filter *f, const float *input, const float *delta) {
+	filter_backprop_weight_range(reference_kernel(f), f, input, delta, 0, f->n);
+}
+
+static void
+reference_convpool_argmax(struct filter *f, const float *input, float *output, int *index) {
+	convpool_argmax_kernel(reference_kernel(f), f, input, output, index);
+}
+
+// the general path of any pool_stride (the simd one without memory)
+static void
+reference_backprop_maxpooling(struct filter *f, float *conv_img, const float *delta_img) {
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	float *plane = (float *)malloc(dw * dh * sizeof(float));
+	if (plane == NULL) {
+		filter_backprop_maxpooling(f, conv_img, delta_img);
+		return;
+	}
+	int i;
+	for (i=0;i<f->n;i++) {
+		pooling_max_backprop_strided(f, delta_img, conv_img, plane);
+		delta_img += pw * ph;
+		conv_img += dw * dh;
+	}
+	free(plane);
+}
+
+// scatter the pooling delta into a convolution delta, then the weight gradient of all the windows
+// (the simd one without memory)
+static void
+reference_backprop_conv_weight_argmax(struct filter *f, const float *input, const float *delta, const int *index) {
+	int dw,dh,pw,ph;
+	filter_output_size(f, &dw, &dh);
+	filter_pooling_size(f, &pw, &ph);
+	int conv_n = dw * dh * f->n;
+	float *conv = (float *)malloc(conv_n * sizeof(float));
+	if (conv == NULL) {
+		filter_backprop_weight_argmax(f, input, delta, index);
+		return;
+	}
+	pooling_max_scatter(delta, index, pw * ph * f->n, conv, conv_n);
+	reference_backprop_conv_weight(f, input, conv);
+	free(conv);
+}
+
+// the general path of any stride and padding
+static void
+reference_backprop_conv_input(struct filter *f, const float *delta_img, float *input) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	memset(input, 0, f->src_w * f->src_h * f->channel * sizeof(float));
+	int i;
+	for (i=0;i<f->n;i++) {
+		conv_backprop_input_strided(f, delta_img, input, filter_weight(f, i));
+		delta_img += dw * dh;
+	}
+}
+
+static const struct backend reference_backend = {
+	"reference",
+	signal_accumulate,
+	signal_sigmoid,
+	signal_relu,
+	prop,
+	backprop_weight,
+	backprop_bias,
+	backprop_sigmoid,
+	backprop_relu,
+	softmax_error,
+	reference_convolution,
+	reference_convpool,
+	filter_maxpooling,
+	reference_backprop_conv_weight,
+	filter_maxpooling_argmax,
+	reference_convpool_argmax,
+	reference_backprop_maxpooling,
+	reference_backprop_conv_weight_argmax,
+	reference_backprop_conv_input,
+	filter_backprop_bias,
+	pooling_max_scatter,
+};
+
+static const struct backend simd_backend = {
+	"simd",
+	signal_accumulate,
+	signal_sigmoid,
+	signal_relu,
+	prop_simd,
+	backprop_weight,
+	backprop_bias_simd,
+	backprop_sigmoid,
+	backprop_relu,
+	softmax_error,
+	filter_convolution,
+	filter_convpool,
+	filter_maxpooling,
+	filter_backprop_weight,
+	filter_maxpooling_argmax,
+	convpool_argmax,
+	filter_backprop_maxpooling,
+	filter_backprop_weight_argmax,
+	filter_backprop_input,
+	filter_backprop_bias,
+	pooling_max_scatter,
+};
+
+static const struct backend threaded_backend = {
+	"threaded",
+	signal_accumulate,
+	signal_sigmoid,
+	signal_relu,
+	prop_parallel,
+	backprop_weight,
+	backprop_bias_parallel,
+	backprop_sigmoid,
+	backprop_relu,
+	softmax_error,
+	filter_convolution_parallel,
+	filter_convpool,
+	filter_maxpooling,
+	filter_backprop_weight_parallel,
+	filter_maxpooling_argmax,
+	convpool_argmax,
+	filter_backprop_maxpooling,
+	filter_backprop_weight_argmax,
+	filter_backprop_input,
+	filter_backprop_bias,
+	pooling_max_scatter,
+};
+
+// Tuned backend : the backend of each (op, shape) measured by ann.autotune(), threaded by default
+
+#define TUNE_MAX 256
+#define TUNE_SHAPE 9
+#define TUNE_SHAPE_V1 6	// profiles before the stride, padding and pooling stride of the filters
+
+enum {
+	TUNE_PROP,
+	TUNE_BACKPROP_BIAS,
+	TUNE_CONVOLUTION,
+	TUNE_CONVPOOL,
+	TUNE_BACKPROP_CONV_WEIGHT,
+	TUNE_OPS,
+};
+
+static const char * tune_name[TUNE_OPS] = {
+	"prop",
+	"backprop_bias",
+	"convolution",
+	"convpool",
+	"backprop_conv_weight",
+};
+
+struct tune_entry {
+	int op;
+	int shape[TUNE_SHAPE];	// w, h of a weight, or size, channel, src_w, src_h, n, pooling, pool_stride, stride, pad of a filter
+	const struct backend *b;
+};
+
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tune_entry tune_entry[TUNE_MAX];
+static atomic_int tune_n;	// entries are only appended (under tune_lock), readers don't lock
+
+static const struct backend *
+tune_find(int op, const int shape[TUNE_SHAPE]) {
+	int n = atomic_load(&tune_n);
+	int i;
+	for (i=0;i<n;i++) {
+		const struct tune_entry *e = &tune_entry[i];
+		if (e->op == op && memcmp(e->shape, shape, sizeof(e->shape)) == 0)
+			return e->b;
+	}
+	return &threaded_backend;
+}
+
+static void
+filter_shape(const struct filter *f, int shape[TUNE_SHAPE]) {
+	shape[0] = f->size;
+	shape[1] = f->channel;
+	shape[2] = f->src_w;
+	shape[3] = f->src_h;
+	shape[4] = f->n;
+	shape[5] = f->pooling;
+	shape[6] = f->pool_stride;
+	shape[7] = f->stride;
+	shape[8] = f->pad;
+}
+
+static void
+tuned_prop(const float *input, float *output, const float *c, int w, int h) {
+	int shape[TUNE_SHAPE] = { w, h };
+	tune_find(TUNE_PROP, shape)->prop(input, output, c, w, h);
+}
+
+static void
+tuned_backprop_bias(float *output, const float *delta, const float *c, int w, int h) {
+	int shape[TUNE_SHAPE] = { w, h };
+	tune_find(TUNE_BACKPROP_BIAS, shape)->backprop_bias(output, delta, c, w, h);
+}
+
+static void
+tuned_convolution(struct filter *f, const float *input, float *output) {
+	int shape[TUNE_SHAPE];
+	filter_shape(f, shape);
+	tune_find(TUNE_CONVOLUTION, shape)->convolution(f, input, output);
+}
+
+static void
+tuned_convpool(struct filter *f, const float *input, float *output) {
+	int shape[TUNE_SHAPE];
+	filter_shape(f, shape);
+	tune_find(TUNE_CONVPOOL, shape)->convpool(f, input, output);
+}
+
+static void
+tuned_backprop_conv_weight(struct filter *f, const float *input, const float *delta) {
+	int shape[TUNE_SHAPE];
+	filter_shape(f, shape);
+	tune_find(TUNE_BACKPROP_CONV_WEIGHT, shape)->backprop_conv_weight(f, input, delta);
+}
+
+static const struct backend tuned_backend = {
+	"tuned",
+	signal_accumulate,
+	signal_sigmoid,
+	signal_relu,
+	tuned_prop,
+	backprop_weight,
+	tuned_backprop_bias,
+	backprop_sigmoid,
+	backprop_relu,
+	softmax_error,
+	tuned_convolution,
+	tuned_convpool,
+	filter_maxpooling,
+	tuned_backprop_conv_weight,
+	filter_maxpooling_argmax,
+	convpool_argmax,
+	filter_backprop_maxpooling,
+	filter_backprop_weight_argmax,
+	filter_backprop_input,
+	filter_backprop_bias,
+	pooling_max_scatter,
+};
+
+static const struct backend *backends[] = {
+	&reference_backend,
+	&simd_backend,
+	&threaded_backend,
+	&tuned_backend,
+	NULL,
+};
+
+static const struct backend *
+backend_find(const char *name) {
+	int i;
+	for (i=0;backends[i];i++) {
+		if (strcmp(backends[i]->name, name) == 0)
+			return backends[i];
+	}
+	return NULL;
+}
+
+static const struct backend *B = &threaded_backend;
+
+enum {
+	VERIFY_ACCUMULATE,
+	VERIFY_SIGMOID,
+	VERIFY_RELU,
+	VERIFY_PROP,
+	VERIFY_BACKPROP_WEIGHT,
+	VERIFY_BACKPROP_BIAS,
+	VERIFY_BACKPROP_SIGMOID,
+	VERIFY_BACKPROP_RELU,
+	VERIFY_SOFTMAX_ERROR,
+	VERIFY_CONVOLUTION,
+	VERIFY_CONVPOOL,
+	VERIFY_MAXPOOLING,
+	VERIFY_BACKPROP_CONV_WEIGHT,
+	VERIFY_MAXPOOLING_ARGMAX,
+	VERIFY_CONVPOOL_ARGMAX,
+	VERIFY_BACKPROP_MAXPOOLING,
+	VERIFY_BACKPROP_CONV_WEIGHT_ARGMAX,
+	VERIFY_BACKPROP_CONV_INPUT,
+	VERIFY_BACKPROP_CONV_BIAS,
+	VERIFY_MAXPOOLING_SCATTER,
+	VERIFY_OPS,
+};
+
+static const char * verify_name[VERIFY_OPS] = {
+	"accumulate",
+	"sigmoid",
+	"relu",
+	"prop",
+	"backprop_weight",
+	"backprop_bias",
+	"backprop_sigmoid",
+	"backprop_relu",
+	"softmax_error",
+	"convolution",
+	"convpool",
+	"maxpooling",
+	"backprop_conv_weight",
+	"maxpooling_argmax",
+	"convpool_argmax",
+	"backprop_maxpooling",
+	"backprop_conv_weight_argmax",
+	"backprop_conv_input",
+	"backprop_conv_bias",
+	"maxpooling_scatter",
+};
+
+struct verify_stat {
+	uint64_t calls;
+	uint32_t ulp;
+	double rel;
+};
+
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct verify_stat verify_stat[VERIFY_OPS];
+static const struct backend *verified;	// the backend under verification
+
+// distance in units in the last place, NaN against a number is UINT32_MAX
+static uint32_t
+ulp_distance(float a, float b) {
+	if (a == b || (isnan(a) && isnan(b)))
+		return 0;
+	if (isnan(a) || isnan(b))
+		return UINT32_MAX;
+	int32_t ia, ib;
+	memcpy(&ia, &a, sizeof(ia));
+	memcpy(&ib, &b, sizeof(ib));
+	// sign-magnitude to an ordered integer
+	int64_t oa = ia < 0 ? (int64_t)INT32_MIN - ia : ia;
+	int64_t ob = ib < 0 ? (int64_t)INT32_MIN - ib : ib;
+	int64_t d = oa > ob ? oa - ob : ob - oa;
+	return d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+}
+
+// expect is NULL when the copy can't be allocated, the call isn't verified
+static void
+verify_compare(int op, const float *output, const float *expect, int n) {
+	if (expect == NULL)
+		return;
+	uint32_t ulp = 0;
+	double rel = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		uint32_t u = ulp_distance(output[i], expect[i]);
+		if (u > ulp)
+			ulp = u;
+		if (u) {
+			double a = fabs(output[i]), b = fabs(expect[i]);
+			double r = fabs((double)output[i] - expect[i]) / (a > b ? a : b);
+			if (!(r <= rel))
+				rel = r;
+		}
+	}
+	pthread_mutex_lock(&verify_lock);
+	struct verify_stat *v = &verify_stat[op];
+	++v->calls;
+	if (ulp > v->ulp)
+		v->ulp = ulp;
+	if (!(rel <= v->rel))
+		v->rel = rel;
+	pthread_mutex_unlock(&verify_lock);
+}
+
+static float *
+verify_copy(const float *src, int n) {
+	float *r = (float *)malloc(n * sizeof(float));
+	if (r && src)
+		memcpy(r, src, n * sizeof(float));
+	return r;
+}
+
+// the reference writes the weight of a copy of the filter
+static struct filter *
+verify_filter(const struct filter *f) {
+	struct filter *r = (struct filter *)malloc(filter_size(f->size, f->channel, f->n));
+	if (r) {
+		*r = *f;
+		r->f = r->buffer;
+		memcpy(r->f, f->f, (filter_wsize(f) + 1) * f->n * sizeof(float));
+	}
+	return r;
+}
+
+// the reference runs first on copies, so the inputs are intact even if the op works in place
+
+static void
+verify_accumulate(float *s, const float *delta, int n, float eta) {
+	float *expect = verify_copy(s, n);
+	if (expect)
+		reference_backend.accumulate(expect, delta, n, eta);
+	verified->accumulate(s, delta, n, eta);
+	verify_compare(VERIFY_ACCUMULATE, s, expect, n);
+	free(expect);
+}
+
+static void
+verify_sigmoid(float *s, int n) {
+	float *expect = verify_copy(s, n);
+	if (expect)
+		reference_backend.sigmoid(expect, n);
+	verified->sigmoid(s, n);
+	verify_compare(VERIFY_SIGMOID, s, expect, n);
+	free(expect);
+}
+
+static void
+verify_relu(float *s, int n) {
+	float *expect = verify_copy(s, n);
+	if (expect)
+		reference_backend.relu(expect, n);
+	verified->relu(s, n);
+	verify_compare(VERIFY_RELU, s, expect, n);
+	free(expect);
+}
+
+static void
+verify_prop(const float *input, float *output, const float *c, int w, int h) {
+	float *expect = verify_copy(NULL, h);
+	if (expect)
+		reference_backend.prop(input, expect, c, w, h);
+	verified->prop(input, output, c, w, h);
+	verify_compare(VERIFY_PROP, output, expect, h);
+	free(expect);
+}
+
+static void
+verify_backprop_weight(const float *source, const float *delta, float *nabla, int w, int h) {
+	float *expect = verify_copy(NULL, w * h);
+	if (expect)
+		reference_backend.backprop_weight(source, delta, expect, w, h);
+	verified->backprop_weight(source, delta, nabla, w, h);
+	verify_compare(VERIFY_BACKPROP_WEIGHT, nabla, expect, w * h);
+	free(expect);
+}
+
+static void
+verify_backprop_bias(float *output, const float *delta, const float *c, int w, int h) {
+	float *expect = verify_copy(NULL, w);
+	if (expect)
+		reference_backend.backprop_bias(expect, delta, c, w, h);
+	verified->backprop_bias(output, delta, c, w, h);
+	verify_compare(VERIFY_BACKPROP_BIAS, output, expect, w);
+	free(expect);
+}
+
+static void
+verify_backprop_sigmoid(const float *s, float *input, int n) {
+	float *expect = verify_copy(input, n);
+	if (expect)
+		reference_backend.backprop_sigmoid(s, expect, n);
+	verified->backprop_sigmoid(s, input, n);
+	verify_compare(VERIFY_BACKPROP_SIGMOID, input, expect, n);
+	free(expect);
+}
+
+static void
+verify_backprop_relu(const float *s, float *input, int n) {
+	float *expect = verify_copy(input, n);
+	if (expect)
+		reference_backend.backprop_relu(s, expect, n);
+	verified->backprop_relu(s, input, n);
+	verify_compare(VERIFY_BACKPROP_RELU, input, expect, n);
+	free(expect);
+}
+
+static void
+verify_softmax_error(const float *a, const float *b, float *output, int n) {
+	float *expect = verify_copy(NULL, n);
+	if (expect)
+		reference_backend.softmax_error(a, b, expect, n);
+	verified->softmax_error(a, b, output, n);
+	verify_compare(VERIFY_SOFTMAX_ERROR, output, expect, n);
+	free(expect);
+}
+
+static void
+verify_convolution(struct filter *f, const float *input, float *output) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int n = dw * dh * f->n;
+	float *expect = verify_copy(NULL, n);
+	if (expect)
+		reference_backend.convolution(f, input, expect);
+	verified->convolution(f, input, output);
+	verify_compare(VERIFY_CONVOLUTION, output, expect, n);
+	free(expect);
+}
+
+static void
+verify_convpool(struct filter *f, const float *input, float *output) {
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int n = pw * ph * f->n;
+	float *expect = verify_copy(NULL, n);
+	if (expect)
+		reference_backend.convpool(f, input, expect);
+	verified->convpool(f, input, output);
+	verify_compare(VERIFY_CONVPOOL, output, expect, n);
+	free(expect);
+}
+
+static void
+verify_maxpooling(struct filter *f, const float *src, float *output) {
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int n = pw * ph * f->n;
+	float *expect = verify_copy(NULL, n);
+	if (expect)
+		reference_backend.maxpooling(f, src, expect);
+	verified->maxpooling(f, src, output);
+	verify_compare(VERIFY_MAXPOOLING, output, expect, n);
+	free(expect);
+}
+
+static void
+verify_backprop_conv_weight(struct filter *f, const float *input, const float *delta) {
+	struct filter *expect = verify_filter(f);
+	if (expect)
+		reference_backend.backprop_conv_weight(expect, input, delta);
+	verified->backprop_conv_weight(f, input, delta);
+	verify_compare(VERIFY_BACKPROP_CONV_WEIGHT, f->f, expect ? expect->f : NULL, (filter_wsize(f) + 1) * f->n);
+	free(expect);
+}
+
+// an argmax differs : the max ulp, the relative error 1
+static void
+verify_index(int op, const int *index, const int *expect, int n) {
+	if (expect == NULL || memcmp(index, expect, n * sizeof(int)) == 0)
+		return;
+	pthread_mutex_lock(&verify_lock);
+	verify_stat[op].ulp = UINT32_MAX;
+	if (!(verify_stat[op].rel >= 1))
+		verify_stat[op].rel = 1;
+	pthread_mutex_unlock(&verify_lock);
+}
+
+static void
+verify_maxpooling_argmax(struct filter *f, const float *src, float *output, int *index) {
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int n = pw * ph * f->n;
+	float *expect = verify_copy(NULL, n * 2);	// output, then index
+	int *expect_index = expect ? (int *)(expect + n) : NULL;
+	if (expect)
+		reference_backend.maxpooling_argmax(f, src, expect, expect_index);
+	verified->maxpooling_argmax(f, src, output, index);
+	verify_compare(VERIFY_MAXPOOLING_ARGMAX, output, expect, n);
+	verify_index(VERIFY_MAXPOOLING_ARGMAX, index, expect_index, n);
+	free(expect);
+}
+
+static void
+verify_convpool_argmax(struct filter *f, const float *input, float *output, int *index) {
+	int pw,ph;
+	filter_pooling_size(f, &pw, &ph);
+	int n = pw * ph * f->n;
+	float *expect = verify_copy(NULL, n * 2);	// output, then index
+	int *expect_index = expect ? (int *)(expect + n) : NULL;
+	if (expect)
+		reference_backend.convpool_argmax(f, input, expect, expect_index);
+	verified->convpool_argmax(f, input, output, index);
+	verify_compare(VERIFY_CONVPOOL_ARGMAX, output, expect, n);
+	verify_index(VERIFY_CONVPOOL_ARGMAX, index, expect_index, n);
+	free(expect);
+}
+
+static void
+verify_backprop_maxpooling(struct filter *f, float *conv, const float *delta) {
+	int dw,dh;
+	filter_output_size(f, &dw, &dh);
+	int n = dw * dh * f->n;
+	float *expect = verify_copy(conv, n);
+	if (expect)
+		reference_backend.backprop_maxpooling(f, expect, delta);
+	verified->backprop_maxpooling(f, conv, delta);
+	verify_compare(VERIFY_BACKPROP_MAXPOOLING, conv, expect, n);
+	free(expect);
+}
+
+static void
+verify_backprop_conv_weight_argmax(struct filter *f, const float *input, const float *delta, const int *index) {
+	struct filter *expect = verify_filter(f);
+	if (expect)
+		reference_backend.backprop_conv_weight_argmax(expect, input, delta, index);
+	verified->backprop_conv_weight_argmax(f, input, delta, index);
+	verify_compare(VERIFY_BACKPROP_CONV_WEIGHT_ARGMAX, f->f, expect ? expect->f : NULL, (filter_wsize(f) + 1) * f->n);
+	free(expect);
+}
+
+static void
+verify_backprop_conv_input(struct filter *f, const float *delta, float *input) {
+	int n = f->src_w * f->src_h * f->channel;
+	float *expect = verify_copy(NULL, n);
+	if (expect)
+		reference_backend.backprop_conv_input(f, delta, expect);
+	verified->backprop_conv_input(f, delta, input);
+	verify_compare(VERIFY_BACKPROP_CONV_INPUT, input, expect, n);
+	free(expect);
+}
+
+// the bias of the filter, the weight is left as is
+static void
+verify_backprop_conv_bias(struct filter *f, const float *delta, int size) {
+	float *expect = verify_copy(NULL, f->n);
+	if (expect) {
+		struct filter tmp = *f;
+		tmp.f = expect;
+		reference_backend.backprop_conv_bias(&tmp, delta, size);
+	}
+	verified->backprop_conv_bias(f, delta, size);
+	verify_compare(VERIFY_BACKPROP_CONV_BIAS, f->f, expect, f->n);
+	free(expect);
+}
+
+static void
+verify_maxpooling_scatter(const float *delta, const int *index, int n, float *conv, int conv_n) {
+	float *expect = verify_copy(NULL, conv_n);
+	if (expect)
+		reference_backend.maxpooling_scatter(delta, index, n, expect, conv_n);
+	verified->maxpooling_scatter(delta, index, n, conv, conv_n);
+	verify_compare(VERIFY_MAXPOOLING_SCATTER, conv, expect, conv_n);
+	free(expect);
+}
+
+static const struct backend verify_backend = {
+	"verify",
+	verify_accumulate,
+	verify_sigmoid,
+	verify_relu,
+	verify_prop,
+	verify_backprop_weight,
+	verify_backprop_bias,
+	verify_backprop_sigmoid,
+	verify_backprop_relu,
+	verify_softmax_error,
+	verify_convolution,
+	verify_convpool,
+	verify_maxpooling,
+	verify_backprop_conv_weight,
+	verify_maxpooling_argmax,
+	verify_convpool_argmax,
+	verify_backprop_maxpooling,
+	verify_backprop_conv_weight_argmax,
+	verify_backprop_conv_input,
+	verify_backprop_conv_bias,
+	verify_maxpooling_scatter,
+};
+
+// ann.backend([name [, verify]]) : select the backend of the kernels, returns the name and verify.
+// With verify, each op also runs on the reference backend, see ann.verify()
+static int
+lbackend(lua_State *L) {
+	if (!lua_isnoneornil(L, 1)) {
+		const char *name = luaL_checkstring(L, 1);
+		const struct backend *b = backend_find(name);
+		if (b == NULL)
+			return luaL_error(L, "Unknown backend %s", name);
+		if (lua_toboolean(L, 2)) {
+			verified = b;
+			B = &verify_backend;
+		} else {
+			B = b;
+		}
+	}
+	int verify = B == &verify_backend;
+	lua_pushstring(L, verify ? verified->name : B->name);
+	lua_pushboolean(L, verify);
+	return 2;
+}
+
+// ann.verify([reset]) : { op = { calls = n, ulp = max ulp, rel = max relative error } } of the verified ops
+static int
+lverify(lua_State *L) {
+	int reset = lua_toboolean(L, 1);
+	struct verify_stat stat[VERIFY_OPS];
+	pthread_mutex_lock(&verify_lock);
+	memcpy(stat, verify_stat, sizeof(stat));
+	if (reset)
+		memset(verify_stat, 0, sizeof(verify_stat));
+	pthread_mutex_unlock(&verify_lock);
+	lua_newtable(L);
+	int i;
+	for (i=0;i<VERIFY_OPS;i++) {
+		if (stat[i].calls == 0)
+			continue;
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, (lua_Integer)stat[i].calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, stat[i].ulp);
+		lua_setfield(L, -2, "ulp");
+		lua_pushnumber(L, stat[i].rel);
+		lua_setfield(L, -2, "rel");
+		lua_setfield(L, -2, verify_name[i]);
+	}
+	return 1;
+}
+
+// Autotune : measure the candidate backends of each (op, shape) used by some tapes, keep the fastest.
+// The profile is a text file of sections, one for each cpu model :
+//   cpu <model name>
+//   <op> <shape[0]> ... <shape[8]> <backend>
+// A line of 6 numbers (the old format) is a filter of stride 1, no padding and pool_stride = pooling.
+
+#define TUNE_SECONDS 0.01
+#define TUNE_LINE 256
+
+static pthread_once_t tune_once = PTHREAD_ONCE_INIT;
+
+static void
+cpu_model(char *model, size_t sz) {
+	char line[TUNE_LINE];
+	snprintf(model, sz, "unknown");
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "model name", 10) == 0) {
+			char *p = strchr(line, ':');
+			if (p) {
+				p += strspn(p + 1, " \t") + 1;
+				p[strcspn(p, "\n")] = 0;
+				snprintf(model, sz, "%s", p);
+			}
+			break;
+		}
+	}
+	fclose(f);
+}
+
+// $ANN_PROFILE or ~/.ann_profile, NULL without $HOME or if the path doesn't fit in buf
+static const char *
+profile_path(char *buf, size_t sz) {
+	const char *path = getenv("ANN_PROFILE");
+	if (path)
+		return path;
+	const char *home = getenv("HOME");
+	if (home == NULL)
+		return NULL;
+	int n = snprintf(buf, sz, "%s/.ann_profile", home);
+	if (n < 0 || (size_t)n >= sz)
+		return NULL;
+	return buf;
+}
+
+static void
+tune_set(int op, const int shape[TUNE_SHAPE], const struct backend *b) {
+	pthread_mutex_lock(&tune_lock);
+	int n = atomic_load(&tune_n);
+	int i;
+	for (i=0;i<n;i++) {
+		struct tune_entry *e = &tune_entry[i];
+		if (e->op == op && memcmp(e->shape, shape, sizeof(e->shape)) == 0) {
+			e->b = b;
+			break;
+		}
+	}
+	if (i == n && n < TUNE_MAX) {
+		struct tune_entry *e = &tune_entry[n];
+		e->op = op;
+		memcpy(e->shape, shape, sizeof(e->shape));
+		e->b = b;
+		atomic_store(&tune_n, n + 1);
+	}
+	pthread_mutex_unlock(&tune_lock);
+}
+
+// "op shape... backend", returns 0 if the line is invalid
+static int
+tune_parse(const char *line, char op[32], int shape[TUNE_SHAPE], char name[32]) {
+	int len;
+	if (sscanf(line, "%31s%n", op, &len) != 1)
+		return 0;
+	line += len;
+	int n;
+	for (n=0;n<TUNE_SHAPE && sscanf(line, "%d%n", &shape[n], &len) == 1;n++)
+		line += len;
+	if (sscanf(line, "%31s%n", name, &len) != 1 || line[len + strspn(line + len, " \t\r")] != 0)
+		return 0;
+	if (n == TUNE_SHAPE)
+		return 1;
+	if (n != TUNE_SHAPE_V1 || shape[5] < 0 || shape[5] > 255)
+		return 0;
+	// the missing fields of the old format, 0 for a weight (pooling is 0)
+	shape[6] = shape[5];
+	shape[7] = shape[5] ? 1 : 0;
+	shape[8] = 0;
+	return 1;
+}
+
+// read the section of this cpu, returns the number of entries
+static int
+tune_load(const char *path) {
+	char model[TUNE_LINE], line[TUNE_LINE];
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	cpu_model(model, sizeof(model));
+	int match = 0;
+	int n = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = 0;
+		if (strncmp(line, "cpu ", 4) == 0) {
+			match = strcmp(line + 4, model) == 0;
+		} else if (match) {
+			char op[32], name[32];
+			int shape[TUNE_SHAPE];
+			if (!tune_parse(line, op, shape, name))
+				continue;
+			const struct backend *b = backend_find(name);
+			int i;
+			for (i=0;i<TUNE_OPS;i++) {
+				if (strcmp(op, tune_name[i]) == 0)
+					break;
+			}
+			if (b && b != &tuned_backend && i < TUNE_OPS) {
+				tune_set(i, shape, b);
+				++n;
+			}
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+// keep the sections of other cpus, and rewrite the section of this cpu
+static int
+tune_save(const char *path) {
+	char model[TUNE_LINE], line[TUNE_LINE], tmp[PATH_MAX];
+	cpu_model(model, sizeof(model));
+	int len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (len < 0 || (size_t)len >= sizeof(tmp))
+		return 0;
+	FILE *out = fopen(tmp, "w");
+	if (out == NULL)
+		return 0;
+	FILE *f = fopen(path, "r");
+	if (f) {
+		int keep = 1;
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "cpu ", 4) == 0) {
+				line[strcspn(line, "\n")] = 0;
+				keep = strcmp(line + 4, model) != 0;
+				if (keep)
+					fprintf(out, "%s\n", line);
+			} else if (keep) {
+				fputs(line, out);
+			}
+		}
+		fclose(f);
+	}
+	fprintf(out, "cpu %s\n", model);
+	int n = atomic_load(&tune_n);
+	int i;
+	for (i=0;i<n;i++) {
+		const struct tune_entry *e = &tune_entry[i];
+		fprintf(out, "%s %d %d %d %d %d %d %d %d %d %s\n", tune_name[e->op],
+			e->shape[0], e->shape[1], e->shape[2], e->shape[3], e->shape[4], e->shape[5],
+			e->shape[6], e->shape[7], e->shape[8], e->b->name);
+	}
+	int err = ferror(out);
+	err |= fclose(out) != 0;
+	if (err || rename(tmp, path) != 0) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+tune_init(void) {
+	char buf[PATH_MAX];
+	const char *path = profile_path(buf, sizeof(buf));
+	if (path && tune_load(path) > 0)
+		B = &tuned_backend;
+}
+
+// scratch buffers of one (op, shape)
+struct tune_args {
+	int op;
+	int w;
+	int h;
+	struct filter *f;
+	float *input;
+	float *output;
+	float *c;
+};
+
+static void
+tune_run(const struct backend *b, struct tune_args *args) {
+	switch (args->op) {
+	case TUNE_PROP:
+		b->prop(args->input, args->output, args->c, args->w, args->h);
+		break;
+	case TUNE_BACKPROP_BIAS:
+		b->backprop_bias(args->output, args->input, args->c, args->w, args->h);
+		break;
+	case TUNE_CONVOLUTION:
+		b->convolution(args->f, args->input, args->output);
+		break;
+	case TUNE_CONVPOOL:
+		b->convpool(args->f, args->input, args->output);
+		break;
+	case TUNE_BACKPROP_CONV_WEIGHT:
+		b->backprop_conv_weight(args->f, args->input, args->output);
+		break;
+	}
+}
+
+// seconds of one call, the best of 3 rounds
+static double
+tune_measure(const struct backend *b, struct tune_args *args) {
+	double best = HUGE_VAL;
+	int round;
+	tune_run(b, args);
+	for (round=0;round<3;round++) {
+		int iter = 0;
+		double start = wall_clock();
+		double t;
+		do {
+			tune_run(b, args);
+			++iter;
+			t = wall_clock() - start;
+		} while (t < TUNE_SECONDS);
+		if (t / iter < best)
+			best = t / iter;
+	}
+	return best;
+}
+
+// push { op = , shape = { ... }, backend = , time = { backend = seconds } }
+static void
+tune_shape(lua_State *L, int op, const int shape[TUNE_SHAPE], const struct filter *f) {
+	struct tune_args args;
+	memset(&args, 0, sizeof(args));
+	int top = lua_gettop(L);	// the buffers are userdata above top, collected with the stack
+	args.op = op;
+	int ninput, noutput;
+	if (f) {
+		int dw, dh;
+		size_t sz = filter_size(f->size, f->channel, f->n);
+		args.f = (struct filter *)lua_newuserdatauv(L, sz, 0);
+		*args.f = *f;
+		args.f->f = args.f->buffer;
+		randn(args.f->f, (filter_wsize(f) + 1) * f->n, 1.0f);
+		filter_output_size(f, &dw, &dh);
+		ninput = f->src_w * f->src_h * f->channel;
+		noutput = dw * dh * f->n;
+	} else {
+		args.w = shape[0];
+		args.h = shape[1];
+		args.c = (float *)lua_newuserdatauv(L, (size_t)args.w * args.h * sizeof(float), 0);
+		randn(args.c, args.w * args.h, 1.0f);
+		ninput = args.w > args.h ? args.w : args.h;
+		noutput = ninput;
+	}
+	args.input = (float *)lua_newuserdatauv(L, (size_t)ninput * sizeof(float), 0);
+	args.output = (float *)lua_newuserdatauv(L, (size_t)noutput * sizeof(float), 0);
+	randn(args.input, ninput, 1.0f);
+	randn(args.output, noutput, 1.0f);
+
+	lua_createtable(L, 0, 4);
+	lua_pushstring(L, tune_name[op]);
+	lua_setfield(L, -2, "op");
+	lua_createtable(L, TUNE_SHAPE, 0);
+	int i;
+	for (i=0;i<TUNE_SHAPE;i++) {
+		lua_pushinteger(L, shape[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_setfield(L, -2, "shape");
+	lua_newtable(L);
+	const struct backend *best = NULL;
+	double best_time = HUGE_VAL;
+	for (i=0;backends[i];i++) {
+		const struct backend *b = backends[i];
+		if (b == &tuned_backend)
+			continue;
+		double t = tune_measure(b, &args);
+		lua_pushnumber(L, t);
+		lua_setfield(L, -2, b->name);
+		if (t < best_time) {
+			best_time = t;
+			best = b;
+		}
+	}
+	lua_setfield(L, -2, "time");
+	lua_pushstring(L, best->name);
+	lua_setfield(L, -2, "backend");
+	tune_set(op, shape, best);
+
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+}
+
+static int
+tune_seen(const int *seen, int n, int op, const int shape[TUNE_SHAPE]) {
+	int i;
+	for (i=0;i<n;i++) {
+		const int *s = seen + i * (TUNE_SHAPE + 1);
+		if (s[0] == op && memcmp(s + 1, shape, TUNE_SHAPE * sizeof(int)) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// measure the ops of one tape, seen is the (op, shape) already measured
+static int
+tune_tape(lua_State *L, const struct tape *t, int *seen, int nseen, int result) {
+	int i;
+	for (i=0;i<t->n;i++) {
+		const struct instruction *ins = &t->code[i];
+		int op;
+		int shape[TUNE_SHAPE] = { 0 };
+		const struct filter *f = NULL;
+		switch (ins->op) {
+		case OP_PROP:
+		case OP_BACKPROP_BIAS: {
+			const struct weight *w = (const struct weight *)ins->arg[2];
+			op = ins->op == OP_PROP ? TUNE_PROP : TUNE_BACKPROP_BIAS;
+			shape[0] = w->w;
+			shape[1] = w->h;
+			break;
+		}
+		case OP_CONVOLUTION:
+		case OP_CONVPOOL:
+		case OP_BACKPROP_CONV_WEIGHT:
+			f = (const struct filter *)ins->arg[0];
+			op = ins->op == OP_CONVOLUTION ? TUNE_CONVOLUTION :
+				ins->op == OP_CONVPOOL ? TUNE_CONVPOOL : TUNE_BACKPROP_CONV_WEIGHT;
+			filter_shape(f, shape);
+			break;
+		default:
+			continue;
+		}
+		if (nseen >= TUNE_MAX || tune_seen(seen, nseen, op, shape))
+			continue;
+		int *s = seen + nseen * (TUNE_SHAPE + 1);
+		s[0] = op;
+		memcpy(s + 1, shape, sizeof(shape));
+		++nseen;
+		tune_shape(L, op, shape, f);
+		lua_rawseti(L, result, nseen);
+	}
+	return nseen;
+}
+
+// ann.autotune(tape or { tapes } [, profile]) : measure the backends of the ops in the tapes,
+// save the fastest into the profile ($ANN_PROFILE or ~/.ann_profile) and select the tuned backend.
+// Call it after ann.threads(). Returns the results of each (op, shape)
+static int
+lautotune(lua_State *L) {
+	int ntape = 1;
+	if (lua_type(L, 1) == LUA_TTABLE) {
+		ntape = lua_rawlen(L, 1);
+	} else {
+		check_tape(L, 1);
+	}
+	char buf[PATH_MAX];
+	const char *path = luaL_optstring(L, 2, NULL);
+	if (path == NULL) {
+		path = profile_path(buf, sizeof(buf));
+		if (path == NULL && getenv("HOME"))
+			return luaL_error(L, "$HOME is too long for the profile path");
+	}
+	lua_settop(L, 2);
+	int *seen = (int *)lua_newuserdatauv(L, TUNE_MAX * (TUNE_SHAPE + 1) * sizeof(int), 0);	// index 3
+	lua_newtable(L);	// result, index 4
+	int nseen = 0;
+	int i;
+	for (i=0;i<ntape;i++) {
+		if (lua_type(L, 1) == LUA_TTABLE) {
+			lua_rawgeti(L, 1, i+1);
+		} else {
+			lua_pushvalue(L, 1);
+		}
+		const struct tape *t = check_tape(L, -1);
+		nseen = tune_tape(L, t, seen, nseen, 4);
+		lua_pop(L, 1);
+	}
+	if (path && !tune_save(path))
+		return luaL_error(L, "Can't write profile %s", path);
+	if (B == &verify_backend)
+		verified = &tuned_backend;
+	else
+		B = &tuned_backend;
+	return 1;
+}
+
+// ann.clock() : monotonic wall clock in seconds, for benchmarks
+static int
+lclock(lua_State *L) {
+	lua_pushnumber(L, wall_clock());
+	return 1;
+}
+
+// ann.peakrss() : peak resident set size of the process in KB
+static int
+lpeakrss(lua_State *L) {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	lua_pushinteger(L, ru.ru_maxrss);
 	return 1;
 }
 
 LUAMOD_API int
 luaopen_ann(lua_State *L) {
 	luaL_checkversion(L);
+	pthread_once(&tune_once, tune_init);
 	luaL_Reg l[] = {
 		{ "signal" , lsignal },
 		{ "weight", lweight },
@@ -1049,6 +5669,24 @@ luaopen_ann(lua_State *L) {
 		{ "backprop_sigmoid", lbackprop_sigmoid },
 		{ "backprop_relu", lbackprop_relu },
 		{ "convpool_filter", lconvpool_filter },
+		{ "interleave", linterleave },
+		{ "deinterleave", ldeinterleave },
+		{ "serve", ann_serve },
+		{ "allreduce", ann_allreduce },
+		{ "lowrank", llowrank },
+		{ "backprop_lowrank", lbackprop_lowrank },
+		{ "sparse", lsparse },
+		{ "prop_batch", lprop_batch },
+		{ "params", lparams },
+		{ "hogwild", lhogwild },
+		{ "threads", ann_threads },
+		{ "record", lrecord },
+		{ "snapshot", ann_snapshot },
+		{ "backend", lbackend },
+		{ "verify", lverify },
+		{ "autotune", lautotune },
+		{ "clock", lclock },
+		{ "peakrss", lpeakrss },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
@@ -0,0 +1,95 @@
+#ifndef ann_h
+#define ann_h
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// data points to buffer, or into a parameter group (see ann.params) when it's a view.
+
+struct signal {
+	int n;
+	float *data;
+	float buffer[1];
+};
+
+static inline struct signal *
+check_signal(lua_State *L, int index) {
+	return (struct signal *)luaL_checkudata(L, index, "ANN_SIGNAL");
+}
+
+struct weight {
+	int w;
+	int h;
+	float *data;
+	float buffer[1];
+};
+
+static inline struct weight *
+check_weight(lua_State *L, int index) {
+	return (struct weight *)luaL_checkudata(L, index, "ANN_WEIGHT");
+}
+
+// compressed sparse row weight (read only), see ann.sparse. col[row[i]] .. col[row[i+1]-1] are the non zeros of row i
+
+struct sparse {
+	int w;
+	int h;
+	int nnz;
+	int *row;
+	int *col;
+	float *val;
+};
+
+// output[n][h] = input[n][w] * s + bias (bias can be NULL)
+void sparse_prop_batch(const struct sparse *s, const float *input, float *output, int n, const float *bias);
+
+// parameter group, see ann.params
+
+#define PARAMS_ALIGN 16	// floats, 64 bytes
+
+struct segment {
+	int offset;
+	int n;
+	float lr;	// learning rate multiplier of the tensor
+};
+
+struct params {
+	int n;	// floats in data, with padding
+	int nseg;
+	float *data;
+	struct segment seg[1];
+};
+
+static inline struct params *
+check_params(lua_State *L, int index) {
+	return (struct params *)luaL_checkudata(L, index, "ANN_PARAMS");
+}
+
+// annserve.c
+int ann_serve(lua_State *L);
+
+// annreduce.c
+int ann_allreduce(lua_State *L);
+
+// annsnap.c : published read-only copies of a parameter group, see ann.snapshot
+struct snapshot;
+struct version {
+	int ref;	// guarded by the snapshot lock
+	int id;
+	struct version *next;
+	float data[1];
+};
+struct snapshot * check_snapshot(lua_State *L, int index);
+const struct params * snapshot_source(struct snapshot *s);
+void snapshot_grab(struct snapshot *s);
+void snapshot_release(struct snapshot *s);
+struct version * snapshot_pin(struct snapshot *s);
+void snapshot_unpin(struct snapshot *s, struct version *v);
+int ann_snapshot(lua_State *L);
+
+// annpool.c : func(ud, from, to) runs [from, to) of n, work is the multiply-adds of the whole kernel
+typedef void (*parallel_func)(void *ud, int from, int to);
+void ann_parallel(parallel_func func, void *ud, int n, size_t work);
+int ann_threads(lua_State *L);
+
+#endif
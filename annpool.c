@@ -0,0 +1,161 @@
+#define LUA_LIB
+
+#include "ann.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Intra-op thread pool : a big kernel splits its rows (or filters) into parts, the caller thread
+// runs parts too. Kernels below the threshold (multiply-adds) never touch the pool.
+
+#define MAX_THREADS 64
+#define DEFAULT_THRESHOLD (1 << 17)
+#define SPIN_COUNT 1024
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t job;
+	pthread_cond_t done;
+	int threads;	// workers + the caller
+	int quit;
+	unsigned generation;
+	parallel_func func;
+	void *ud;
+	int n;
+	int parts;
+	atomic_int next;
+	atomic_int finish;	// workers finished the current generation
+	atomic_flag busy;
+	pthread_t pid[MAX_THREADS];
+};
+
+static struct pool P = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	1,
+};
+
+static size_t threshold = DEFAULT_THRESHOLD;
+
+static void
+run_parts(struct pool *p) {
+	int part;
+	while ((part = atomic_fetch_add(&p->next, 1)) < p->parts) {
+		int from = (int)((long long)p->n * part / p->parts);
+		int to = (int)((long long)p->n * (part + 1) / p->parts);
+		if (from < to)
+			p->func(p->ud, from, to);
+	}
+}
+
+static void *
+worker_thread(void *ud) {
+	struct pool *p = (struct pool *)ud;
+	unsigned seen = 0;
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->generation == seen && !p->quit)
+			pthread_cond_wait(&p->job, &p->lock);
+		if (p->quit) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		seen = p->generation;
+		pthread_mutex_unlock(&p->lock);
+		run_parts(p);
+		// the caller doesn't start the next job until every worker is out of this one
+		if (atomic_fetch_add(&p->finish, 1) == p->threads - 2) {
+			pthread_mutex_lock(&p->lock);
+			pthread_cond_signal(&p->done);
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+	return NULL;
+}
+
+void
+ann_parallel(parallel_func func, void *ud, int n, size_t work) {
+	struct pool *p = &P;
+	if (p->threads <= 1 || n <= 1 || work < threshold || atomic_flag_test_and_set(&p->busy)) {
+		// small kernel, or the pool is used by another thread
+		func(ud, 0, n);
+		return;
+	}
+	int workers = p->threads - 1;
+	pthread_mutex_lock(&p->lock);
+	p->func = func;
+	p->ud = ud;
+	p->n = n;
+	p->parts = n < p->threads ? n : p->threads;
+	atomic_store(&p->next, 0);
+	atomic_store(&p->finish, 0);
+	++p->generation;
+	pthread_cond_broadcast(&p->job);
+	pthread_mutex_unlock(&p->lock);
+
+	run_parts(p);
+
+	int i;
+	for (i=0;i<SPIN_COUNT && atomic_load(&p->finish) < workers;i++) {}
+	if (atomic_load(&p->finish) < workers) {
+		pthread_mutex_lock(&p->lock);
+		while (atomic_load(&p->finish) < workers)
+			pthread_cond_wait(&p->done, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+	}
+	atomic_flag_clear(&p->busy);
+}
+
+static void
+pool_stop(struct pool *p) {
+	int i;
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->job);
+	pthread_mutex_unlock(&p->lock);
+	for (i=0;i<p->threads-1;i++) {
+		pthread_join(p->pid[i], NULL);
+	}
+	p->quit = 0;
+	p->threads = 1;
+	p->generation = 0;
+}
+
+static int
+pool_start(struct pool *p, int threads) {
+	int i;
+	for (i=0;i<threads-1;i++) {
+		if (pthread_create(&p->pid[i], NULL, worker_thread, p) != 0)
+			break;
+		p->threads = i + 2;
+	}
+	return p->threads == threads;
+}
+
+// ann.threads([n [, threshold]]) : set the threads (includes the caller) of the big kernels, returns n, threshold
+int
+ann_threads(lua_State *L) {
+	struct pool *p = &P;
+	if (!lua_isnoneornil(L, 1)) {
+		int n = luaL_checkinteger(L, 1);
+		if (n < 1 || n > MAX_THREADS)
+			return luaL_error(L, "Invalid threads %d", n);
+		if (atomic_flag_test_and_set(&p->busy))
+			return luaL_error(L, "Thread pool is busy");
+		if (n != p->threads) {
+			pool_stop(p);
+			if (!pool_start(p, n)) {
+				atomic_flag_clear(&p->busy);
+				return luaL_error(L, "Can't create threads (%d/%d)", p->threads, n);
+			}
+		}
+		atomic_flag_clear(&p->busy);
+	}
+	if (!lua_isnoneornil(L, 2)) {
+		lua_Integer t = luaL_checkinteger(L, 2);
+		threshold = t < 0 ? 0 : (size_t)t;
+	}
+	lua_pushinteger(L, p->threads);
+	lua_pushinteger(L, (lua_Integer)threshold);
+	return 2;
+}
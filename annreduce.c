@@ -0,0 +1,325 @@
+#define LUA_LIB
+
+#include "ann.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Gradient exchange between processes on one host, through a named POSIX shared memory segment.
+// Each process copies its flattened gradient (a parameter group) into its slot, then every
+// process sums one chunk across all the slots (reduce-scatter), and copies the whole result back.
+
+#define REDUCE_MAGIC 0x414e4e52	// ANNR
+#define SPIN_COUNT 4096
+#define REDUCE_TIMEOUT 60	// seconds
+
+struct shm_header {
+	atomic_int magic;	// written last by rank 0, after the token
+	atomic_int attached;
+	atomic_int count;	// barrier arrivals
+	atomic_int generation;	// futex word
+	int nproc;
+	int n;	// floats of a slot
+	int chunk;
+	int pid;	// of rank 0, a segment of a dead rank 0 is stale
+	int64_t token;	// the run, the same for all the processes of a run
+	int padding[6];	// the slots start at 64 bytes
+};
+
+struct reducer {
+	struct shm_header *h;
+	size_t size;
+	int rank;
+	int timeout;	// seconds of a barrier
+	float *slot;	// slot[nproc][n]
+	float *result;	// result[n]
+};
+
+static inline size_t
+shm_size(int nproc, int n) {
+	return sizeof(struct shm_header) + (size_t)(nproc + 1) * n * sizeof(float);
+}
+
+// returns 0 on timeout
+static int
+futex_wait(atomic_int *addr, int val, const struct timespec *timeout) {
+	if (syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0) != 0 && errno == ETIMEDOUT)
+		return 0;
+	return 1;
+}
+
+static void
+futex_wake(atomic_int *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int64_t
+monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// returns 0 if the others don't arrive in timeout seconds
+static int
+barrier_wait(struct shm_header *h, int timeout) {
+	int gen = atomic_load(&h->generation);
+	if (atomic_fetch_add(&h->count, 1) == h->nproc - 1) {
+		atomic_store(&h->count, 0);
+		atomic_fetch_add(&h->generation, 1);
+		futex_wake(&h->generation);
+		return 1;
+	}
+	int i;
+	for (i=0;i<SPIN_COUNT;i++) {
+		if (atomic_load_explicit(&h->generation, memory_order_acquire) != gen)
+			return 1;
+	}
+	int64_t deadline = monotonic_ms() + (int64_t)timeout * 1000;
+	while (atomic_load(&h->generation) == gen) {
+		int64_t left = deadline - monotonic_ms();
+		if (left <= 0)
+			return 0;
+		struct timespec ts = { left / 1000, (left % 1000) * 1000000 };
+		if (!futex_wait(&h->generation, gen, &ts))
+			return atomic_load(&h->generation) != gen;
+	}
+	return 1;
+}
+
+static void
+reducer_unmap(struct reducer *r) {
+	if (r->h) {
+		munmap(r->h, r->size);
+		r->h = NULL;
+	}
+}
+
+// a peer is gone (or stuck), the barrier count is broken, so the reducer is closed
+static void
+barrier(lua_State *L, struct reducer *r) {
+	if (!barrier_wait(r->h, r->timeout)) {
+		reducer_unmap(r);
+		luaL_error(L, "Allreduce timeout (%d seconds), the reducer is closed", r->timeout);
+	}
+}
+
+static struct reducer *
+check_reducer(lua_State *L, int index) {
+	struct reducer *r = (struct reducer *)luaL_checkudata(L, index, "ANN_REDUCER");
+	if (r->h == NULL)
+		luaL_error(L, "Reducer closed");
+	return r;
+}
+
+static void
+check_size(lua_State *L, struct reducer *r, struct params *p) {
+	if (p->n != r->h->n)
+		luaL_error(L, "Invalid params size %d != %d", p->n, r->h->n);
+}
+
+// reducer:reduce(grad [, scale]) : grad = sum(grad of all processes) * scale
+static int
+lreducer_reduce(lua_State *L) {
+	struct reducer *r = check_reducer(L, 1);
+	struct params *p = check_params(L, 2);
+	float scale = luaL_optnumber(L, 3, 1.0f);
+	check_size(L, r, p);
+	struct shm_header *h = r->h;
+	int n = h->n;
+	memcpy(r->slot + (size_t)r->rank * n, p->data, n * sizeof(float));
+	barrier(L, r);
+	int from = r->rank * h->chunk;
+	int to = from + h->chunk;
+	if (to > n)
+		to = n;
+	if (from < to) {
+		float *result = r->result;
+		int i,j;
+		memcpy(result + from, r->slot + from, (to - from) * sizeof(float));
+		for (i=1;i<h->nproc;i++) {
+			const float *slot = r->slot + (size_t)i * n;
+			for (j=from;j<to;j++) {
+				result[j] += slot[j];
+			}
+		}
+		if (scale != 1.0f) {
+			for (j=from;j<to;j++) {
+				result[j] *= scale;
+			}
+		}
+	}
+	barrier(L, r);
+	memcpy(p->data, r->result, n * sizeof(float));
+	lua_settop(L, 2);
+	return 1;
+}
+
+// reducer:broadcast(params [, root]) : copy the params of root process to all
+static int
+lreducer_broadcast(lua_State *L) {
+	struct reducer *r = check_reducer(L, 1);
+	struct params *p = check_params(L, 2);
+	int root = luaL_optinteger(L, 3, 0);
+	check_size(L, r, p);
+	if (root < 0 || root >= r->h->nproc)
+		return luaL_error(L, "Invalid root %d", root);
+	// others may be still reading the result of the last reduce
+	barrier(L, r);
+	if (r->rank == root)
+		memcpy(r->result, p->data, r->h->n * sizeof(float));
+	barrier(L, r);
+	if (r->rank != root)
+		memcpy(p->data, r->result, r->h->n * sizeof(float));
+	lua_settop(L, 2);
+	return 1;
+}
+
+static int
+lreducer_barrier(lua_State *L) {
+	struct reducer *r = check_reducer(L, 1);
+	barrier(L, r);
+	return 0;
+}
+
+static int
+lreducer_info(lua_State *L) {
+	struct reducer *r = check_reducer(L, 1);
+	lua_pushinteger(L, r->rank);
+	lua_pushinteger(L, r->h->nproc);
+	return 2;
+}
+
+static int
+lreducer_close(lua_State *L) {
+	struct reducer *r = (struct reducer *)luaL_checkudata(L, 1, "ANN_REDUCER");
+	reducer_unmap(r);
+	return 0;
+}
+
+static void
+sleep_ms(int ms) {
+	struct timespec ts = { 0, ms * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+// map the segment of the run, NULL if it isn't ready yet or it's stale (another token, or rank 0 is dead)
+static struct shm_header *
+peer_map(const char *name, size_t size, int64_t token) {
+	int fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size != size) {
+		close(fd);
+		return NULL;
+	}
+	struct shm_header *h = (struct shm_header *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+		return NULL;
+	if (atomic_load(&h->magic) == REDUCE_MAGIC && h->token == token && (kill(h->pid, 0) == 0 || errno == EPERM))
+		return h;
+	munmap(h, size);
+	return NULL;
+}
+
+/*
+	ann.allreduce(name, rank, nproc, params [, token [, timeout]]) : rank 0 creates the segment (and removes
+	a stale one) and marks it ready last, the others wait for a ready segment of the same token.
+	token is the same for all the processes of a run (0 by default), so a segment left by another run
+	isn't mapped. A barrier (and the start) fails after timeout seconds (60 by default).
+	The name is unlinked after all processes are attached.
+ */
+int
+ann_allreduce(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	int rank = luaL_checkinteger(L, 2);
+	int nproc = luaL_checkinteger(L, 3);
+	struct params *p = check_params(L, 4);
+	int64_t token = luaL_optinteger(L, 5, 0);
+	int timeout = luaL_optinteger(L, 6, REDUCE_TIMEOUT);
+	if (nproc <= 0 || rank < 0 || rank >= nproc)
+		return luaL_error(L, "Invalid rank %d / %d", rank, nproc);
+	if (timeout <= 0)
+		return luaL_error(L, "Invalid timeout %d", timeout);
+	int n = p->n;
+	size_t size = shm_size(nproc, n);
+	struct shm_header *h;
+	if (rank == 0) {
+		int fd;
+		shm_unlink(name);
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			return luaL_error(L, "Can't create %s : %s", name, strerror(errno));
+		if (ftruncate(fd, size) != 0) {
+			int err = errno;
+			close(fd);
+			shm_unlink(name);
+			return luaL_error(L, "Can't resize %s : %s", name, strerror(err));
+		}
+		h = (struct shm_header *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (h == MAP_FAILED)
+			return luaL_error(L, "Can't map %s : %s", name, strerror(errno));
+		h->nproc = nproc;
+		h->n = n;
+		h->chunk = ((n + nproc - 1) / nproc + PARAMS_ALIGN - 1) / PARAMS_ALIGN * PARAMS_ALIGN;
+		h->pid = getpid();
+		h->token = token;
+		// the segment is ready
+		atomic_store(&h->magic, REDUCE_MAGIC);
+	} else {
+		int64_t deadline = monotonic_ms() + (int64_t)timeout * 1000;
+		while ((h = peer_map(name, size, token)) == NULL) {
+			if (monotonic_ms() > deadline)
+				return luaL_error(L, "Timeout waiting %s", name);
+			sleep_ms(1);
+		}
+		if (h->nproc != nproc || h->n != n) {
+			int np = h->nproc, hn = h->n;
+			munmap(h, size);
+			return luaL_error(L, "Mismatch %s : nproc %d/%d size %d/%d", name, nproc, np, n, hn);
+		}
+	}
+
+	struct reducer *r = (struct reducer *)lua_newuserdatauv(L, sizeof(*r), 0);
+	r->h = h;
+	r->size = size;
+	r->rank = rank;
+	r->timeout = timeout;
+	r->slot = (float *)(h + 1);
+	r->result = r->slot + (size_t)nproc * n;
+	if (luaL_newmetatable(L, "ANN_REDUCER")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "reduce", lreducer_reduce },
+			{ "broadcast", lreducer_broadcast },
+			{ "barrier", lreducer_barrier },
+			{ "info", lreducer_info },
+			{ "close", lreducer_close },
+			{ "__gc", lreducer_close },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+
+	if (atomic_fetch_add(&h->attached, 1) == nproc - 1) {
+		// everyone is here, the name is no longer needed
+		shm_unlink(name);
+	}
+	barrier(L, r);
+	return 1;
+}
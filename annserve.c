@@ -0,0 +1,666 @@
+#define LUA_LIB
+
+#include "ann.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Inference server : a client sends raw images (input size bytes) through a unix domain socket,
+// and reads one byte (the label) for each image. Requests from all the connections are batched.
+
+#define MAX_THREADS 64
+#define LATENCY_SLOTS 256	// 8 slots per octave of microseconds
+
+struct conn {
+	int fd;
+	int got;	// bytes of image received
+	int busy;	// in queue or running, don't read it
+	uint64_t arrival;
+	struct conn *next;
+	uint8_t image[1];
+};
+
+struct stats {
+	uint64_t since;
+	uint64_t requests;
+	uint64_t batches;
+	uint64_t latency[LATENCY_SLOTS];
+};
+
+struct server;
+
+// the buffers of a worker thread, allocated by ann.serve in a user value of the server
+struct worker {
+	struct server *S;
+	struct conn **batch;	// max_batch
+	float *buffer;	// max_batch * (input + hidden + output)
+};
+
+struct server {
+	int listen_fd;
+	int wakeup[2];
+	int quit;
+	int threads;
+	int max_batch;
+	uint64_t deadline;	// ns
+	int input;
+	int hidden;
+	int output;
+	const struct weight *weight_ih;
+	const struct sparse *sparse_ih;	// a pruned weight_ih, when not NULL
+	const struct signal *bias_hidden;
+	const struct weight *weight_ho;
+	const struct signal *bias_output;
+	struct snapshot *snapshot;	// serve the published versions instead, when not NULL
+	int offset[4];	// of weight_ih, bias_hidden, weight_ho, bias_output in the snapshot
+	atomic_int version;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct conn *head;
+	struct conn *tail;
+	int queue;
+	struct stats stat;
+	int nconn;
+	int capconn;
+	struct conn **conn;
+	int io_running;
+	pthread_t io;
+	pthread_t worker[MAX_THREADS];	// threads of them are running
+	struct worker work[MAX_THREADS];
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+};
+
+static inline uint64_t
+now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int
+latency_slot(uint64_t ns) {
+	double us = ns / 1000.0;
+	if (us < 1.0)
+		return 0;
+	int slot = (int)(log2(us) * 8) + 1;
+	return slot < LATENCY_SLOTS ? slot : LATENCY_SLOTS - 1;
+}
+
+// upper bound of the slot, in ms
+static double
+latency_percentile(const struct stats *st, double p) {
+	uint64_t n = 0;
+	int i;
+	for (i=0;i<LATENCY_SLOTS;i++)
+		n += st->latency[i];
+	if (n == 0)
+		return 0;
+	uint64_t target = (uint64_t)(n * p);
+	if (target >= n)
+		target = n - 1;
+	uint64_t c = 0;
+	for (i=0;i<LATENCY_SLOTS;i++) {
+		c += st->latency[i];
+		if (c > target)
+			break;
+	}
+	return pow(2.0, i / 8.0) / 1000.0;
+}
+
+// wakeup is a socket pair, MSG_NOSIGNAL : never raise SIGPIPE
+static void
+wakeup_io(struct server *S) {
+	char c = 0;
+	while (send(S->wakeup[1], &c, 1, MSG_NOSIGNAL) < 0 && errno == EINTR) {}
+}
+
+// nconn and conn are guarded by S->lock, lserver_stats reads them
+static int
+add_conn(struct server *S, int fd) {
+	struct conn *c = (struct conn *)malloc(sizeof(*c) + S->input - 1);
+	if (c == NULL)
+		return 1;
+	c->fd = fd;
+	c->got = 0;
+	c->busy = 0;
+	c->next = NULL;
+	pthread_mutex_lock(&S->lock);
+	if (S->nconn >= S->capconn) {
+		int cap = S->capconn * 2 + 16;
+		struct conn **tmp = (struct conn **)realloc(S->conn, cap * sizeof(*tmp));
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&S->lock);
+			free(c);
+			return 1;
+		}
+		S->conn = tmp;
+		S->capconn = cap;
+	}
+	S->conn[S->nconn++] = c;
+	pthread_mutex_unlock(&S->lock);
+	return 0;
+}
+
+static void
+remove_conn(struct server *S, struct conn *c) {
+	int j;
+	pthread_mutex_lock(&S->lock);
+	for (j=0;j<S->nconn;j++) {
+		if (S->conn[j] == c) {
+			S->conn[j] = S->conn[--S->nconn];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&S->lock);
+	close(c->fd);
+	free(c);
+}
+
+// returns 1 if the connection is closed
+static int
+read_conn(struct server *S, struct conn *c) {
+	ssize_t n = read(c->fd, c->image + c->got, S->input - c->got);
+	if (n <= 0) {
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			return 0;
+		return 1;
+	}
+	c->got += n;
+	if (c->got == S->input) {
+		c->arrival = now_ns();
+		pthread_mutex_lock(&S->lock);
+		c->busy = 1;
+		if (S->tail)
+			S->tail->next = c;
+		else
+			S->head = c;
+		S->tail = c;
+		++S->queue;
+		pthread_cond_broadcast(&S->cond);
+		pthread_mutex_unlock(&S->lock);
+	}
+	return 0;
+}
+
+static void *
+io_thread(void *ud) {
+	struct server *S = (struct server *)ud;
+	struct pollfd *fds = NULL;
+	struct conn **polled = NULL;
+	int cap = 0;
+	while (!S->quit) {
+		int n = 2;
+		int i;
+		pthread_mutex_lock(&S->lock);
+		if (cap < S->nconn + 2) {
+			// keep the old arrays when out of memory, and poll the connections they can hold
+			int newcap = S->nconn * 2 + 16;
+			struct pollfd *f = (struct pollfd *)realloc(fds, newcap * sizeof(*f));
+			if (f)
+				fds = f;
+			struct conn **p = f ? (struct conn **)realloc(polled, newcap * sizeof(*p)) : NULL;
+			if (p) {
+				polled = p;
+				cap = newcap;
+			}
+		}
+		if (cap == 0) {
+			pthread_mutex_unlock(&S->lock);
+			struct timespec ts = { 0, 10000000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		fds[0].fd = S->listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = S->wakeup[0];
+		fds[1].events = POLLIN;
+		for (i=0;i<S->nconn && n<cap;i++) {
+			struct conn *c = S->conn[i];
+			if (!c->busy) {
+				fds[n].fd = c->fd;
+				fds[n].events = POLLIN;
+				polled[n] = c;
+				++n;
+			}
+		}
+		pthread_mutex_unlock(&S->lock);
+		if (poll(fds, n, -1) < 0)
+			continue;
+		if (fds[1].revents & POLLIN) {
+			char tmp[64];
+			while (read(S->wakeup[0], tmp, sizeof(tmp)) == sizeof(tmp)) {}
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(S->listen_fd, NULL, NULL);
+			if (fd >= 0 && add_conn(S, fd))
+				close(fd);
+		}
+		for (i=2;i<n;i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				struct conn *c = polled[i];
+				if (read_conn(S, c))
+					remove_conn(S, c);
+			}
+		}
+	}
+	free(fds);
+	free(polled);
+	return NULL;
+}
+
+// output[n][h] = input[n][w] * weight + bias, the weight row stays in cache for the whole batch
+static void
+prop_batch(const float *input, float *output, int n, const float *weight, int w, int h, const float *bias) {
+	int i,j,k;
+	for (i=0;i<h;i++) {
+		const float *row = weight + i * w;
+		const float *in = input;
+		for (j=0;j<n;j++) {
+			float s = bias[i];
+			for (k=0;k<w;k++) {
+				s += in[k] * row[k];
+			}
+			output[j * h + i] = s;
+			in += w;
+		}
+	}
+}
+
+static void
+inference(struct server *S, struct conn **batch, int n, float *buffer) {
+	float *input = buffer;
+	float *hidden = input + n * S->input;
+	float *output = hidden + n * S->hidden;
+	int i,j;
+	for (i=0;i<n;i++) {
+		const uint8_t *image = batch[i]->image;
+		float *in = input + i * S->input;
+		for (j=0;j<S->input;j++) {
+			in[j] = image[j] / 255.0f;
+		}
+	}
+	const float *weight_ih, *bias_hidden, *weight_ho, *bias_output;
+	struct version *v = NULL;
+	if (S->snapshot) {
+		// the version can't change during the batch
+		v = snapshot_pin(S->snapshot);
+		weight_ih = v->data + S->offset[0];
+		bias_hidden = v->data + S->offset[1];
+		weight_ho = v->data + S->offset[2];
+		bias_output = v->data + S->offset[3];
+		atomic_store(&S->version, v->id);
+	} else {
+		weight_ih = S->weight_ih ? S->weight_ih->data : NULL;
+		bias_hidden = S->bias_hidden->data;
+		weight_ho = S->weight_ho->data;
+		bias_output = S->bias_output->data;
+	}
+	if (S->sparse_ih)
+		sparse_prop_batch(S->sparse_ih, input, hidden, n, bias_hidden);
+	else
+		prop_batch(input, hidden, n, weight_ih, S->input, S->hidden, bias_hidden);
+	for (i=0;i<n * S->hidden;i++) {
+		hidden[i] = 1.0f / (1.0f + expf(-hidden[i]));
+	}
+	prop_batch(hidden, output, n, weight_ho, S->hidden, S->output, bias_output);
+	if (v)
+		snapshot_unpin(S->snapshot, v);
+	for (i=0;i<n;i++) {
+		const float *out = output + i * S->output;
+		uint8_t label = 0;
+		for (j=1;j<S->output;j++) {
+			if (out[j] > out[label])
+				label = j;
+		}
+		int fd = batch[i]->fd;
+		// the client may be gone : no SIGPIPE, and the io thread closes the connection on the hangup
+		ssize_t r;
+		while ((r = send(fd, &label, 1, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+		if (r < 0)
+			shutdown(fd, SHUT_RDWR);
+	}
+}
+
+static void *
+worker_thread(void *ud) {
+	struct worker *w = (struct worker *)ud;
+	struct server *S = w->S;
+	struct conn **batch = w->batch;
+	float *buffer = w->buffer;
+	pthread_mutex_lock(&S->lock);
+	for (;;) {
+		// wait for a full batch, or for the deadline of the oldest request
+		while (!S->quit) {
+			if (S->queue >= S->max_batch)
+				break;
+			if (S->queue > 0) {
+				uint64_t expire = S->head->arrival + S->deadline;
+				if (now_ns() >= expire)
+					break;
+				struct timespec ts;
+				ts.tv_sec = expire / 1000000000;
+				ts.tv_nsec = expire % 1000000000;
+				pthread_cond_timedwait(&S->cond, &S->lock, &ts);
+			} else {
+				pthread_cond_wait(&S->cond, &S->lock);
+			}
+		}
+		if (S->quit)
+			break;
+		int n = 0;
+		while (n < S->max_batch && S->head) {
+			batch[n++] = S->head;
+			S->head = S->head->next;
+		}
+		if (S->head == NULL)
+			S->tail = NULL;
+		S->queue -= n;
+		pthread_mutex_unlock(&S->lock);
+
+		inference(S, batch, n, buffer);
+		uint64_t t = now_ns();
+
+		pthread_mutex_lock(&S->lock);
+		int i;
+		for (i=0;i<n;i++) {
+			struct conn *c = batch[i];
+			++S->stat.latency[latency_slot(t - c->arrival)];
+			c->next = NULL;
+			c->got = 0;
+			c->busy = 0;
+		}
+		S->stat.requests += n;
+		++S->stat.batches;
+		pthread_mutex_unlock(&S->lock);
+		wakeup_io(S);
+		pthread_mutex_lock(&S->lock);
+	}
+	pthread_mutex_unlock(&S->lock);
+	return NULL;
+}
+
+static void
+server_stop(struct server *S) {
+	if (S->listen_fd < 0)
+		return;
+	int i;
+	pthread_mutex_lock(&S->lock);
+	S->quit = 1;
+	pthread_cond_broadcast(&S->cond);
+	pthread_mutex_unlock(&S->lock);
+	if (S->io_running) {
+		wakeup_io(S);
+		pthread_join(S->io, NULL);
+		S->io_running = 0;
+	}
+	for (i=0;i<S->threads;i++) {
+		pthread_join(S->worker[i], NULL);
+	}
+	for (i=0;i<S->nconn;i++) {
+		close(S->conn[i]->fd);
+		free(S->conn[i]);
+	}
+	free(S->conn);
+	S->conn = NULL;
+	S->nconn = 0;
+	close(S->listen_fd);
+	close(S->wakeup[0]);
+	close(S->wakeup[1]);
+	unlink(S->path);
+	pthread_cond_destroy(&S->cond);
+	pthread_mutex_destroy(&S->lock);
+	if (S->snapshot) {
+		snapshot_release(S->snapshot);
+		S->snapshot = NULL;
+	}
+	S->listen_fd = -1;
+}
+
+static struct server *
+check_server(lua_State *L, int index) {
+	return (struct server *)luaL_checkudata(L, index, "ANN_SERVER");
+}
+
+static int
+lserver_close(lua_State *L) {
+	struct server *S = check_server(L, 1);
+	server_stop(S);
+	return 0;
+}
+
+static void
+set_number(lua_State *L, const char *key, double v) {
+	lua_pushnumber(L, v);
+	lua_setfield(L, -2, key);
+}
+
+// server:stats([interval]) : sleep interval seconds, then returns (and resets) the stats since last reset
+static int
+lserver_stats(lua_State *L) {
+	struct server *S = check_server(L, 1);
+	if (S->listen_fd < 0)
+		return luaL_error(L, "Server closed");
+	double interval = luaL_optnumber(L, 2, 0);
+	if (interval > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)interval;
+		ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+	}
+	struct stats st;
+	pthread_mutex_lock(&S->lock);
+	st = S->stat;
+	int queue = S->queue;
+	int nconn = S->nconn;
+	if (interval > 0) {
+		memset(&S->stat, 0, sizeof(S->stat));
+		S->stat.since = now_ns();
+	}
+	pthread_mutex_unlock(&S->lock);
+	double elapsed = (now_ns() - st.since) / 1e9;
+	lua_createtable(L, 0, 8);
+	set_number(L, "requests", (double)st.requests);
+	set_number(L, "batches", (double)st.batches);
+	set_number(L, "batch_size", st.batches ? (double)st.requests / st.batches : 0);
+	set_number(L, "throughput", elapsed > 0 ? st.requests / elapsed : 0);
+	set_number(L, "p50", latency_percentile(&st, 0.5));
+	set_number(L, "p99", latency_percentile(&st, 0.99));
+	set_number(L, "queue", queue);
+	set_number(L, "connections", nconn);
+	if (S->snapshot)
+		set_number(L, "version", atomic_load(&S->version));
+	return 1;
+}
+
+static int
+lserver_gc(lua_State *L) {
+	struct server *S = (struct server *)lua_touserdata(L, 1);
+	server_stop(S);
+	return 0;
+}
+
+static void *
+get_field(lua_State *L, const char *key, const char *type) {
+	lua_getfield(L, 1, key);
+	void *ud = luaL_testudata(L, -1, type);
+	if (ud == NULL)
+		luaL_error(L, ".%s should be %s", key, type);
+	lua_pop(L, 1);
+	return ud;
+}
+
+/*
+	ann.serve {
+		path = "/tmp/ann.sock",
+		weight_ih = weight or sparse, bias_hidden = signal,
+		weight_ho = weight, bias_output = signal,
+		snapshot = snapshot,	-- optional, the tensors above are views of its params, serve the published versions (weight_ih can't be sparse)
+		batch = 32,	-- max batch size
+		deadline = 1,	-- ms, max wait of the oldest request in a batch
+		threads = 4,
+	}
+ */
+int
+ann_serve(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	if (lua_getfield(L, 1, "path") != LUA_TSTRING)
+		return luaL_error(L, "Need .path");
+	size_t pathsz;
+	const char *path = lua_tolstring(L, -1, &pathsz);
+	lua_pop(L, 1);
+	const struct weight *weight_ih = NULL;
+	int input, hidden;
+	lua_getfield(L, 1, "weight_ih");
+	const struct sparse *sparse_ih = (const struct sparse *)luaL_testudata(L, -1, "ANN_SPARSE");
+	lua_pop(L, 1);
+	if (sparse_ih) {
+		input = sparse_ih->w;
+		hidden = sparse_ih->h;
+	} else {
+		weight_ih = (const struct weight *)get_field(L, "weight_ih", "ANN_WEIGHT");
+		input = weight_ih->w;
+		hidden = weight_ih->h;
+	}
+	const struct signal *bias_hidden = (const struct signal *)get_field(L, "bias_hidden", "ANN_SIGNAL");
+	const struct weight *weight_ho = (const struct weight *)get_field(L, "weight_ho", "ANN_WEIGHT");
+	const struct signal *bias_output = (const struct signal *)get_field(L, "bias_output", "ANN_SIGNAL");
+	if (hidden != bias_hidden->n || weight_ho->w != hidden || weight_ho->h != bias_output->n)
+		return luaL_error(L, "Invalid model (%d, %d) (%d, %d)", input, hidden, weight_ho->w, weight_ho->h);
+	if (bias_output->n > 256)
+		return luaL_error(L, "Too many outputs %d", bias_output->n);
+	int i;
+	struct snapshot *snapshot = NULL;
+	int offset[4] = { 0 };
+	if (lua_getfield(L, 1, "snapshot") != LUA_TNIL) {
+		snapshot = check_snapshot(L, -1);
+		if (sparse_ih)
+			return luaL_error(L, "A sparse weight_ih can't be served from a snapshot");
+		const struct params *p = snapshot_source(snapshot);
+		const float *data[4] = { weight_ih->data, bias_hidden->data, weight_ho->data, bias_output->data };
+		int size[4] = { weight_ih->w * weight_ih->h, bias_hidden->n, weight_ho->w * weight_ho->h, bias_output->n };
+		for (i=0;i<4;i++) {
+			if (data[i] < p->data || data[i] + size[i] > p->data + p->n)
+				return luaL_error(L, "The model isn't in the params of the snapshot");
+			offset[i] = data[i] - p->data;
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "batch");
+	int batch = luaL_optinteger(L, -1, 32);
+	lua_getfield(L, 1, "deadline");
+	double deadline = luaL_optnumber(L, -1, 1.0);
+	lua_getfield(L, 1, "threads");
+	int threads = luaL_optinteger(L, -1, 1);
+	lua_pop(L, 3);
+	if (batch <= 0)
+		return luaL_error(L, "Invalid batch %d", batch);
+	if (threads <= 0 || threads > MAX_THREADS)
+		return luaL_error(L, "Invalid threads %d", threads);
+
+	struct server *S = (struct server *)lua_newuserdatauv(L, sizeof(*S), 2);
+	memset(S, 0, sizeof(*S));
+	S->listen_fd = -1;
+	if (pathsz >= sizeof(S->path))
+		return luaL_error(L, "Path too long : %s", path);
+	memcpy(S->path, path, pathsz + 1);
+	S->threads = threads;
+	S->max_batch = batch;
+	S->deadline = (uint64_t)(deadline * 1000000);
+	S->input = input;
+	S->hidden = hidden;
+	S->output = weight_ho->h;
+	S->weight_ih = weight_ih;
+	S->sparse_ih = sparse_ih;
+	S->bias_hidden = bias_hidden;
+	S->weight_ho = weight_ho;
+	S->bias_output = bias_output;
+	memcpy(S->offset, offset, sizeof(offset));
+	S->stat.since = now_ns();
+	// keep the model alive
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1);
+	size_t nbatch = (size_t)batch * sizeof(struct conn *);
+	size_t nbuffer = (size_t)batch * ((size_t)input + hidden + S->output) * sizeof(float);
+	nbuffer = (nbuffer + sizeof(void *) - 1) & ~(sizeof(void *) - 1);	// the next batch is aligned
+	uint8_t *scratch = (uint8_t *)lua_newuserdatauv(L, (nbatch + nbuffer) * threads, 0);
+	lua_setiuservalue(L, -2, 2);
+	for (i=0;i<threads;i++) {
+		struct worker *w = &S->work[i];
+		w->S = S;
+		w->batch = (struct conn **)scratch;
+		w->buffer = (float *)(scratch + nbatch);
+		scratch += nbatch + nbuffer;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return luaL_error(L, "socket() failed : %s", strerror(errno));
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, pathsz + 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+		int err = errno;
+		close(fd);
+		return luaL_error(L, "Can't listen %s : %s", path, strerror(err));
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, S->wakeup) != 0) {
+		close(fd);
+		return luaL_error(L, "socketpair() failed : %s", strerror(errno));
+	}
+	fcntl(S->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(S->wakeup[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&S->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&S->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	S->listen_fd = fd;
+	if (snapshot) {
+		snapshot_grab(snapshot);
+		S->snapshot = snapshot;
+	}
+
+	if (luaL_newmetatable(L, "ANN_SERVER")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "stats", lserver_stats },
+			{ "close", lserver_close },
+			{ "__gc", lserver_gc },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+
+	// server_stop() joins the threads started so far
+	S->threads = 0;
+	int err = 0;
+	for (i=0;i<threads;i++) {
+		if ((err = pthread_create(&S->worker[i], NULL, worker_thread, &S->work[i])) != 0)
+			break;
+		++S->threads;
+	}
+	if (err == 0 && (err = pthread_create(&S->io, NULL, io_thread, S)) == 0)
+		S->io_running = 1;
+	if (err) {
+		server_stop(S);
+		return luaL_error(L, "pthread_create() failed : %s", strerror(err));
+	}
+	return 1;
+}
@@ -0,0 +1,247 @@
+#define LUA_LIB
+
+#include "ann.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Snapshot : the trainer publishes read-only copies (versions) of a parameter group, readers pin
+// the current version while they run inference. Publishing copies outside the lock, then swaps
+// the current version; a version is recycled when the last reader unpins it.
+
+struct snapshot {
+	pthread_mutex_t lock;
+	int ref;	// lua object + readers (servers, pinned versions)
+	int n;
+	int id;
+	const struct params *source;
+	struct version *current;
+	struct version *freelist;
+};
+
+struct pin {
+	struct snapshot *s;
+	struct version *v;
+};
+
+static void
+snapshot_free(struct snapshot *s) {
+	struct version *v = s->freelist;
+	while (v) {
+		struct version *next = v->next;
+		free(v);
+		v = next;
+	}
+	free(s->current);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+void
+snapshot_grab(struct snapshot *s) {
+	pthread_mutex_lock(&s->lock);
+	++s->ref;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+snapshot_release(struct snapshot *s) {
+	pthread_mutex_lock(&s->lock);
+	int ref = --s->ref;
+	pthread_mutex_unlock(&s->lock);
+	if (ref == 0)
+		snapshot_free(s);
+}
+
+struct version *
+snapshot_pin(struct snapshot *s) {
+	pthread_mutex_lock(&s->lock);
+	struct version *v = s->current;
+	++v->ref;
+	pthread_mutex_unlock(&s->lock);
+	return v;
+}
+
+void
+snapshot_unpin(struct snapshot *s, struct version *v) {
+	pthread_mutex_lock(&s->lock);
+	if (--v->ref == 0) {
+		v->next = s->freelist;
+		s->freelist = v;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int
+snapshot_publish(struct snapshot *s) {
+	pthread_mutex_lock(&s->lock);
+	struct version *v = s->freelist;
+	if (v)
+		s->freelist = v->next;
+	pthread_mutex_unlock(&s->lock);
+	if (v == NULL) {
+		v = (struct version *)malloc(sizeof(*v) + (s->n - 1) * sizeof(float));
+		if (v == NULL)
+			return 0;
+	}
+	memcpy(v->data, s->source->data, s->n * sizeof(float));
+	v->ref = 1;	// the current version
+	v->next = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	struct version *old = s->current;
+	v->id = ++s->id;
+	s->current = v;
+	if (old && --old->ref == 0) {
+		old->next = s->freelist;
+		s->freelist = old;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return v->id;
+}
+
+struct snapshot *
+check_snapshot(lua_State *L, int index) {
+	struct snapshot **s = (struct snapshot **)luaL_checkudata(L, index, "ANN_SNAPSHOT");
+	return *s;
+}
+
+const struct params *
+snapshot_source(struct snapshot *s) {
+	return s->source;
+}
+
+// snap:publish() : copy the params as a new version, returns the version id
+static int
+lsnapshot_publish(lua_State *L) {
+	struct snapshot *s = check_snapshot(L, 1);
+	int id = snapshot_publish(s);
+	if (id == 0)
+		return luaL_error(L, "Out of memory");
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+static int
+lsnapshot_version(lua_State *L) {
+	struct snapshot *s = check_snapshot(L, 1);
+	pthread_mutex_lock(&s->lock);
+	int id = s->id;
+	pthread_mutex_unlock(&s->lock);
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+static int
+lsnapshot_gc(lua_State *L) {
+	struct snapshot **s = (struct snapshot **)luaL_checkudata(L, 1, "ANN_SNAPSHOT");
+	if (*s) {
+		snapshot_release(*s);
+		*s = NULL;
+	}
+	return 0;
+}
+
+static struct pin *
+check_pin(lua_State *L, int index) {
+	struct pin *p = (struct pin *)luaL_checkudata(L, index, "ANN_VERSION");
+	if (p->v == NULL)
+		luaL_error(L, "Version unpinned");
+	return p;
+}
+
+static int
+lversion_id(lua_State *L) {
+	struct pin *p = check_pin(L, 1);
+	lua_pushinteger(L, p->v->id);
+	return 1;
+}
+
+// version:copy(params) : copy the pinned version into a parameter group of the same layout
+static int
+lversion_copy(lua_State *L) {
+	struct pin *p = check_pin(L, 1);
+	struct params *dst = check_params(L, 2);
+	if (dst->n != p->s->n)
+		return luaL_error(L, "Invalid params size %d != %d", dst->n, p->s->n);
+	memcpy(dst->data, p->v->data, dst->n * sizeof(float));
+	lua_settop(L, 2);
+	return 1;
+}
+
+static int
+lversion_unpin(lua_State *L) {
+	struct pin *p = (struct pin *)luaL_checkudata(L, 1, "ANN_VERSION");
+	if (p->v) {
+		snapshot_unpin(p->s, p->v);
+		snapshot_release(p->s);
+		p->v = NULL;
+		p->s = NULL;
+	}
+	return 0;
+}
+
+// snap:pin() : the current version, it stays unchanged until version:unpin()
+static int
+lsnapshot_pin(lua_State *L) {
+	struct snapshot *s = check_snapshot(L, 1);
+	struct pin *p = (struct pin *)lua_newuserdatauv(L, sizeof(*p), 0);
+	p->s = NULL;
+	p->v = NULL;
+	if (luaL_newmetatable(L, "ANN_VERSION")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "id", lversion_id },
+			{ "copy", lversion_copy },
+			{ "unpin", lversion_unpin },
+			{ "__gc", lversion_unpin },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	snapshot_grab(s);
+	p->s = s;
+	p->v = snapshot_pin(s);
+	return 1;
+}
+
+// ann.snapshot(params) : publish the first version of params
+int
+ann_snapshot(lua_State *L) {
+	struct params *source = check_params(L, 1);
+	struct snapshot **ud = (struct snapshot **)lua_newuserdatauv(L, sizeof(*ud), 1);
+	*ud = NULL;
+	if (luaL_newmetatable(L, "ANN_SNAPSHOT")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "publish", lsnapshot_publish },
+			{ "pin", lsnapshot_pin },
+			{ "version", lsnapshot_version },
+			{ "__gc", lsnapshot_gc },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	// keep the source alive
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1);
+
+	struct snapshot *s = (struct snapshot *)malloc(sizeof(*s));
+	if (s == NULL)
+		return luaL_error(L, "Out of memory");
+	pthread_mutex_init(&s->lock, NULL);
+	s->ref = 1;
+	s->n = source->n;
+	s->id = 0;
+	s->source = source;
+	s->current = NULL;
+	s->freelist = NULL;
+	*ud = s;
+	if (snapshot_publish(s) == 0)
+		return luaL_error(L, "Out of memory");
+	return 1;
+}
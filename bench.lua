@@ -0,0 +1,24 @@
+-- lua bench.lua [epochs] [dir]
+-- Offline benchmark : write a synthetic MNIST (mnist.synthetic) into dir, then train network.lua
+-- and cnn.lua on it for some epochs (default 1). Each reports images/s of training and inference,
+-- the epoch time and the peak RSS. The data is the same for the same build, so runs are comparable.
+local mnist = require "mnist"
+
+local epochs = tonumber(arg[1]) or 1
+local dir = arg[2] or "/tmp"
+local lua = arg[-1] or "lua"
+
+local function gen(prefix, n, seed)
+	local images = string.format("%s/%s-images.idx3-ubyte", dir, prefix)
+	local labels = string.format("%s/%s-labels.idx1-ubyte", dir, prefix)
+	mnist.synthetic(images, labels, n, seed)
+end
+
+gen("train", 60000, 1)
+gen("t10k", 10000, 2)
+
+for _, model in ipairs { "network.lua", "cnn.lua" } do
+	print("==", model)
+	local cmd = string.format("ANN_DATA=%s ANN_EPOCHS=%d %s %s -", dir, epochs, lua, model)
+	assert(os.execute(cmd), cmd)
+end
@@ -1,8 +1,15 @@
 local mnist = require "mnist"
 local ann = require "ann"
 
-local labels = mnist.labels "data/train-labels.idx1-ubyte"
-local images = mnist.images "data/train-images.idx3-ubyte"
+-- ANN_DATA=dir reads the mnist files from dir (default data/), ANN_EPOCHS=n trains n epochs (default 30). see bench.lua
+local DATA = os.getenv "ANN_DATA" or "data"
+local EPOCHS = tonumber(os.getenv "ANN_EPOCHS") or 30
+-- ANN_LEAN=1 trains without the convolution signal (conv_size floats), see filter:convpool(input, output, argmax)
+local LEAN = os.getenv "ANN_LEAN"
+-- ANN_STRIDE=s and ANN_PAD=p set the stride and the zero padding of the convolution
+local STRIDE = tonumber(os.getenv "ANN_STRIDE")
+local PAD = tonumber(os.getenv "ANN_PAD")
+local images, labels = mnist.load(DATA .. "/train-images.idx3-ubyte", DATA .. "/train-labels.idx1-ubyte")
 
 local network = {}	; network.__index = network
 
@@ -11,13 +18,17 @@ function network.new(args)
 			args.col,
 			args.row,
 			args.filter_n,
-			2):randn(0.01)
+			2,
+			1,
+			args.stride,
+			args.pad):randn(0.01)
 	local conv_args = filter:args()
 	local n = {
 		filter = filter,
 		input = ann.signal(args.col * args.row),
-		conv = ann.signal(conv_args.conv_size),
+		conv = not LEAN and ann.signal(conv_args.conv_size),
 		pooling = ann.signal(conv_args.output_size),
+		argmax = filter:argmax(),
 		hidden = ann.signal(args.hidden),
 		output = ann.signal(args.output),
 		weight_ih = ann.weight(conv_args.output_size, args.hidden):randn(),
@@ -25,15 +36,37 @@ function network.new(args)
 		bias_hidden = ann.signal(args.hidden):randn(),
 		bias_output = ann.signal(args.output):randn(),
 	}
+	n.params = ann.params {
+		n.weight_ih,
+		n.weight_ho,
+		n.bias_hidden,
+		n.bias_output,
+		{ filter, lr = 1 / conv_args.output_size },
+	}
 
 	return setmetatable(n, network)
 end
 
 function network:feedforward(image)
 	self.input:init(image)
-	self.filter:convolution(self.input, self.conv)
-	self.filter:maxpooling(self.conv, self.pooling)
-	self.pooling:relu()
+	if LEAN then
+		-- convpool includes the relu
+		self.filter:convpool(self.input, self.pooling, self.argmax)
+	else
+		self.filter:convolution(self.input, self.conv)
+		self.filter:maxpooling(self.conv, self.pooling, self.argmax)
+		self.pooling:relu()
+	end
+	ann.prop(self.pooling, self.hidden, self.weight_ih)
+	self.hidden:accumulate(self.bias_hidden):sigmoid()
+	ann.prop(self.hidden, self.output, self.weight_ho)
+	return self.output:accumulate(self.bias_output)
+end
+
+-- inference only, the convolution signal is not filled
+function network:predict(image)
+	self.input:init(image)
+	self.filter:convpool(self.input, self.pooling)
 	ann.prop(self.pooling, self.hidden, self.weight_ih)
 	self.hidden:accumulate(self.bias_hidden):sigmoid()
 	ann.prop(self.hidden, self.output, self.weight_ho)
@@ -52,20 +85,16 @@ function network:train(training_data, batch_size, eta)
 	shffule_training_data(training_data)
 
 	local eta_ = - eta / batch_size
-	local filter_delta = self.filter:clone()
-	local filter_delta_s = self.filter:clone()
-	local dw_ih = ann.weight(self.weight_ih:size())
-	local dw_ih_s = ann.weight(self.weight_ih:size())
-	local dw_ho = ann.weight(self.weight_ho:size())
-	local dw_ho_s = ann.weight(self.weight_ho:size())
-	local db_output_s = ann.signal(self.output:size())
-	local db_hidden = ann.signal(self.hidden:size())
-	local db_hidden_s = ann.signal(self.hidden:size())
+	-- gradient of one sample, and the sum of a batch. (views of dw_ih, dw_ho, db_hidden, db_output, filter_delta)
+	local grad = self.params:clone()
+	local grad_s = self.params:clone()
+	local delta = { grad:views() }
+	local delta_s = { grad_s:views() }
 	local db_pooling = ann.signal(self.pooling:size())
+	local db_conv = not LEAN and ann.signal(self.conv:size())
 
-	local db_output
-
-	local function backprop(expect)
+	local function backprop(expect, delta)
+		local dw_ih, dw_ho, db_hidden, db_output, filter_delta = delta[1], delta[2], delta[3], delta[4], delta[5]
 		-- calc error
 		ann.softmax_error(self.output, expect, db_output)
 		-- backprop from output to hidden
@@ -80,47 +109,75 @@ function network:train(training_data, batch_size, eta)
 		-- backprop convpooling
 		ann.backprop_relu(self.pooling, db_pooling)
 		filter_delta:backprop_conv_bias(db_pooling)
-		filter_delta:backprop_maxpooling(self.conv, db_pooling)
-		filter_delta:backprop_conv_weight(self.input, self.conv)
+		if LEAN then
+			-- recompute only the windows at argmax
+			filter_delta:backprop_conv_weight(self.input, db_pooling, self.argmax)
+		else
+			filter_delta:backprop_maxpooling(db_conv, db_pooling, self.argmax)
+			filter_delta:backprop_conv_weight(self.input, db_conv)
+		end
 	end
 
-	local scale = 1 / db_pooling:size()
-
 	for i = 1, #training_data, batch_size do
+		-- the first sample of a batch writes into the sum directly
 		self:feedforward(training_data[i].image)
-		db_output = db_output_s
-		backprop(training_data[i].expect)
-
-		db_output = self.output
-		db_hidden_s, db_hidden = db_hidden, db_hidden_s
-		dw_ih_s, dw_ih = dw_ih, dw_ih_s
-		dw_ho_s, dw_ho = dw_ho, dw_ho_s
-		filter_delta, filter_delta_s = filter_delta_s, filter_delta
+		backprop(training_data[i].expect, delta_s)
 
 		for j = 1, batch_size-1 do
 			local image = training_data[i+j]
 			if image then
 				self:feedforward(image.image)
-				backprop(training_data[i+j].expect)
-				dw_ih_s:accumulate(dw_ih)
-				dw_ho_s:accumulate(dw_ho)
-				db_output_s:accumulate(db_output)
-				db_hidden_s:accumulate(db_hidden)
-				filter_delta_s:accumulate(filter_delta)
+				backprop(training_data[i+j].expect, delta)
+				grad_s:accumulate(grad)
 			else
 				eta_ = - eta / j
 				break
 			end
 		end
 
-		self.weight_ih:accumulate(dw_ih_s, eta_)
-		self.weight_ho:accumulate(dw_ho_s, eta_)
-		self.bias_hidden:accumulate(db_hidden_s, eta_)
-		self.bias_output:accumulate(db_output_s, eta_)
-		self.filter:accumulate(filter_delta_s, eta_ * scale)
+		-- the filter is scaled by its lr (1 / output_size)
+		self.params:accumulate(grad_s, eta_)
 	end
 end
 
+function network:save(filename)
+	local f = assert(io.open(filename, "wb"))
+	local function array(t)
+		local tmp = {}
+		for i, v in ipairs(t) do
+			tmp[i] = string.format("%.9g", v)
+		end
+		return "{" .. table.concat(tmp, ",") .. "}"
+	end
+	local function matrix(m)
+		local tmp = {}
+		for i, row in ipairs(m) do
+			tmp[i] = array(row)
+		end
+		return "{\n" .. table.concat(tmp, ",\n") .. "}"
+	end
+	local input, hidden = self.weight_ih:size()
+	local _, output = self.weight_ho:size()
+	local args = self.filter:args()
+	local filter = self.filter:export()
+	local bias = {}
+	for i, w in ipairs(filter) do
+		bias[i] = w.bias
+	end
+	f:write(string.format("return {\ninput = %d,\nhidden = %d,\noutput = %d,\n", input, hidden, output))
+	f:write(string.format("filter = {\nsize = %d,\nn = %d,\nchannel = %d,\nw = %d,\nh = %d,\npooling = %d,\n",
+		args.size, args.n, args.channel, args.w, args.h, args.pooling))
+	f:write(string.format("stride = %d,\npad = %d,\npool_stride = %d,\n", args.stride, args.pad, args.pool_stride))
+	f:write("weight = ", matrix(filter), ",\n")
+	f:write("bias = ", array(bias), ",\n},\n")
+	f:write("weight_ih = ", matrix(self.weight_ih:export()), ",\n")
+	f:write("weight_ho = ", matrix(self.weight_ho:export()), ",\n")
+	f:write("bias_hidden = ", array(self.bias_hidden:toarray()), ",\n")
+	f:write("bias_output = ", array(self.bias_output:toarray()), ",\n")
+	f:write("}\n")
+	f:close()
+end
+
 local function gen_training_data()
 	local result = {}
 	for i = 0, 9 do
@@ -142,19 +199,20 @@ local n = network.new {
 	col = images.col,
 	filter_size = 5,
 	filter_n = 30,
+	stride = STRIDE,
+	pad = PAD,
 	hidden = 30,
 	output = 10,
 }
 
 local data = gen_training_data()
 
-local labels = mnist.labels "data/t10k-labels.idx1-ubyte"
-local images = mnist.images "data/t10k-images.idx3-ubyte"
+local images, labels = mnist.load(DATA .. "/t10k-images.idx3-ubyte", DATA .. "/t10k-labels.idx1-ubyte")
 
 local function test()
 	local s = 0
 	for idx = 1, #labels do
-		local r, p = n:feedforward(images[idx]):max()
+		local r, p = n:predict(images[idx]):max()
 		local label = labels[idx]
 		if r~=label then
 			s = s + 1
@@ -163,7 +221,18 @@ local function test()
 	return (s / #labels * 100) .."%"
 end
 
-for i = 1, 30 do
+for i = 1, EPOCHS do
+	local t0 = ann.clock()
 	n:train(data,10,3.0)
-	print("Epoch", i, test())
+	local t1 = ann.clock()
+	local err = test()
+	local t2 = ann.clock()
+	print(string.format("Epoch %d %s train %.0f images/s test %.0f images/s epoch %.3fs",
+		i, err, #data / (t1 - t0), #labels / (t2 - t1), t2 - t0))
+end
+print("Peak RSS", ann.peakrss() .. " KB")
+
+-- lua cnn.lua model.lua : save the model for export.lua
+if arg and arg[1] and arg[1] ~= "-" then
+	n:save(arg[1])
 end
@@ -0,0 +1,193 @@
+-- lua export.lua model.lua [name]
+-- Generate name.h and name.c (default name is "model") from a model saved by network.lua or cnn.lua.
+-- All the sizes are constants and the weights are static arrays, so the source builds without lua :
+--   gcc -O2 -shared -fPIC -o model.so model.c -lm
+
+local model = assert(dofile(assert(arg[1], "Need model.lua")))
+local name = arg[2] or "model"
+local NAME = name:upper()
+
+local function number(v)
+	-- %e always has a dot or an exponent, so the f suffix is valid
+	return string.format("%.9ef", v)
+end
+
+local function array(t)
+	local lines = {}
+	for i = 1, #t, 8 do
+		local tmp = {}
+		for j = i, math.min(i + 7, #t) do
+			tmp[#tmp+1] = number(t[j])
+		end
+		lines[#lines+1] = "\t" .. table.concat(tmp, ", ") .. ","
+	end
+	return "{\n" .. table.concat(lines, "\n") .. "\n}"
+end
+
+local function matrix(m)
+	local rows = {}
+	for i, row in ipairs(m) do
+		rows[i] = array(row)
+	end
+	return "{\n" .. table.concat(rows, ",\n") .. "\n}"
+end
+
+local code = {}
+local function emit(fmt, ...)
+	code[#code+1] = string.format(fmt, ...)
+end
+
+local filter = model.filter
+local input = filter and filter.w * filter.h * filter.channel or model.input
+
+emit("// Generated by export.lua from %s, don't edit.\n", arg[1])
+emit("#include \"%s.h\"\n", name)
+emit("#include <math.h>\n\n")
+emit("#define ALIGNED __attribute__((aligned(64)))\n\n")
+emit("#define INPUT %d\n#define HIDDEN %d\n#define OUTPUT %d\n", model.input, model.hidden, model.output)
+
+-- models saved before the strided filters have stride 1, no padding and non-overlapping pooling
+local stride = filter and filter.stride or 1
+local pad = filter and filter.pad or 0
+local pool_stride = filter and filter.pool_stride or filter and filter.pooling
+
+if filter then
+	local cw = (filter.w + 2 * pad - filter.size) // stride + 1
+	local ch = (filter.h + 2 * pad - filter.size) // stride + 1
+	local pw = (cw - filter.pooling) // pool_stride + 1
+	local ph = (ch - filter.pooling) // pool_stride + 1
+	assert(pw * ph * filter.n == model.input, "The filter output doesn't match the input")
+	emit("#define SRC_W %d\n#define SRC_H %d\n#define CHANNEL %d\n", filter.w, filter.h, filter.channel)
+	emit("#define FILTER_N %d\n#define POOLING %d\n#define PW %d\n#define PH %d\n", filter.n, filter.pooling, pw, ph)
+	emit("#define STRIDE %d\n#define PAD %d\n#define POOL_STRIDE %d\n", stride, pad, pool_stride)
+	-- the input is copied into a zero padded image when PAD > 0
+	emit("#define PAD_W (SRC_W + PAD * 2)\n#define PAD_H (SRC_H + PAD * 2)\n")
+	emit("#define FSIZE %d\n#define LINE (PAD_W * CHANNEL)\n#define FLINE (FSIZE * CHANNEL)\n\n", filter.size)
+	emit("static const float filter_weight[FILTER_N][FSIZE * FLINE] ALIGNED = %s;\n\n", matrix(filter.weight))
+	emit("static const float filter_bias[FILTER_N] = %s;\n\n", array(filter.bias))
+
+	-- the convolution window of one filter, fully unrolled
+	local terms = {}
+	for y = 0, filter.size - 1 do
+		for x = 0, filter.size * filter.channel - 1 do
+			terms[#terms+1] = string.format("src[%d] * f[%d]", y * (filter.w + pad * 2) * filter.channel + x, y * filter.size * filter.channel + x)
+		end
+	end
+	emit("static inline float\nconv_dot(const float *src, const float *f) {\n\treturn\n\t\t%s;\n}\n\n",
+		table.concat(terms, " +\n\t\t"))
+
+	emit([[
+// convolution + bias + max pooling + relu
+static void
+convpool(const float *src, float *dst) {
+	int k,i,j,m,n;
+	for (k=0;k<FILTER_N;k++) {
+		const float *f = filter_weight[k];
+		for (i=0;i<PH;i++) {
+			for (j=0;j<PW;j++) {
+				const float *window = src + (i * LINE + j * CHANNEL) * POOL_STRIDE * STRIDE;
+				float maxv = -INFINITY;
+				for (m=0;m<POOLING;m++) {
+					for (n=0;n<POOLING;n++) {
+						float v = conv_dot(window + (m * LINE + n * CHANNEL) * STRIDE, f);
+						if (v > maxv)
+							maxv = v;
+					}
+				}
+				maxv += filter_bias[k];
+				*dst++ = maxv > 0 ? maxv : 0;
+			}
+		}
+	}
+}
+
+]])
+end
+
+emit("static const float weight_ih[HIDDEN][INPUT] ALIGNED = %s;\n\n", matrix(model.weight_ih))
+emit("static const float bias_hidden[HIDDEN] = %s;\n\n", array(model.bias_hidden))
+emit("static const float weight_ho[OUTPUT][HIDDEN] ALIGNED = %s;\n\n", matrix(model.weight_ho))
+emit("static const float bias_output[OUTPUT] = %s;\n\n", array(model.bias_output))
+
+emit([[
+int
+%s_predict(const unsigned char *image, float *output) {
+	float input[%s_INPUT] ALIGNED;
+	float hidden[HIDDEN] ALIGNED;
+	float out[OUTPUT];
+	int i,j;
+	for (i=0;i<%s_INPUT;i++) {
+		input[i] = image[i] / 255.0f;
+	}
+]], name, NAME, NAME)
+if filter then
+	if pad > 0 then
+		emit([[
+	float padded[PAD_H * LINE] = { 0 };
+	for (i=0;i<SRC_H;i++) {
+		for (j=0;j<SRC_W * CHANNEL;j++) {
+			padded[(i + PAD) * LINE + PAD * CHANNEL + j] = input[i * SRC_W * CHANNEL + j];
+		}
+	}
+	float pooling[INPUT] ALIGNED;
+	convpool(padded, pooling);
+	const float *layer = pooling;
+]])
+	else
+		emit([[
+	float pooling[INPUT] ALIGNED;
+	convpool(input, pooling);
+	const float *layer = pooling;
+]])
+	end
+else
+	emit("\tconst float *layer = input;\n")
+end
+emit([[
+	for (i=0;i<HIDDEN;i++) {
+		float s = 0;
+		for (j=0;j<INPUT;j++) {
+			s += layer[j] * weight_ih[i][j];
+		}
+		hidden[i] = 1.0f / (1.0f + expf(-(s + bias_hidden[i])));
+	}
+	int label = 0;
+	for (i=0;i<OUTPUT;i++) {
+		float s = 0;
+		for (j=0;j<HIDDEN;j++) {
+			s += hidden[j] * weight_ho[i][j];
+		}
+		out[i] = s + bias_output[i];
+		if (out[i] > out[label])
+			label = i;
+	}
+	if (output) {
+		for (i=0;i<OUTPUT;i++) {
+			output[i] = out[i];
+		}
+	}
+	return label;
+}
+]])
+
+local f = assert(io.open(name .. ".c", "wb"))
+f:write(table.concat(code))
+f:close()
+
+f = assert(io.open(name .. ".h", "wb"))
+f:write(string.format([[
+// Generated by export.lua from %s, don't edit.
+#ifndef %s_h
+#define %s_h
+
+#define %s_INPUT %d
+#define %s_OUTPUT %d
+
+// image is %s_INPUT bytes of pixels, output (can be NULL) receives %s_OUTPUT scores, returns the label
+int %s_predict(const unsigned char *image, float *output);
+
+#endif
+]], arg[1], name, name, NAME, input, NAME, model.output, NAME, NAME, name))
+f:close()
+
+print("Write", name .. ".c", name .. ".h")
@@ -0,0 +1,59 @@
+-- lua hogwild.lua [threads] : train network.lua's model with lock-free threads
+local mnist = require "mnist"
+local ann = require "ann"
+
+local threads = tonumber(arg and arg[1]) or 4
+
+local images, labels = mnist.load("data/train-images.idx3-ubyte", "data/train-labels.idx1-ubyte")
+
+local input, hidden, output = images.row * images.col, 30, 10
+
+local n = {
+	input = ann.signal(input),
+	hidden = ann.signal(hidden),
+	output = ann.signal(output),
+	weight_ih = ann.weight(input, hidden):randn(),
+	weight_ho = ann.weight(hidden, output):randn(),
+	bias_hidden = ann.signal(hidden):randn(),
+	bias_output = ann.signal(output):randn(),
+}
+
+local function feedforward(image)
+	n.input:init(image)
+	ann.prop(n.input, n.hidden, n.weight_ih)
+	n.hidden:accumulate(n.bias_hidden):sigmoid()
+	ann.prop(n.hidden, n.output, n.weight_ho)
+	return n.output:accumulate(n.bias_output)
+end
+
+local test_images, test_labels = mnist.load("data/t10k-images.idx3-ubyte", "data/t10k-labels.idx1-ubyte")
+
+local function test()
+	local s = 0
+	for idx = 1, #test_labels do
+		local r = feedforward(test_images[idx]):max()
+		if r ~= test_labels[idx] then
+			s = s + 1
+		end
+	end
+	return (s / #test_labels * 100) .."%"
+end
+
+for i = 1, 30 do
+	local stat = ann.hogwild {
+		images = images,
+		labels = labels,
+		weight_ih = n.weight_ih,
+		bias_hidden = n.bias_hidden,
+		weight_ho = n.weight_ho,
+		bias_output = n.bias_output,
+		threads = threads,
+		eta = 3.0,
+		batch = 20,
+	}
+	local per_thread = {}
+	for idx, t in ipairs(stat) do
+		per_thread[idx] = string.format("%d/%.2fs", t.samples, t.seconds)
+	end
+	print("Epoch", i, test(), string.format("%.0f samples/s", stat.samples / stat.seconds), table.concat(per_thread, " "))
+end
@@ -0,0 +1,211 @@
+// Load generator for ann.serve
+// loadgen [socket path] [connections] [requests per connection] [images.idx3-ubyte]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct images {
+	int n;
+	int size;
+	uint8_t *data;
+};
+
+struct client {
+	const char *path;
+	const struct images *images;
+	int requests;
+	int seed;
+	int errors;
+	int hist[10];
+	double *latency;
+};
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+read_uint32(FILE *f) {
+	uint8_t bytes[4] = {0} ;
+	if (fread(bytes, 1, 4, f) != 4)
+		return 0;
+	return bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+static int
+load_images(const char *filename, struct images *img) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return 1;
+	uint32_t magic = read_uint32(f);
+	if (magic != 2051) {
+		fclose(f);
+		return 1;
+	}
+	img->n = read_uint32(f);
+	int row = read_uint32(f);
+	int col = read_uint32(f);
+	img->size = row * col;
+	if (img->n <= 0 || img->size <= 0) {
+		fclose(f);
+		return 1;
+	}
+	size_t sz = (size_t)img->n * img->size;
+	img->data = (uint8_t *)malloc(sz);
+	if (img->data == NULL) {
+		fclose(f);
+		return 1;
+	}
+	int err = fread(img->data, 1, sz, f) != sz;
+	fclose(f);
+	return err;
+}
+
+static int
+random_images(struct images *img) {
+	int i;
+	img->n = 1000;
+	img->size = 28 * 28;
+	img->data = (uint8_t *)malloc(img->n * img->size);
+	if (img->data == NULL)
+		return 1;
+	for (i=0;i<img->n * img->size;i++) {
+		img->data[i] = rand() & 0xff;
+	}
+	return 0;
+}
+
+static int
+send_all(int fd, const uint8_t *buf, int sz) {
+	while (sz > 0) {
+		ssize_t n = write(fd, buf, sz);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		buf += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+static void *
+client_thread(void *ud) {
+	struct client *c = (struct client *)ud;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		c->errors = c->requests;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	unsigned seed = c->seed;
+	int i;
+	for (i=0;i<c->requests;i++) {
+		const uint8_t *image = c->images->data + (size_t)(rand_r(&seed) % c->images->n) * c->images->size;
+		double t = now();
+		uint8_t label;
+		if (send_all(fd, image, c->images->size) || read(fd, &label, 1) != 1) {
+			c->errors += c->requests - i;
+			break;
+		}
+		c->latency[i] = now() - t;
+		if (label < 10)
+			++c->hist[label];
+	}
+	close(fd);
+	return NULL;
+}
+
+static int
+compar(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *path = argc > 1 ? argv[1] : "/tmp/ann.sock";
+	int connections = argc > 2 ? atoi(argv[2]) : 8;
+	int requests = argc > 3 ? atoi(argv[3]) : 10000;
+	struct images images;
+	if (argc > 4) {
+		if (load_images(argv[4], &images)) {
+			fprintf(stderr, "Can't load %s\n", argv[4]);
+			return 1;
+		}
+	} else if (random_images(&images)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if (connections <= 0 || requests <= 0) {
+		fprintf(stderr, "Invalid connections %d or requests %d\n", connections, requests);
+		return 1;
+	}
+	struct client *c = (struct client *)calloc(connections, sizeof(*c));
+	pthread_t *pid = (pthread_t *)malloc(connections * sizeof(*pid));
+	double *latency = (double *)calloc((size_t)connections * requests, sizeof(double));
+	if (c == NULL || pid == NULL || latency == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	int i;
+	double t = now();
+	for (i=0;i<connections;i++) {
+		c[i].path = path;
+		c[i].images = &images;
+		c[i].requests = requests;
+		c[i].seed = i + 1;
+		c[i].latency = latency + (size_t)i * requests;
+		pthread_create(&pid[i], NULL, client_thread, &c[i]);
+	}
+	int errors = 0;
+	int hist[10] = { 0 };
+	for (i=0;i<connections;i++) {
+		int j;
+		pthread_join(pid[i], NULL);
+		errors += c[i].errors;
+		for (j=0;j<10;j++)
+			hist[j] += c[i].hist[j];
+	}
+	t = now() - t;
+	// compact the answered requests
+	size_t n = 0;
+	size_t k;
+	for (k=0;k<(size_t)connections * requests;k++) {
+		if (latency[k] > 0)
+			latency[n++] = latency[k];
+	}
+	qsort(latency, n, sizeof(double), compar);
+	printf("requests %zu errors %d in %.3fs : %.0f req/s\n", n, errors, t, n / t);
+	if (n > 0) {
+		printf("latency p50 %.3fms p99 %.3fms max %.3fms\n",
+			latency[n / 2] * 1000, latency[n * 99 / 100] * 1000, latency[n - 1] * 1000);
+	}
+	printf("labels");
+	for (i=0;i<10;i++)
+		printf(" %d", hist[i]);
+	printf("\n");
+	free(latency);
+	free(pid);
+	free(c);
+	free(images.data);
+	return errors != 0;
+}
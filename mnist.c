@@ -4,14 +4,19 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+// gzread reads both gzip compressed and plain files.
+#define READ_CHUNK (1024 * 1024)
 
 static int
 label_get(lua_State *L) {
 	uint8_t *data = (uint8_t *)luaL_checkudata(L, 1, "MNIST_LABELS");
-	int n = luaL_checkinteger(L, 2);
-	int sz = lua_rawlen(L, 1);
-	if (n <= 0 || n > sz) {
-		return luaL_error(L, "Out of range %d [1, %d]", n, sz);
+	lua_Integer n = luaL_checkinteger(L, 2);
+	lua_Unsigned sz = lua_rawlen(L, 1);
+	if (n <= 0 || (lua_Unsigned)n > sz) {
+		return luaL_error(L, "Out of range %I [1, %I]", n, (lua_Integer)sz);
 	}
 	lua_pushinteger(L, data[n-1]);
 	return 1;
@@ -20,32 +25,54 @@ label_get(lua_State *L) {
 static int
 label_len(lua_State *L) {
 	luaL_checkudata(L, 1, "MNIST_LABELS");
-	int sz = lua_rawlen(L, 1);
-	lua_pushinteger(L, sz);
+	lua_pushinteger(L, (lua_Integer)lua_rawlen(L, 1));
 	return 1;
 }
 
 static uint32_t
-read_uint32(FILE *f) {
+read_uint32(gzFile f) {
 	uint8_t bytes[4] = {0} ;
-	fread(bytes, 1, 4, f);
+	gzread(f, bytes, 4);
 	return bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
 }
 
-static int
-read_labels(lua_State *L) {
-	const char * filename = luaL_checkstring(L, 1);
-	FILE *f = fopen(filename, "rb");
+// filename, or filename.gz as it's downloaded. NULL if neither can be opened
+static gzFile
+gzopen_idx(lua_State *L, const char *filename) {
+	gzFile f = gzopen(filename, "rb");
+	if (f == NULL) {
+		f = gzopen(lua_pushfstring(L, "%s.gz", filename), "rb");
+		lua_pop(L, 1);
+	}
+	if (f)
+		gzbuffer(f, 128 * 1024);
+	return f;
+}
+
+static gzFile
+open_idx(lua_State *L, const char *filename) {
+	gzFile f = gzopen_idx(L, filename);
 	if (f == NULL)
-		return luaL_error(L, "Can't open %s", filename);
-	uint32_t magic = read_uint32(f);
-	if (magic != 2049)
-		return luaL_error(L, "Invalid magic number %d (Should be 2049)", magic);
-	uint32_t number = read_uint32(f);
-	void *data = lua_newuserdatauv(L, number, 0);
-	if (fread(data, 1, number, f) != number)
-		return luaL_error(L, "Invalid labels number (%d)", number);
-	fclose(f);
+		luaL_error(L, "Can't open %s", filename);
+	return f;
+}
+
+// decompress into data chunk by chunk, returns 0 if succ
+static int
+read_data(gzFile f, void *data, size_t sz) {
+	uint8_t *ptr = (uint8_t *)data;
+	while (sz > 0) {
+		unsigned n = sz > READ_CHUNK ? READ_CHUNK : (unsigned)sz;
+		if (gzread(f, ptr, n) != n)
+			return 1;
+		ptr += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+static void
+set_labels_meta(lua_State *L) {
 	if (luaL_newmetatable(L, "MNIST_LABELS")) {
 		luaL_Reg l[] = {
 			{ "__index", label_get },
@@ -55,6 +82,37 @@ read_labels(lua_State *L) {
 		luaL_setfuncs(L, l, 0);
 	}
 	lua_setmetatable(L, -2);
+}
+
+// push labels userdata (uninitialized) and its size, or push the error message and returns 0.
+// The caller closes f (and raises the error)
+static int
+new_labels(lua_State *L, gzFile f, size_t *sz) {
+	uint32_t magic = read_uint32(f);
+	if (magic != 2049) {
+		lua_pushfstring(L, "Invalid magic number %d (Should be 2049)", (int)magic);
+		return 0;
+	}
+	uint32_t number = read_uint32(f);
+	lua_newuserdatauv(L, number, 0);
+	set_labels_meta(L);
+	*sz = number;
+	return 1;
+}
+
+static int
+read_labels(lua_State *L) {
+	const char * filename = luaL_checkstring(L, 1);
+	gzFile f = open_idx(L, filename);
+	size_t number;
+	if (!new_labels(L, f, &number)) {
+		gzclose(f);
+		return lua_error(L);
+	}
+	int err = read_data(f, lua_touserdata(L, -1), number);
+	gzclose(f);
+	if (err)
+		return luaL_error(L, "Invalid labels number (%d)", (int)number);
 	return 1;
 }
 
@@ -97,33 +155,31 @@ image_get(lua_State *L) {
 	if (idx <= 0 || idx > meta->n) {
 		return luaL_error(L, "Out of range %d [1, %d]", idx, meta->n);
 	}
-	size_t stride = meta->row * meta->col;
+	size_t stride = (size_t)meta->row * meta->col;
 	const char * image = (const char *)lua_touserdata(L, 1);
 	image = image + stride * (idx-1);
 	lua_pushlstring(L, image, stride);
 	return 1;
 }
 
+// push images userdata (uninitialized) and its size, or push the error message and returns 0.
+// The caller closes f (and raises the error)
 static int
-read_images(lua_State *L) {
-	struct image_meta *meta = (struct image_meta *)lua_newuserdatauv(L, sizeof(*meta), 0);
-	const char * filename = luaL_checkstring(L, 1);
-	FILE *f = fopen(filename, "rb");
-	if (f == NULL)
-		return luaL_error(L, "Can't open %s", filename);
+new_images(lua_State *L, gzFile f, size_t *psz) {
 	uint32_t magic = read_uint32(f);
-	if (magic != 2051)
-		return luaL_error(L, "Invalid magic number %d (Should be 2051)", magic);
+	if (magic != 2051) {
+		lua_pushfstring(L, "Invalid magic number %d (Should be 2051)", (int)magic);
+		return 0;
+	}
+	struct image_meta *meta = (struct image_meta *)lua_newuserdatauv(L, sizeof(*meta), 0);
 	meta->n = read_uint32(f);
 	meta->row = read_uint32(f);
 	meta->col = read_uint32(f);
-	size_t sz = meta->n * meta->row * meta->col;
-	void *data = lua_newuserdatauv(L, sz, 1);
+	size_t sz = (size_t)meta->n * meta->row * meta->col;
+	lua_newuserdatauv(L, sz, 1);
 	lua_pushvalue(L, -2);
 	lua_setiuservalue(L, -2, 1);
-	if (fread(data, 1, sz, f) != sz)
-		return luaL_error(L, "Invalid images size %dx%dx%d", meta->n, meta->row, meta->col);
-	fclose(f);
+	lua_replace(L, -2);
 	if (luaL_newmetatable(L, "MNIST_IMAGES")) {
 		luaL_Reg l[] = {
 			{ "__index", image_get },
@@ -133,9 +189,667 @@ read_images(lua_State *L) {
 		luaL_setfuncs(L, l, 0);
 	}
 	lua_setmetatable(L, -2);
+	*psz = sz;
+	return 1;
+}
+
+static int
+read_images(lua_State *L) {
+	const char * filename = luaL_checkstring(L, 1);
+	gzFile f = open_idx(L, filename);
+	size_t sz;
+	if (!new_images(L, f, &sz)) {
+		gzclose(f);
+		return lua_error(L);
+	}
+	int err = read_data(f, lua_touserdata(L, -1), sz);
+	gzclose(f);
+	if (err)
+		return luaL_error(L, "Invalid images size %I", (lua_Integer)sz);
+	return 1;
+}
+
+struct loader {
+	gzFile f;
+	void *data;
+	size_t sz;
+	int err;
+};
+
+static void *
+load_thread(void *ud) {
+	struct loader *l = (struct loader *)ud;
+	l->err = read_data(l->f, l->data, l->sz);
+	return NULL;
+}
+
+// mnist.load(images_filename, labels_filename) : read images and labels concurrently
+static int
+load_dataset(lua_State *L) {
+	const char * images_filename = luaL_checkstring(L, 1);
+	const char * labels_filename = luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+	struct loader images, labels;
+	images.f = open_idx(L, images_filename);
+	labels.f = gzopen_idx(L, labels_filename);
+	if (labels.f == NULL) {
+		gzclose(images.f);
+		return luaL_error(L, "Can't open %s", labels_filename);
+	}
+	if (!new_images(L, images.f, &images.sz) || !new_labels(L, labels.f, &labels.sz)) {
+		gzclose(images.f);
+		gzclose(labels.f);
+		return lua_error(L);
+	}
+	images.data = lua_touserdata(L, 3);
+	labels.data = lua_touserdata(L, 4);
+	pthread_t pid;
+	int threaded = pthread_create(&pid, NULL, load_thread, &labels) == 0;
+	if (!threaded)
+		load_thread(&labels);
+	load_thread(&images);
+	if (threaded)
+		pthread_join(pid, NULL);
+	gzclose(images.f);
+	gzclose(labels.f);
+	if (images.err)
+		return luaL_error(L, "Invalid images %s", images_filename);
+	if (labels.err)
+		return luaL_error(L, "Invalid labels %s", labels_filename);
+	return 2;
+}
+
+// IDX : any type and rank. The data is converted to the host byte order when loading.
+
+#define IDX_UINT8 0x08
+#define IDX_INT8 0x09
+#define IDX_INT16 0x0B
+#define IDX_INT32 0x0C
+#define IDX_FLOAT32 0x0D
+#define IDX_FLOAT64 0x0E
+
+struct idx_meta {
+	int type;
+	int size;	// bytes of an element
+	int rank;
+	uint64_t n;	// elements
+	uint64_t dims[1];	// [rank] and then the strides (bytes) [rank]
+};
+
+static inline uint64_t *
+idx_strides(struct idx_meta *m) {
+	return m->dims + m->rank;
+}
+
+static int
+idx_type_size(int type) {
+	switch (type) {
+	case IDX_UINT8:
+	case IDX_INT8:
+		return 1;
+	case IDX_INT16:
+		return 2;
+	case IDX_INT32:
+	case IDX_FLOAT32:
+		return 4;
+	case IDX_FLOAT64:
+		return 8;
+	}
+	return 0;
+}
+
+static const char *
+idx_type_name(int type) {
+	switch (type) {
+	case IDX_UINT8: return "uint8";
+	case IDX_INT8: return "int8";
+	case IDX_INT16: return "int16";
+	case IDX_INT32: return "int32";
+	case IDX_FLOAT32: return "float32";
+	case IDX_FLOAT64: return "float64";
+	}
+	return "unknown";
+}
+
+// big endian to host, in place
+static void
+idx_swap(uint8_t *data, uint64_t n, int size) {
+	const uint16_t one = 1;
+	if (size == 1 || *(const uint8_t *)&one == 0)
+		return;
+	uint64_t i;
+	int j;
+	for (i=0;i<n;i++) {
+		for (j=0;j<size/2;j++) {
+			uint8_t tmp = data[j];
+			data[j] = data[size-1-j];
+			data[size-1-j] = tmp;
+		}
+		data += size;
+	}
+}
+
+static struct idx_meta *
+idx_check(lua_State *L, int index) {
+	luaL_checkudata(L, index, "MNIST_IDX");
+	lua_getiuservalue(L, index, 1);
+	struct idx_meta *m = (struct idx_meta *)lua_touserdata(L, -1);
+	lua_pop(L, 1);	// the data keeps the meta alive
+	return m;
+}
+
+static void
+idx_push_element(lua_State *L, struct idx_meta *m, const uint8_t *ptr) {
+	switch (m->type) {
+	case IDX_UINT8: lua_pushinteger(L, *ptr); break;
+	case IDX_INT8: lua_pushinteger(L, *(const int8_t *)ptr); break;
+	case IDX_INT16: lua_pushinteger(L, *(const int16_t *)ptr); break;
+	case IDX_INT32: lua_pushinteger(L, *(const int32_t *)ptr); break;
+	case IDX_FLOAT32: lua_pushnumber(L, *(const float *)ptr); break;
+	case IDX_FLOAT64: lua_pushnumber(L, *(const double *)ptr); break;
+	}
+}
+
+static const uint8_t *
+idx_item(lua_State *L, struct idx_meta *m, int index, lua_Integer i) {
+	if (m->rank == 0 || i <= 0 || (uint64_t)i > m->dims[0])
+		luaL_error(L, "Out of range %I [1, %I]", (lua_Integer)i, m->rank ? (lua_Integer)m->dims[0] : (lua_Integer)0);
+	const uint8_t *data = (const uint8_t *)lua_touserdata(L, index);
+	return data + (uint64_t)(i - 1) * idx_strides(m)[0];
+}
+
+// idx:pointer([i]) : lightuserdata of the data (or of the i-th item), for zero-copy access by strides
+static int
+idx_pointer(lua_State *L) {
+	struct idx_meta *m = idx_check(L, 1);
+	if (lua_isnoneornil(L, 2)) {
+		lua_pushlightuserdata(L, lua_touserdata(L, 1));
+	} else {
+		lua_pushlightuserdata(L, (void *)idx_item(L, m, 1, luaL_checkinteger(L, 2)));
+	}
+	return 1;
+}
+
+static void
+idx_push_array(lua_State *L, const uint64_t *v, int n) {
+	lua_createtable(L, n, 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, (lua_Integer)v[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+}
+
+// idx[i] : a number (rank 1), or the bytes of the i-th item in host byte order
+// idx.type, idx.rank, idx.dims, idx.strides, idx:pointer([i])
+static int
+idx_get(lua_State *L) {
+	struct idx_meta *m = idx_check(L, 1);
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		const char *what = lua_tostring(L, 2);
+		if (strcmp(what, "type") == 0) {
+			lua_pushstring(L, idx_type_name(m->type));
+		} else if (strcmp(what, "rank") == 0) {
+			lua_pushinteger(L, m->rank);
+		} else if (strcmp(what, "dims") == 0) {
+			idx_push_array(L, m->dims, m->rank);
+		} else if (strcmp(what, "strides") == 0) {
+			idx_push_array(L, idx_strides(m), m->rank);
+		} else if (strcmp(what, "pointer") == 0) {
+			lua_pushcfunction(L, idx_pointer);
+		} else {
+			return luaL_error(L, "Can't get .%s", what);
+		}
+		return 1;
+	}
+	const uint8_t *item = idx_item(L, m, 1, luaL_checkinteger(L, 2));
+	if (m->rank == 1) {
+		idx_push_element(L, m, item);
+	} else {
+		lua_pushlstring(L, (const char *)item, idx_strides(m)[0]);
+	}
+	return 1;
+}
+
+static int
+idx_len(lua_State *L) {
+	struct idx_meta *m = idx_check(L, 1);
+	lua_pushinteger(L, m->rank ? (lua_Integer)m->dims[0] : 0);
+	return 1;
+}
+
+// mnist.idx(filename) : read an IDX file of any type and rank
+static int
+read_idx(lua_State *L) {
+	const char * filename = luaL_checkstring(L, 1);
+	gzFile f = open_idx(L, filename);
+	uint32_t magic = read_uint32(f);
+	int type = (magic >> 8) & 0xff;
+	int rank = magic & 0xff;
+	int size = idx_type_size(type);
+	if ((magic >> 16) != 0 || size == 0) {
+		gzclose(f);
+		return luaL_error(L, "Invalid IDX magic number %d", (int)magic);
+	}
+	struct idx_meta *m = (struct idx_meta *)lua_newuserdatauv(L, sizeof(*m) + (rank * 2) * sizeof(uint64_t), 0);
+	m->type = type;
+	m->size = size;
+	m->rank = rank;
+	m->n = 1;
+	int i;
+	for (i=0;i<rank;i++) {
+		uint64_t d = read_uint32(f);
+		if (d != 0 && m->n > UINT64_MAX / d) {
+			gzclose(f);
+			return luaL_error(L, "IDX too large");
+		}
+		m->dims[i] = d;
+		m->n *= d;
+	}
+	uint64_t *strides = idx_strides(m);
+	uint64_t stride = size;
+	for (i=rank-1;i>=0;i--) {
+		strides[i] = stride;
+		stride *= m->dims[i];
+	}
+	if (m->n > SIZE_MAX / size) {
+		gzclose(f);
+		return luaL_error(L, "IDX too large");
+	}
+	size_t sz = (size_t)m->n * size;
+	uint8_t *data = (uint8_t *)lua_newuserdatauv(L, sz, 1);
+	lua_pushvalue(L, -2);
+	lua_setiuservalue(L, -2, 1);
+	if (luaL_newmetatable(L, "MNIST_IDX")) {
+		luaL_Reg l[] = {
+			{ "__index", idx_get },
+			{ "__len", idx_len },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	int err = read_data(f, data, sz);
+	gzclose(f);
+	if (err)
+		return luaL_error(L, "Invalid IDX size %I : %s", (lua_Integer)sz, filename);
+	idx_swap(data, m->n, size);
+	return 1;
+}
+
+// Dataset : a compact uint32 permutation over images and labels, shuffled in C.
+
+struct dataset {
+	uint32_t n;
+	uint32_t stride;	// bytes of an image
+	uint64_t rng;
+	const uint8_t *images;
+	const uint8_t *labels;
+	uint32_t index[1];
+};
+
+struct samples {
+	struct dataset *d;
+	int label;	// images or labels
+};
+
+static inline uint64_t
+splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static struct dataset *
+check_dataset(lua_State *L, int index) {
+	return (struct dataset *)luaL_checkudata(L, index, "MNIST_DATASET");
+}
+
+// push the image (lightuserdata of stride bytes) and the label of the i-th (0-based) sample
+static void
+push_sample(lua_State *L, struct dataset *d, uint32_t i) {
+	uint32_t idx = d->index[i];
+	lua_pushlightuserdata(L, (void *)(d->images + (size_t)idx * d->stride));
+	lua_pushinteger(L, d->labels[idx]);
+}
+
+// ds:shuffle([seed])
+static int
+dataset_shuffle(lua_State *L) {
+	struct dataset *d = check_dataset(L, 1);
+	if (!lua_isnoneornil(L, 2))
+		d->rng = (uint64_t)luaL_checkinteger(L, 2);
+	uint32_t i;
+	for (i = d->n; i > 1; i--) {
+		// r in [0, i) : multiply-shift of 32 random bits
+		uint32_t r = (uint32_t)(((splitmix64(&d->rng) >> 32) * i) >> 32);
+		uint32_t tmp = d->index[i-1];
+		d->index[i-1] = d->index[r];
+		d->index[r] = tmp;
+	}
+	lua_settop(L, 1);
 	return 1;
 }
 
+static int
+dataset_len(lua_State *L) {
+	struct dataset *d = check_dataset(L, 1);
+	lua_pushinteger(L, d->n);
+	return 1;
+}
+
+// ds:sample(i) : image, label, index of the original data
+static int
+dataset_sample(lua_State *L) {
+	struct dataset *d = check_dataset(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	if (i <= 0 || i > d->n)
+		return luaL_error(L, "Out of range %d [1, %d]", (int)i, (int)d->n);
+	push_sample(L, d, i - 1);
+	lua_pushinteger(L, (lua_Integer)d->index[i - 1] + 1);
+	return 3;
+}
+
+// ds:shard(rank, nproc) : keep the samples of rank, all the shards are the same size
+static int
+dataset_shard(lua_State *L) {
+	struct dataset *d = check_dataset(L, 1);
+	int rank = luaL_checkinteger(L, 2);
+	int nproc = luaL_checkinteger(L, 3);
+	if (nproc <= 0 || rank < 0 || rank >= nproc)
+		return luaL_error(L, "Invalid rank %d / %d", rank, nproc);
+	uint32_t n = d->n / nproc;
+	uint32_t i;
+	for (i=0;i<n;i++) {
+		d->index[i] = d->index[(size_t)i * nproc + rank];
+	}
+	d->n = n;
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+batch_next(lua_State *L) {
+	struct dataset *d = check_dataset(L, lua_upvalueindex(1));
+	lua_Integer last = lua_tointeger(L, lua_upvalueindex(2));
+	lua_Integer i = luaL_checkinteger(L, 2) + 1;
+	if (i > last || i > d->n)
+		return 0;
+	lua_pushinteger(L, i);
+	push_sample(L, d, i - 1);
+	return 3;
+}
+
+// for i, image, label in ds:batch(b, size) do ... end : the b-th (1-based) batch
+static int
+dataset_batch(lua_State *L) {
+	check_dataset(L, 1);
+	lua_Integer b = luaL_checkinteger(L, 2);
+	lua_Integer size = luaL_checkinteger(L, 3);
+	if (b <= 0 || size <= 0)
+		return luaL_error(L, "Invalid batch %d (size %d)", (int)b, (int)size);
+	lua_settop(L, 1);
+	lua_pushinteger(L, b * size);
+	lua_pushcclosure(L, batch_next, 2);
+	lua_pushnil(L);
+	lua_pushinteger(L, (b - 1) * size);
+	return 3;
+}
+
+// samples[i] : image or label of the i-th sample, nil when out of range
+// samples.stride : the bytes of an image (pointer), so ann checks it against the signal
+static int
+samples_get(lua_State *L) {
+	struct samples *s = (struct samples *)luaL_checkudata(L, 1, "MNIST_SAMPLES");
+	struct dataset *d = s->d;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		const char *what = lua_tostring(L, 2);
+		if (s->label || strcmp(what, "stride") != 0)
+			return luaL_error(L, "Can't get .%s", what);
+		lua_pushinteger(L, d->stride);
+		return 1;
+	}
+	lua_Integer i = luaL_checkinteger(L, 2);
+	if (i <= 0 || i > d->n)
+		return 0;
+	uint32_t idx = d->index[i - 1];
+	if (s->label)
+		lua_pushinteger(L, d->labels[idx]);
+	else
+		lua_pushlightuserdata(L, (void *)(d->images + (size_t)idx * d->stride));
+	return 1;
+}
+
+static int
+samples_len(lua_State *L) {
+	struct samples *s = (struct samples *)luaL_checkudata(L, 1, "MNIST_SAMPLES");
+	lua_pushinteger(L, s->d->n);
+	return 1;
+}
+
+static void
+new_samples(lua_State *L, struct dataset *d, int label) {
+	struct samples *s = (struct samples *)lua_newuserdatauv(L, sizeof(*s), 1);
+	s->d = d;
+	s->label = label;
+	if (luaL_newmetatable(L, "MNIST_SAMPLES")) {
+		luaL_Reg l[] = {
+			{ "__index", samples_get },
+			{ "__len", samples_len },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	// keep the dataset alive
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1);
+}
+
+// ds:images() / ds:labels() : indexable views in the shuffled order, for ann tape:batch
+static int
+dataset_images(lua_State *L) {
+	check_dataset(L, 1);
+	lua_getiuservalue(L, 1, 3);
+	return 1;
+}
+
+static int
+dataset_labels(lua_State *L) {
+	check_dataset(L, 1);
+	lua_getiuservalue(L, 1, 4);
+	return 1;
+}
+
+// mnist.images, or a uint8 idx of rank >= 2 (n, row, col ...) : returns the data, the number and the bytes of an image
+static const uint8_t *
+dataset_images_arg(lua_State *L, int index, uint32_t *n, uint32_t *stride) {
+	if (luaL_testudata(L, index, "MNIST_IDX")) {
+		struct idx_meta *m = idx_check(L, index);
+		if (m->type != IDX_UINT8 || m->rank < 2)
+			luaL_error(L, "Images idx must be uint8 of rank >= 2 (%s, rank %d)", idx_type_name(m->type), m->rank);
+		if (m->dims[0] > UINT32_MAX || idx_strides(m)[0] > UINT32_MAX)
+			luaL_error(L, "Images idx too large (%I x %I)", (lua_Integer)m->dims[0], (lua_Integer)idx_strides(m)[0]);
+		*n = (uint32_t)m->dims[0];
+		*stride = (uint32_t)idx_strides(m)[0];
+		return (const uint8_t *)lua_touserdata(L, index);
+	}
+	const uint8_t *images = (const uint8_t *)luaL_checkudata(L, index, "MNIST_IMAGES");
+	lua_getiuservalue(L, index, 1);
+	struct image_meta *meta = (struct image_meta *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	*n = meta->n;
+	*stride = meta->row * meta->col;
+	return images;
+}
+
+// mnist.labels, or a uint8 idx of rank 1 : returns the data and the number
+static const uint8_t *
+dataset_labels_arg(lua_State *L, int index, uint64_t *n) {
+	if (luaL_testudata(L, index, "MNIST_IDX")) {
+		struct idx_meta *m = idx_check(L, index);
+		if (m->type != IDX_UINT8 || m->rank != 1)
+			luaL_error(L, "Labels idx must be uint8 of rank 1 (%s, rank %d)", idx_type_name(m->type), m->rank);
+		*n = m->dims[0];
+		return (const uint8_t *)lua_touserdata(L, index);
+	}
+	const uint8_t *labels = (const uint8_t *)luaL_checkudata(L, index, "MNIST_LABELS");
+	*n = lua_rawlen(L, index);
+	return labels;
+}
+
+// mnist.dataset(images, labels [, seed]) : images and labels of mnist.load, or idx of mnist.idx
+static int
+new_dataset(lua_State *L) {
+	uint32_t n, stride;
+	uint64_t nlabels;
+	const uint8_t *images = dataset_images_arg(L, 1, &n, &stride);
+	const uint8_t *labels = dataset_labels_arg(L, 2, &nlabels);
+	lua_Integer seed = luaL_optinteger(L, 3, 0);
+	lua_settop(L, 2);
+	if (n != nlabels)
+		return luaL_error(L, "Images (%I) and labels (%I) mismatch", (lua_Integer)n, (lua_Integer)nlabels);
+	struct dataset *d = (struct dataset *)lua_newuserdatauv(L, sizeof(*d) + (n ? n - 1 : 0) * sizeof(uint32_t), 4);
+	d->n = n;
+	d->stride = stride;
+	d->rng = (uint64_t)seed;
+	d->images = images;
+	d->labels = labels;
+	uint32_t i;
+	for (i=0;i<d->n;i++) {
+		d->index[i] = i;
+	}
+	if (luaL_newmetatable(L, "MNIST_DATASET")) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_Reg l[] = {
+			{ "shuffle", dataset_shuffle },
+			{ "sample", dataset_sample },
+			{ "shard", dataset_shard },
+			{ "batch", dataset_batch },
+			{ "images", dataset_images },
+			{ "labels", dataset_labels },
+			{ "__len", dataset_len },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1);
+	lua_pushvalue(L, 2);
+	lua_setiuservalue(L, -2, 2);
+	lua_replace(L, 1);	// dataset at 1
+	new_samples(L, d, 0);
+	lua_setiuservalue(L, 1, 3);
+	new_samples(L, d, 1);
+	lua_setiuservalue(L, 1, 4);
+	lua_settop(L, 1);
+	return 1;
+}
+
+// Synthetic MNIST : each label is a few strokes (the same for any seed), a sample moves its strokes
+// by up to 3 pixels, scales the intensity and adds noise. Deterministic for a seed, no download needed.
+
+#define SYNTHETIC_SHIFT 3
+#define SYNTHETIC_STROKES 3
+
+static void
+synthetic_templates(uint8_t *t, int row, int col) {
+	uint64_t rng = 0x4d4e495354ULL;
+	int label, i, k;
+	memset(t, 0, 10 * row * col);
+	for (label=0;label<10;label++) {
+		uint8_t *img = t + label * row * col;
+		for (i=0;i<SYNTHETIC_STROKES;i++) {
+			// a line segment inside the center box
+			int margin = SYNTHETIC_SHIFT + 1;
+			int x0 = margin + splitmix64(&rng) % (col - 2 * margin);
+			int y0 = margin + splitmix64(&rng) % (row - 2 * margin);
+			int x1 = margin + splitmix64(&rng) % (col - 2 * margin);
+			int y1 = margin + splitmix64(&rng) % (row - 2 * margin);
+			for (k=0;k<=64;k++) {
+				int x = x0 + (x1 - x0) * k / 64;
+				int y = y0 + (y1 - y0) * k / 64;
+				img[y * col + x] = 255;
+				img[y * col + x + 1] = 255;
+				img[(y + 1) * col + x] = 255;
+			}
+		}
+	}
+}
+
+static void
+write_uint32(FILE *f, uint32_t v) {
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	fwrite(b, 1, 4, f);
+}
+
+// mnist.synthetic(images_filename, labels_filename, n [, seed [, row, col]]) : write IDX files
+static int
+gen_synthetic(lua_State *L) {
+	const char * images_filename = luaL_checkstring(L, 1);
+	const char * labels_filename = luaL_checkstring(L, 2);
+	lua_Integer n = luaL_checkinteger(L, 3);
+	uint64_t rng = (uint64_t)luaL_optinteger(L, 4, 0);
+	int row = luaL_optinteger(L, 5, 28);
+	int col = luaL_optinteger(L, 6, 28);
+	if (n <= 0 || n > UINT32_MAX)
+		return luaL_error(L, "Invalid number %I", n);
+	if (row < 4 * SYNTHETIC_SHIFT || col < 4 * SYNTHETIC_SHIFT)
+		return luaL_error(L, "Invalid size %d x %d", row, col);
+	size_t stride = (size_t)row * col;
+	uint8_t *buffer = (uint8_t *)lua_newuserdatauv(L, stride * 11, 0);
+	uint8_t *templates = buffer + stride;
+	synthetic_templates(templates, row, col);
+	FILE *images = fopen(images_filename, "wb");
+	if (images == NULL)
+		return luaL_error(L, "Can't write %s", images_filename);
+	FILE *labels = fopen(labels_filename, "wb");
+	if (labels == NULL) {
+		fclose(images);
+		return luaL_error(L, "Can't write %s", labels_filename);
+	}
+	write_uint32(images, 2051);
+	write_uint32(images, (uint32_t)n);
+	write_uint32(images, row);
+	write_uint32(images, col);
+	write_uint32(labels, 2049);
+	write_uint32(labels, (uint32_t)n);
+	lua_Integer i;
+	int x, y;
+	for (i=0;i<n;i++) {
+		uint64_t r = splitmix64(&rng);
+		uint8_t label = r % 10;
+		int dx = (int)((r >> 8) % (2 * SYNTHETIC_SHIFT + 1)) - SYNTHETIC_SHIFT;
+		int dy = (int)((r >> 16) % (2 * SYNTHETIC_SHIFT + 1)) - SYNTHETIC_SHIFT;
+		int scale = 160 + (int)((r >> 24) % 96);
+		const uint8_t *t = templates + label * stride;
+		for (y=0;y<row;y++) {
+			for (x=0;x<col;x++) {
+				int sx = x - dx, sy = y - dy;
+				int v = 0;
+				if (sx >= 0 && sx < col && sy >= 0 && sy < row)
+					v = t[sy * col + sx] * scale / 255;
+				if (((x + y) & 7) == 0) {
+					r = splitmix64(&rng);
+				}
+				v += (r >> (((x + y) & 7) * 8)) & 31;
+				buffer[y * col + x] = v > 255 ? 255 : v;
+			}
+		}
+		fwrite(buffer, 1, stride, images);
+		fwrite(&label, 1, 1, labels);
+	}
+	int err = ferror(images) || ferror(labels);
+	err |= fclose(images) != 0;
+	err |= fclose(labels) != 0;
+	if (err)
+		return luaL_error(L, "Write %s / %s failed", images_filename, labels_filename);
+	return 0;
+}
+
 static int
 gen_pgm(lua_State *L) {
 	size_t sz = 0;
@@ -162,7 +876,11 @@ luaopen_mnist(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "labels", read_labels },
 		{ "images", read_images },
+		{ "load", load_dataset },
+		{ "dataset", new_dataset },
+		{ "idx", read_idx },
 		{ "pgm", gen_pgm },
+		{ "synthetic", gen_synthetic },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
@@ -1,123 +1,172 @@
 local mnist = require "mnist"
 local ann = require "ann"
 
-local labels = mnist.labels "data/train-labels.idx1-ubyte"
-local images = mnist.images "data/train-images.idx3-ubyte"
+-- ANN_DATA=dir reads the mnist files from dir (default data/), ANN_EPOCHS=n trains n epochs (default 30). see bench.lua
+local DATA = os.getenv "ANN_DATA" or "data"
+local EPOCHS = tonumber(os.getenv "ANN_EPOCHS") or 30
+-- ANN_RANK=r factorizes weight_ih (input x hidden) into rank r, see ann.lowrank
+local RANK = tonumber(os.getenv "ANN_RANK")
+-- ANN_PRUNE=sparsity (e.g. 0.9) prunes weight_ih after training, and tests the sparse model, see weight:prune
+local PRUNE = tonumber(os.getenv "ANN_PRUNE")
+local images, labels = mnist.load(DATA .. "/train-images.idx3-ubyte", DATA .. "/train-labels.idx1-ubyte")
+
+-- lua network.lua [model.lua|-] [rank/nproc]
+-- Data parallel training : start nproc processes of the same command line with rank 0 .. nproc-1,
+-- each trains on its shard and the gradients are summed through shared memory (ann.allreduce).
+-- ANN_RUN=token (the same for the processes of a run) keeps them off a segment left by another run.
+local save = arg and arg[1] ~= "-" and arg[1]
+local rank, nproc = 0, 1
+if arg and arg[2] then
+	rank, nproc = arg[2]:match "(%d+)/(%d+)"
+	rank, nproc = assert(tonumber(rank)), assert(tonumber(nproc))
+end
 
 local network = {}	; network.__index = network
 
 function network.new(args)
+	local weight_ih
+	if args.lowrank then
+		weight_ih = ann.lowrank(args.input, args.hidden, args.lowrank):randn()
+	else
+		weight_ih = ann.weight(args.input, args.hidden):randn()
+	end
 	local n = {
 		input = ann.signal(args.input),
 		hidden = ann.signal(args.hidden),
 		output = ann.signal(args.output),
-		weight_ih = ann.weight(args.input, args.hidden):randn(),
+		weight_ih = weight_ih,
 		weight_ho = ann.weight(args.hidden, args.output):randn(),
 		bias_hidden = ann.signal(args.hidden):randn(),
 		bias_output = ann.signal(args.output):randn(),
 	}
+	n.params = ann.params {
+		n.weight_ih,
+		n.weight_ho,
+		n.bias_hidden,
+		n.bias_output,
+	}
+	if args.nproc > 1 then
+		n.comm = ann.allreduce("/ann.allreduce", args.rank, args.nproc, n.params, tonumber(os.getenv "ANN_RUN"))
+		-- start from the weights of rank 0
+		n.comm:broadcast(n.params)
+	end
 
 	return setmetatable(n, network)
 end
 
-function network:feedforward(image)
-	self.input:init(image)
+-- image is a string, or the view of ds:images() and an index
+function network:feedforward(image, i)
+	self.input:init(image, i)
 	ann.prop(self.input, self.hidden, self.weight_ih)
 	self.hidden:accumulate(self.bias_hidden):sigmoid()
 	ann.prop(self.hidden, self.output, self.weight_ho)
 	return self.output:accumulate(self.bias_output)
 end
 
-local function shffule_training_data(t)
-	local n = #t
-	for i = 1, n - 1 do
-		local r = math.random(i, n)
-		t[i] , t[r] = t[r], t[i]
-	end
-end
-
-function network:train(training_data, batch_size, eta)
-	shffule_training_data(training_data)
-
-	local eta_ = - eta / batch_size
-	local dw_ih = ann.weight(self.weight_ih:size())
-	local dw_ih_s = ann.weight(self.weight_ih:size())
-	local dw_ho = ann.weight(self.weight_ho:size())
-	local dw_ho_s = ann.weight(self.weight_ho:size())
-	local db_output_s = ann.signal(self.output:size())
-	local db_hidden = ann.signal(self.hidden:size())
-	local db_hidden_s = ann.signal(self.hidden:size())
-
-	local db_output
-
-	local function backprop(expect)
+-- record the steps of a sample once, then tape:batch() replays them in C
+function network:record(images, i)
+	-- gradient of one sample, and the sum of a batch. (views of dw_ih, dw_ho, db_hidden, db_output)
+	local grad = self.params:clone()
+	local grad_s = self.params:clone()
+	local delta = { grad:views() }
+	local delta_s = { grad_s:views() }
+	self.grad_s = grad_s
+	self.expect = ann.signal(self.output:size())
+
+	local function backprop(delta)
+		local dw_ih, dw_ho, db_hidden, db_output = delta[1], delta[2], delta[3], delta[4]
 		-- calc error
-		ann.softmax_error(self.output, expect, db_output)
+		ann.softmax_error(self.output, self.expect, db_output)
 		-- backprop from output to hidden
 		ann.backprop_weight(self.hidden, db_output, dw_ho)
 		ann.backprop_bias(db_hidden, db_output, self.weight_ho)
 		ann.backprop_sigmoid(self.hidden, db_hidden)
 		-- backprop from hidden to input
-		ann.backprop_weight(self.input, db_hidden, dw_ih)
+		if RANK then
+			ann.backprop_lowrank(self.weight_ih, self.input, db_hidden, dw_ih)
+		else
+			ann.backprop_weight(self.input, db_hidden, dw_ih)
+		end
 	end
 
-	for i = 1, #training_data, batch_size do
-		self:feedforward(training_data[i].image)
-		db_output = db_output_s
-		backprop(training_data[i].expect)
-		db_output = self.output
-		db_hidden_s, db_hidden = db_hidden, db_hidden_s
-		dw_ih_s, dw_ih = dw_ih, dw_ih_s
-		dw_ho_s, dw_ho = dw_ho, dw_ho_s
-
-		for j = 1, batch_size-1 do
-			local image = training_data[i+j]
-			if image then
-				self:feedforward(image.image)
-				backprop(training_data[i+j].expect)
-				dw_ih_s:accumulate(dw_ih)
-				dw_ho_s:accumulate(dw_ho)
-				db_output_s:accumulate(db_output)
-				db_hidden_s:accumulate(db_hidden)
-			else
-				eta_ = - eta / j
-				break
-			end
+	-- the first sample of a batch writes into the sum directly
+	self.tape_first = ann.record(function()
+		self:feedforward(images, i)
+		backprop(delta_s)
+	end)
+	self.tape = ann.record(function()
+		self:feedforward(images, i)
+		backprop(delta)
+		grad_s:accumulate(grad)
+	end)
+end
+
+-- training_data is a mnist.dataset
+function network:train(training_data, batch_size, eta)
+	training_data:shuffle()
+	if not self.tape then
+		self:record(training_data:images(), 1)
+		-- ANN_AUTOTUNE=1 measures the kernels for the shapes of this model, see ann.autotune
+		if os.getenv "ANN_AUTOTUNE" then
+			ann.autotune { self.tape_first, self.tape }
 		end
+	end
 
-		self.weight_ih:accumulate(dw_ih_s, eta_)
-		self.weight_ho:accumulate(dw_ho_s, eta_)
-		self.bias_hidden:accumulate(db_hidden_s, eta_)
-		self.bias_output:accumulate(db_output_s, eta_)
+	local images, labels = training_data:images(), training_data:labels()
+	local input, expect = self.input, self.expect
+	for i = 1, #training_data, batch_size do
+		local n = self.tape_first:batch(i, i, input, images, expect, labels)
+			+ self.tape:batch(i + 1, i + batch_size - 1, input, images, expect, labels)
+
+		if self.comm then
+			-- every process runs the same number of batches, the average of the gradients
+			self.comm:reduce(self.grad_s, 1 / nproc)
+		end
+		self.params:accumulate(self.grad_s, - eta / n)
 	end
 end
 
-local function gen_training_data()
-	local result = {}
-	for i = 0, 9 do
-		result[i] = ann.signal(10):init(i)
+function network:save(filename)
+	local f = assert(io.open(filename, "wb"))
+	local function array(t)
+		local tmp = {}
+		for i, v in ipairs(t) do
+			tmp[i] = string.format("%.9g", v)
+		end
+		return "{" .. table.concat(tmp, ",") .. "}"
 	end
-	local training = {}
-	for i = 1, #images do
-		training[i] = {
-			image = images[i],
-			expect = result[labels[i] ],
-			value = labels[i],
-		}
+	local function matrix(w)
+		local tmp = {}
+		for i, row in ipairs(w:export()) do
+			tmp[i] = array(row)
+		end
+		return "{\n" .. table.concat(tmp, ",\n") .. "}"
 	end
-	return training
+	-- a lowrank weight_ih exports the expanded rows
+	local input, hidden = self.weight_ih:size()
+	local _, output = self.weight_ho:size()
+	f:write(string.format("return {\ninput = %d,\nhidden = %d,\noutput = %d,\n", input, hidden, output))
+	f:write("weight_ih = ", matrix(self.weight_ih), ",\n")
+	f:write("weight_ho = ", matrix(self.weight_ho), ",\n")
+	f:write("bias_hidden = ", array(self.bias_hidden:toarray()), ",\n")
+	f:write("bias_output = ", array(self.bias_output:toarray()), ",\n")
+	f:write("}\n")
+	f:close()
 end
 
 local n = network.new {
 	input = images.row * images.col,
 	hidden = 30,
 	output = 10,
+	lowrank = RANK,
+	rank = rank,
+	nproc = nproc,
 }
 
-local data = gen_training_data()
+-- the shard of this process, all the shards are the same size
+local data = mnist.dataset(images, labels, os.time() + rank):shard(rank, nproc)
 
-local labels = mnist.labels "data/t10k-labels.idx1-ubyte"
-local images = mnist.images "data/t10k-images.idx3-ubyte"
+local images, labels = mnist.load(DATA .. "/t10k-images.idx3-ubyte", DATA .. "/t10k-labels.idx1-ubyte")
 
 local function test()
 	local s = 0
@@ -131,7 +180,31 @@ local function test()
 	return (s / #labels * 100) .."%"
 end
 
-for i = 1, 30 do
+for i = 1, EPOCHS do
+	local t0 = ann.clock()
 	n:train(data,20,3.0)
-	print("Epoch", i, test())
+	local t1 = ann.clock()
+	if rank == 0 then
+		local err = test()
+		local t2 = ann.clock()
+		-- all the processes train the same number of samples
+		print(string.format("Epoch %d %s train %.0f images/s test %.0f images/s epoch %.3fs",
+			i, err, #data * nproc / (t1 - t0), #labels / (t2 - t1), t2 - t0))
+	end
+end
+if PRUNE and rank == 0 then
+	local threshold, zero = n.weight_ih:prune(PRUNE)
+	n.weight_ih = ann.sparse(n.weight_ih)
+	local t0 = ann.clock()
+	local err = test()
+	local t1 = ann.clock()
+	print(string.format("Pruned %d weights (|w| <= %g) %s test %.0f images/s", zero, threshold, err, #labels / (t1 - t0)))
+end
+if rank == 0 then
+	print("Peak RSS", ann.peakrss() .. " KB")
+end
+
+-- lua network.lua model.lua : save the model for serve.lua
+if save and rank == 0 then
+	n:save(save)
 end
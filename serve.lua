@@ -0,0 +1,56 @@
+-- lua serve.lua [model.lua] [socket path]
+-- model.lua is saved by `lua network.lua model.lua`
+
+local ann = require "ann"
+
+local model = arg[1] and dofile(arg[1])
+local path = arg[2] or "/tmp/ann.sock"
+
+local input, hidden, output = 28 * 28, 30, 10
+
+local n = {
+	weight_ih = ann.weight(input, hidden):randn(),
+	weight_ho = ann.weight(hidden, output):randn(),
+	bias_hidden = ann.signal(hidden):randn(),
+	bias_output = ann.signal(output):randn(),
+}
+
+if model then
+	n.weight_ih = ann.weight(model.input, model.hidden)
+	n.weight_ih:import(model.weight_ih)
+	n.weight_ho = ann.weight(model.hidden, model.output)
+	n.weight_ho:import(model.weight_ho)
+	n.bias_hidden = ann.signal(model.hidden):init(model.bias_hidden)
+	n.bias_output = ann.signal(model.output):init(model.bias_output)
+else
+	print "No model, serve random weights"
+end
+
+-- ANN_PRUNE=sparsity serves a pruned (sparse) weight_ih
+local PRUNE = tonumber(os.getenv "ANN_PRUNE")
+if PRUNE then
+	local _, zero = n.weight_ih:prune(PRUNE)
+	n.weight_ih = ann.sparse(n.weight_ih)
+	print("Pruned", zero)
+end
+
+local server = ann.serve {
+	path = path,
+	weight_ih = n.weight_ih,
+	bias_hidden = n.bias_hidden,
+	weight_ho = n.weight_ho,
+	bias_output = n.bias_output,
+	batch = 32,
+	deadline = 1,	-- ms
+	threads = 4,
+}
+
+print("Listen", path)
+
+while true do
+	local s = server:stats(1)
+	if s.requests > 0 then
+		print(string.format("%.0f req/s\tbatch %.1f\tp50 %.3fms\tp99 %.3fms\tconnections %d",
+			s.throughput, s.batch_size, s.p50, s.p99, s.connections))
+	end
+end
@@ -0,0 +1,76 @@
+local mnist = require "mnist"
+
+-- Write IDX files of each type, then read them back with mnist.idx, plain and gzip compressed
+
+local dir = os.getenv "TMPDIR" or "/tmp"
+
+local types = {
+	uint8 = { 0x08, "B" },
+	int8 = { 0x09, "b" },
+	int16 = { 0x0B, "i2" },
+	int32 = { 0x0C, "i4" },
+	float32 = { 0x0D, "f" },
+	float64 = { 0x0E, "d" },
+}
+
+local files = {
+	{ "uint8", { 5 }, { 0, 1, 127, 128, 255 } },
+	{ "int8", { 4 }, { -128, -1, 0, 127 } },
+	{ "int16", { 4 }, { -32768, -3, 1234, 32767 } },
+	{ "int32", { 3 }, { -2147483648, 65536, 2147483647 } },
+	{ "float32", { 3 }, { 0.5, -0.25, 1024 } },
+	{ "float64", { 3 }, { 1.5, -2.25, 1e100 } },
+	{ "uint8", { 2, 2, 3 }, { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 } },
+	{ "int32", { 3, 2 }, { 1, -1, 2, -2, 3, -3 } },
+}
+
+local function write_idx(filename, type, dims, values)
+	local code, fmt = table.unpack(types[type])
+	local f = assert(io.open(filename, "wb"))
+	f:write(string.pack(">BBBB", 0, 0, code, #dims))
+	for _, d in ipairs(dims) do
+		f:write(string.pack(">I4", d))
+	end
+	for _, v in ipairs(values) do
+		f:write(string.pack(">" .. fmt, v))
+	end
+	f:close()
+end
+
+local function check(t, type, dims, values, what)
+	local _, fmt = table.unpack(types[type])
+	assert(t.type == type, what)
+	assert(t.rank == #dims and #t == dims[1], what)
+	local stride = string.packsize(fmt)
+	for i = #dims, 1, -1 do
+		assert(t.dims[i] == dims[i], what)
+		assert(t.strides[i] == stride, what)
+		stride = stride * dims[i]
+	end
+	local per = #values // dims[1]
+	for i = 1, dims[1] do
+		if #dims == 1 then
+			assert(t[i] == values[i], what .. " [" .. i .. "]")
+		else
+			-- the bytes of an item, in host byte order
+			local item = { string.unpack("=" .. string.rep(fmt, per), t[i]) }
+			for j = 1, per do
+				assert(item[j] == values[(i - 1) * per + j], what .. " [" .. i .. "][" .. j .. "]")
+			end
+		end
+	end
+end
+
+for i, v in ipairs(files) do
+	local type, dims, values = table.unpack(v)
+	local filename = dir .. "/testidx" .. i .. ".idx"
+	write_idx(filename, type, dims, values)
+	check(mnist.idx(filename), type, dims, values, filename)
+	assert(os.execute("gzip -f " .. filename))
+	check(mnist.idx(filename .. ".gz"), type, dims, values, filename .. ".gz")
+	-- the plain name falls back to name.gz
+	check(mnist.idx(filename), type, dims, values, filename .. " (.gz)")
+	os.remove(filename .. ".gz")
+end
+
+print "ok"
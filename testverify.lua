@@ -0,0 +1,65 @@
+local ann = require "ann"
+
+-- The filter ops of the simd and threaded backends against the reference (ann.backend(name, true)),
+-- on odd geometries : size, w, h, n, pooling, channel, stride, pad, pool_stride
+local shapes = {
+	{ 3, 29, 27, 3, 3, 2, 1, 1, 2 },	-- padded, 2 channels, overlapped pooling
+	{ 3, 28, 28, 4, 2, 1, 2, 1, 2 },	-- stride 2
+	{ 5, 31, 29, 2, 2, 3, 2, 2, 1 },	-- stride 2, pad 2, 3 channels, pooling stride 1
+	{ 7, 31, 30, 2, 3, 1, 3, 3, 3 },
+	{ 3, 27, 25, 2, 2, 1, 1, 0, 3 },	-- gaps between the pooling windows
+	{ 5, 28, 28, 4, 2, 1, 1, 0, 2 },	-- the specialized 5x5 kernel
+	{ 3, 100, 90, 2, 3, 1, 1, 0, 2 },	-- a plane larger than the stack buffer
+}
+
+-- the argmax weight gradient sums the windows in another order, the others are the same code or order
+local tolerance = { backprop_conv_weight_argmax = 1e-3 }
+
+local function run(shape)
+	local f = ann.convpool_filter(table.unpack(shape)):randn()
+	local grad = f:clone()
+	local args = f:args()
+	local input = ann.signal(args.w * args.h * args.channel):randn()
+	local conv = ann.signal(args.conv_size)
+	local output = ann.signal(args.output_size)
+	local delta = ann.signal(args.output_size):randn()
+	local dconv = ann.signal(args.conv_size)
+	local dinput = ann.signal(args.w * args.h * args.channel)
+	local argmax = f:argmax()
+
+	f:convolution(input, conv)
+	f:maxpooling(conv, output)
+	f:maxpooling(conv, output, argmax)
+	f:convpool(input, output)
+	f:convpool(input, output, argmax)
+
+	grad:backprop_conv_bias(delta)
+	grad:backprop_conv_weight(input, delta, argmax)
+	grad:backprop_maxpooling(dconv, delta, argmax)
+	grad:backprop_conv_weight(input, dconv)
+	grad:backprop_maxpooling(conv, delta)
+	f:backprop_conv_input(dconv, dinput)
+end
+
+ann.threads(4, 0)	-- every kernel on the pool
+
+for _, name in ipairs { "simd", "threaded" } do
+	ann.backend(name, true)
+	ann.verify(true)
+	for _, shape in ipairs(shapes) do
+		run(shape)
+	end
+	for op, v in pairs(ann.verify()) do
+		print(name, op, v.calls, v.ulp, v.rel)
+		local tol = tolerance[op]
+		if tol then
+			assert(v.rel < tol, op)
+		else
+			assert(v.ulp == 0, op)
+		end
+	end
+end
+
+ann.backend "threaded"
+ann.threads(1)
+print "ok"
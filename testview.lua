@@ -0,0 +1,30 @@
+local ann = require "ann"
+
+-- randn of an odd length view must not write into the floats after it
+
+local function unchanged(t, from, to, what)
+	for i = from, to do
+		assert(t[i] == 0, what .. " [" .. i .. "] = " .. t[i])
+	end
+end
+
+local s = ann.signal(10)
+s:slice(3, 7):randn()
+local t = s:toarray()
+unchanged(t, 1, 2, "signal")
+unchanged(t, 8, 10, "signal")
+
+local w = ann.weight(5, 3):zero()
+w:row(2):randn()
+unchanged(w:row(1):toarray(), 1, 5, "row 1")
+unchanged(w:row(3):toarray(), 1, 5, "row 3")
+
+-- the tensors of a parameter group are adjacent when the size is a multiple of 16
+local a = ann.signal(16)
+local b = ann.signal(3)
+local params = ann.params { a, b }
+a:slice(12, 16):randn()
+unchanged(a:toarray(), 1, 11, "params a")
+unchanged(b:toarray(), 1, 3, "params b")
+
+print "ok"